@@ -0,0 +1,132 @@
+#!/bin/bash
+# Benchmark suite behind make bench, writes its measurements as one flat JSON object.
+# It generates two targets from bench_workload.c with THREADS threads, MUTEXES
+# mutexes, CONTENTION% of the lock/unlock pairs on the shared mutex and a 1 us
+# sleep after SLEEPS% of them: bench_workload with OPS pairs per thread for the
+# interposer overhead, and bench_sweep with SWEEP_OPS pairs for chesstool.
+# With BASELINE set to an earlier output, a measurement more than TOLERANCE%
+# worse than there fails the run.
+
+THREADS=${THREADS:-2}
+MUTEXES=${MUTEXES:-4}
+OPS=${OPS:-20000}
+CONTENTION=${CONTENTION:-50}
+SLEEPS=${SLEEPS:-0}
+SWEEP_OPS=${SWEEP_OPS:-20}
+HANDOFFS=${HANDOFFS:-100000}
+OUTPUT=${OUTPUT:-bench.json}
+BASELINE=${BASELINE:-}
+TOLERANCE=${TOLERANCE:-20}
+
+unset CHESS_VIRTUAL_TIME CHESS_FIBERS CHESS_SCHEDULE
+
+now() {
+	date +%s.%N
+}
+
+# Arithmetic on decimals
+calc() {
+	awk "BEGIN { print ($*) }"
+}
+
+# The number before text in the output of a command
+measure() {
+	local text=$1
+	shift
+	"$@" 2>/dev/null | sed -n "s/.*[ (]\([0-9.][0-9.]*\) $text.*/\1/p" | head -1
+}
+
+# Schedules per second chesstool reports in its results file
+explore() {
+	rm -f .bench_results.json .chessjournal
+	./chesstool -o .bench_results.json "$@" ./bench_sweep >/dev/null 2>&1
+	sed -n 's/.*"schedules_per_second": \([0-9.][0-9.]*\).*/\1/p' .bench_results.json
+	rm -f .bench_results.json .chessjournal bench_sweep.*.replay
+}
+
+parameters="-DTHREADS=$THREADS -DMUTEXES=$MUTEXES -DCONTENTION=$CONTENTION -DSLEEPS=$SLEEPS"
+gcc -O2 -o bench_workload $parameters -DOPS=$OPS bench_workload.c -lpthread -lrt || exit 1
+gcc -O2 -o bench_sweep $parameters -DOPS=$SWEEP_OPS bench_workload.c -lpthread -lrt || exit 1
+
+# Interposer overhead: the same workload natively, under chess.so without a
+# schedule, and with fibers. Every pair is two synchronization points. chess.so
+# runs one thread at a time, so the overhead is taken against a native run of
+# one thread, which never contends; the threads natively contend on the shared
+# mutex and can take longer per pair than under chess.so.
+native=$(measure "ns per lock" ./bench_workload)
+serial=$(measure "ns per lock" ./bench_workload 1 $MUTEXES $OPS $CONTENTION $SLEEPS)
+interposed=$(CHESS_SCHEDULE= measure "ns per lock" ./run.sh ./bench_workload)
+fibers=$(CHESS_SCHEDULE= CHESS_FIBERS=1 measure "ns per lock" ./run.sh ./bench_workload)
+
+handoff=$(CHESS_SCHEDULE= measure "ns per handoff" ./run.sh ./bench_handoff $HANDOFFS)
+fiber_handoff=$(CHESS_SCHEDULE= CHESS_FIBERS=1 measure "ns per handoff" ./run.sh ./bench_handoff $HANDOFFS)
+
+# Discovery pass: the first execution of bench_sweep, which counts its
+# synchronization points
+echo 0/0 > .tracksyncpts
+start=$(now)
+CHESS_VIRTUAL_TIME=1 ./run.sh ./bench_sweep >/dev/null 2>&1
+discovery=$(calc "$(now) - $start")
+sync_pts=$(cut -d/ -f2 .tracksyncpts)
+
+# End to end: chesstool sweeps bench_sweep from the start, with fork servers
+# and from checkpoints
+schedules=$(explore)
+fork_server=$(explore -f)
+checkpoint=$(explore --checkpoint)
+echo 0/0 > .tracksyncpts
+
+overhead=$(calc "(${interposed:-0} - ${serial:-0}) / 2")
+fiber_overhead=$(calc "(${fibers:-0} - ${serial:-0}) / 2")
+
+cat > "$OUTPUT" <<EOF
+{
+  "threads": $THREADS,
+  "mutexes": $MUTEXES,
+  "ops": $OPS,
+  "contention": $CONTENTION,
+  "sleeps": $SLEEPS,
+  "sweep_ops": $SWEEP_OPS,
+  "sync_pts": ${sync_pts:-0},
+  "native_ns_per_op": ${native:-0},
+  "native_serial_ns_per_op": ${serial:-0},
+  "chess_ns_per_op": ${interposed:-0},
+  "fiber_ns_per_op": ${fibers:-0},
+  "overhead_ns_per_sync_pt": $(printf "%.1f" $overhead),
+  "fiber_overhead_ns_per_sync_pt": $(printf "%.1f" $fiber_overhead),
+  "handoff_ns": ${handoff:-0},
+  "fiber_handoff_ns": ${fiber_handoff:-0},
+  "discovery_seconds": $(printf "%.6f" $discovery),
+  "schedules_per_second": ${schedules:-0},
+  "fork_server_schedules_per_second": ${fork_server:-0},
+  "checkpoint_schedules_per_second": ${checkpoint:-0}
+}
+EOF
+cat "$OUTPUT"
+
+if [ -z "$BASELINE" ]; then
+	exit 0
+fi
+
+value() {
+	sed -n "s/.*\"$1\": \([0-9.-][0-9.]*\).*/\1/p" "$2"
+}
+
+# Times may grow and rates may drop by TOLERANCE% before it counts as a regression
+status=0
+for key in chess_ns_per_op fiber_ns_per_op handoff_ns fiber_handoff_ns discovery_seconds schedules_per_second fork_server_schedules_per_second checkpoint_schedules_per_second; do
+	old=$(value $key "$BASELINE")
+	new=$(value $key "$OUTPUT")
+	if [ -z "$old" ] || [ -z "$new" ]; then
+		continue
+	fi
+	case $key in
+		*per_second) worse=$(calc "$new < $old * (100 - $TOLERANCE) / 100") ;;
+		*) worse=$(calc "$new > $old * (100 + $TOLERANCE) / 100") ;;
+	esac
+	if [ "$worse" = 1 ]; then
+		echo "REGRESSION: $key went from $old to $new" >&2
+		status=1
+	fi
+done
+exit $status
@@ -0,0 +1,55 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+// Handoff microbenchmark: two threads hand control back and forth with
+// sched_yield(). Run under chess.so (./run.sh bench_handoff [iterations]),
+// every yield is one scheduler handoff.
+
+static int iterations = 100000;
+
+void* yielder(void* arg)
+{
+    int i;
+    for (i = 0; i < iterations; i++)
+        sched_yield();
+    return NULL;
+}
+
+static double seconds(struct timeval tv)
+{
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1)
+        iterations = atoi(argv[1]);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, yielder, NULL);
+    yielder(0);
+    pthread_join(thread, NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    double wall = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    double cpu = seconds(usage.ru_utime) + seconds(usage.ru_stime);
+    long handoffs = 2L * iterations;
+
+    printf("handoffs: %ld\n", handoffs);
+    printf("wall time: %.3f s (%.0f ns per handoff)\n", wall, wall * 1e9 / handoffs);
+    printf("cpu time: %.3f s (%.0f ns per handoff, %.2f cores busy)\n", cpu, cpu * 1e9 / handoffs, cpu / wall);
+
+    return 0;
+}
@@ -0,0 +1,59 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Lock overhead microbenchmark: N threads each lock and unlock a pool of
+// mutexes. Run natively and under chess.so with an empty schedule
+// (CHESS_SCHEDULE= ./run.sh bench_locks [threads] [iterations]), the
+// difference is the per-lock cost of the scheduler.
+
+#define MUTEXES 256
+
+static pthread_mutex_t mutexes[MUTEXES];
+static int iterations = 20000;
+
+void* locker(void* arg)
+{
+    long id = (long)arg;
+    int i;
+    for (i = 0; i < iterations; i++) {
+        pthread_mutex_t *mutex = &mutexes[(id * 7 + i) % MUTEXES];
+        pthread_mutex_lock(mutex);
+        pthread_mutex_unlock(mutex);
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int threads = 2;
+    if (argc > 1)
+        threads = atoi(argv[1]);
+    if (argc > 2)
+        iterations = atoi(argv[2]);
+
+    int i;
+    for (i = 0; i < MUTEXES; i++)
+        pthread_mutex_init(&mutexes[i], NULL);
+
+    pthread_t *thread = malloc(threads * sizeof(pthread_t));
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (i = 0; i < threads; i++)
+        pthread_create(&thread[i], NULL, locker, (void*)(long)i);
+    for (i = 0; i < threads; i++)
+        pthread_join(thread[i], NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double wall = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    long locks = (long)threads * iterations;
+
+    printf("threads: %d, locks: %ld, %.0f ns per lock/unlock\n", threads, locks, wall * 1e9 / locks);
+
+    free(thread);
+    return 0;
+}
@@ -0,0 +1,106 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+// Synthetic workload for make bench: T threads each do K lock/unlock pairs on
+// M mutexes. With probability contention% an operation takes the one mutex all
+// threads share, otherwise a mutex of its own thread's share of the pool. After
+// an operation the thread sleeps for 1 us with probability sleeps%. The choices
+// come from a generator seeded by the thread number, so every run is the same
+// program for chesstool. chesstool passes no arguments, so bench.sh builds the
+// targets it measures with their parameters as defaults (-DOPS=20 ...).
+// ./bench_workload [threads] [mutexes] [ops] [contention%] [sleeps%]
+
+#ifndef THREADS
+#define THREADS 2
+#endif
+#ifndef MUTEXES
+#define MUTEXES 4
+#endif
+#ifndef OPS
+#define OPS 20000
+#endif
+#ifndef CONTENTION
+#define CONTENTION 50
+#endif
+#ifndef SLEEPS
+#define SLEEPS 0
+#endif
+
+static pthread_mutex_t *mutexes;
+static int threads = THREADS;
+static int mutex_count = MUTEXES;
+static int ops = OPS;
+static int contention = CONTENTION;
+static int sleeps = SLEEPS;
+
+static unsigned int next_random(unsigned int *state)
+{
+    *state = *state * 1103515245 + 12345;
+    return (*state >> 16) % 100;
+}
+
+void* worker(void* arg)
+{
+    long id = (long)arg;
+    unsigned int state = id + 1;
+    int i;
+    for (i = 0; i < ops; i++) {
+        pthread_mutex_t *mutex = &mutexes[0];
+        if (mutex_count > 1 && (int)next_random(&state) >= contention)
+            mutex = &mutexes[1 + (id + (long)threads * i) % (mutex_count - 1)];
+        pthread_mutex_lock(mutex);
+        pthread_mutex_unlock(mutex);
+        if (sleeps > 0 && (int)next_random(&state) < sleeps)
+            usleep(1);
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1)
+        threads = atoi(argv[1]);
+    if (argc > 2)
+        mutex_count = atoi(argv[2]);
+    if (argc > 3)
+        ops = atoi(argv[3]);
+    if (argc > 4)
+        contention = atoi(argv[4]);
+    if (argc > 5)
+        sleeps = atoi(argv[5]);
+    if (threads < 1 || mutex_count < 1 || ops < 0) {
+        fprintf(stderr, "Usage: ./bench_workload [threads] [mutexes] [ops] [contention%%] [sleeps%%]\n");
+        return 1;
+    }
+
+    int i;
+    mutexes = malloc(mutex_count * sizeof(pthread_mutex_t));
+    for (i = 0; i < mutex_count; i++)
+        pthread_mutex_init(&mutexes[i], NULL);
+
+    pthread_t *thread = malloc(threads * sizeof(pthread_t));
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // The main thread is worker 0
+    for (i = 1; i < threads; i++)
+        pthread_create(&thread[i], NULL, worker, (void*)(long)i);
+    worker(0);
+    for (i = 1; i < threads; i++)
+        pthread_join(thread[i], NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double wall = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    long locks = (long)threads * ops;
+
+    printf("threads: %d, mutexes: %d, locks: %ld, %.0f ns per lock/unlock\n", threads, mutex_count, locks, locks ? wall * 1e9 / locks : 0);
+
+    free(thread);
+    free(mutexes);
+    return 0;
+}
@@ -1,10 +1,33 @@
 #include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
 #include <sched.h>
 #include <dlfcn.h>
+#include <link.h>
 #include <stdio.h>
 #include <unistd.h>
-#include <map>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <poll.h>
+#include <linux/futex.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <semaphore.h>
+#include <malloc.h>
+#include <ucontext.h>
+#include <vector>
 #include <iostream>
 #include <fstream>
 #include <sstream>
@@ -12,6 +35,12 @@
 #define THREAD_RUNNING_NOT_WAITING_FOR_LOCK     111
 #define THREAD_RUNNING_WAITING_FOR_LOCK         222
 #define THREAD_TERMINATED                       333
+#define THREAD_WAITING_FOR_JOINEE               444
+#define THREAD_SLEEPING                         555
+#define THREAD_WAITING_FOR_CONDITION            666
+#define THREAD_WAITING_FOR_RWLOCK               777
+#define THREAD_WAITING_FOR_SEMAPHORE            888
+#define THREAD_WAITING_FOR_BARRIER              999
 
 #define CURRENT_MODE                            0
 #define DEBUG_MODE                              1
@@ -19,75 +48,786 @@
 #define CHESS_EXPLORE_MODE                      1
 #define EXPLORE_CHESS_SCHEDULES                 1
 
+// File descriptors chesstool drives the fork server with
+#define FORK_SERVER_CONTROL_FD                  198
+#define FORK_SERVER_STATUS_FD                   199
+
+// Exit status of an execution in which every live thread waits for another one
+#define DEADLOCK_EXIT_STATUS                    86
+// Exit status of an execution stopped in a state the state cache holds
+#define PRUNED_EXIT_STATUS                      87
+
+// Most preemptions a schedule from chesstool may contain
+#define MAX_PREEMPTIONS                         64
+// Thread of a preemption that is a priority change point of a PCT schedule
+#define PCT_CHANGE_POINT                        -2
+
+// Capacity of the preallocated thread arena and lookup tables, tables are powers of two
+#define MAX_THREADS                             1024
+#define TABLE_REMOVED                           ((void*)1)
+// Stack of a fiber unless the thread attributes give one, reserved but only
+// committed as it is used
+#define FIBER_STACK_SIZE                        (8 << 20)
+#define THREAD_TABLE_CAPACITY                   2048
+#define MUTEX_TABLE_CAPACITY                    16384
+// Condition variables, read-write locks, semaphores and barriers
+#define MAX_SYNC_OBJECTS                        4096
+#define OBJECT_TABLE_CAPACITY                   8192
+
+// Operations recorded in the trace for partial-order reduction
+#define EVENT_MUTEX_ACQUIRE                     'A'
+#define EVENT_MUTEX_RELEASE                     'R'
+#define EVENT_THREAD_CREATE                     'C'
+#define EVENT_SYNC_OBJECT                       'O'
+
+// Kinds of synchronization points recorded in decision files
+#define SYNC_PT_THREAD_START                    'S'
+#define SYNC_PT_MUTEX_LOCK                      'L'
+#define SYNC_PT_MUTEX_UNLOCK                    'U'
+#define SYNC_PT_SLEEP                           'T'
+#define SYNC_PT_COND_WAIT                       'W'
+#define SYNC_PT_COND_SIGNAL                     'N'
+#define SYNC_PT_RWLOCK_LOCK                     'R'
+#define SYNC_PT_RWLOCK_UNLOCK                   'Q'
+#define SYNC_PT_SEM_WAIT                        'P'
+#define SYNC_PT_SEM_POST                        'V'
+#define SYNC_PT_BARRIER                         'B'
+
+#define DECISION_FILE_MAGIC                     "CHESSDEC"
+#define DECISION_FILE_VERSION                   2
+// Decisions the record file is first sized for, it doubles when full
+#define DECISION_FILE_INITIAL_CAPACITY          4096
+
+// Events of the runtime tracer (CHESS_EVENT_TRACE)
+#define TRACE_EVENT_CREATE                      'C'
+#define TRACE_EVENT_JOIN                        'J'
+#define TRACE_EVENT_LOCK                        'L'
+#define TRACE_EVENT_UNLOCK                      'U'
+#define TRACE_EVENT_YIELD                       'Y'
+#define TRACE_EVENT_SWITCH                      'S'
+#define TRACE_EVENT_WAIT                        'W'
+#define TRACE_EVENT_SIGNAL                      'N'
+#define TRACE_EVENT_SEM_WAIT                    'P'
+#define TRACE_EVENT_SEM_POST                    'V'
+#define TRACE_EVENT_BARRIER                     'B'
+
+// Race detector (CHESS_RACE_DETECT): threads with a vector clock, synchronization
+// objects with a vector clock, and bits of a clock in an epoch (the rest is the thread)
+#define RACE_MAX_THREADS                        256
+#define RACE_MAX_CLOCKS                         16384
+#define RACE_CLOCK_BITS                         24
+#define RACE_REPORT_TABLE_CAPACITY              1024
+// Shadow memory covers the user address space in chunks of 1 MB, allocated on first use
+#define SHADOW_ADDRESS_BITS                     47
+#define SHADOW_CHUNK_SHIFT                      20
+
+// Call sites of the profile (CHESS_PROFILE), and pairs of a call site and an object it used
+#define MAX_PROFILE_SITES                       4096
+#define PROFILE_TABLE_CAPACITY                  8192
+#define PROFILE_OBJECT_TABLE_CAPACITY           65536
+
+#define MAX_FILTER_SITES                        1024
+#define FILTER_OBJECT_TABLE_CAPACITY            4096
+
+#define MAX_CHECKPOINT_JOBS                     256
+#define CHECKPOINT_POLL_MS                      10
+
+#define EVENT_FILE_MAGIC                        "CHESSEVT"
+#define EVENT_FILE_VERSION                      1
+
+#define STATE_CACHE_MAGIC                       "CHESSSTC"
+#define STATE_CACHE_VERSION                     1
+// Events kept per thread, a power of two, older events are overwritten
+#define EVENT_RING_CAPACITY                     8192
+
 using namespace std;
 
+struct Thread_State {
+  pthread_t thread;
+  int status;
+  // Futex word, set to 1 when the scheduler baton is handed to this thread
+  int baton;
+  // Program lock this thread waits for (THREAD_RUNNING_WAITING_FOR_LOCK)
+  pthread_mutex_t* mutex;
+  // Thread this thread waits for (THREAD_WAITING_FOR_JOINEE), NULL if not ours
+  struct Thread_State* joinee;
+  // Creation order, 0 is the main thread. The slot of a joined thread is taken
+  // by the next thread created, so an index is only unique among live threads.
+  int index;
+  // Joined: the slot is free for a new thread
+  bool reusable;
+  // Last synchronization point this thread passed
+  int sync_pt;
+  // Sleeping or in a timed wait: the scheduler may pick the thread at any time,
+  // which ends the wait and moves virtual time to deadline
+  bool timed;
+  long long deadline;
+  // Condition variable, read-write lock, semaphore or barrier this thread waits for
+  struct Sync_Object* object;
+  // Wait number on a condition variable, or barrier cycle the thread arrived in
+  long ticket;
+  // Waits for the write lock of a read-write lock
+  bool exclusive;
+  // State cache: synchronization points this thread passed, and the part of
+  // STATE_HASH that stands for this thread
+  int sync_pts;
+  unsigned long long state_hash;
+  // PCT: the ready thread with the highest priority runs
+  long long priority;
+  // Fiber mode (CHESS_FIBERS): the context the thread runs in, NULL for the
+  // main thread until it first switches
+  struct Fiber* fiber;
+};
+
+// Model of a condition variable, read-write lock, semaphore or barrier. The
+// program's own object is never waited on, only this model is.
+struct Sync_Object {
+  void* key;
+  // Condition variable: waits started so far, and pending signals. A signal can
+  // only be taken by a waiter with a ticket below signaled_below
+  long tickets;
+  long signaled_below;
+  long signals;
+  // Clock of its timed waits, CLOCK_REALTIME unless set in its attributes
+  clockid_t clock;
+  // Read-write lock: readers holding it, and the writer (thread index), -1 if none
+  long readers;
+  long writer;
+  // Semaphore value, valid once initialized
+  long value;
+  bool initialized;
+  // Barrier: threads it waits for, threads arrived in this cycle, completed cycles
+  long needed;
+  long arrived;
+  long cycle;
+};
+
+// Switch to thread (creation index) at synchronization point sync_pt
+// thread -1 selects the next runnable thread, PCT_CHANGE_POINT lowers the
+// priority of the running thread instead
+struct Preemption {
+  int sync_pt;
+  int thread;
+};
+
+// What chesstool writes to the fork server for every child, followed by count
+// preemptions. Same layout as in chesstool.
+struct Fork_Server_Request {
+  int count;
+  int reserved;
+  // PCT seed of the child
+  unsigned long long seed;
+};
+
+// What the fork server reports for every child, same layout as in chesstool
+struct Fork_Server_Result {
+  int status;
+  int reserved;
+  long long user_us;
+  long long sys_us;
+  long long max_rss_kb;
+};
+
+// What a checkpointing execution reports for every child it forks, once when the
+// child starts and once with its result. Same layout as in chesstool.
+struct Checkpoint_Message {
+  int sync_pt;
+  int pid;
+  int finished;
+  int reserved;
+  struct Fork_Server_Result result;
+};
+
+// A running child of a checkpointing execution
+struct Checkpoint_Child {
+  pid_t pid;
+  int pidfd;
+  int sync_pt;
+};
+
+// Open addressing table keyed by pointer. Entries are only added and removed by
+// the thread holding the baton, the key is published last with a release store so
+// lookups from any thread see a complete entry. A removed entry keeps the key
+// TABLE_REMOVED, which lookups pass over and insertions take again.
+struct Table_Entry {
+  void* key;
+  long value;
+};
+
+// Code addresses [first, last) of a preemption filter
+struct Site_Range {
+  uintptr_t first;
+  uintptr_t last;
+};
+
+// Synchronization points one call site of the program reached
+struct Site_Profile {
+  void* site;
+  char kind;
+  long sync_pts;
+  // Distinct mutexes and other objects used there
+  long objects;
+  // Locks that found the mutex held
+  long contended;
+};
+
+// Binary event trace: a header followed by the events of every thread
+struct Event_File_Header {
+  char magic[8];
+  int version;
+  int count;
+  // Events lost because a ring buffer wrapped
+  long long dropped;
+  // Timestamp the trace starts at, and timestamp ticks per microsecond
+  unsigned long long start;
+  double ticks_per_us;
+};
+
+struct Trace_Event {
+  unsigned long long timestamp;
+  // Mutex or other object address, or thread index for create, join and switch
+  unsigned long long object;
+  int sync_pt;
+  short thread;
+  char kind;
+  char reserved;
+};
+
+// Written only by its own thread, head counts every event ever recorded
+struct Event_Ring {
+  unsigned long long head;
+  struct Trace_Event events[EVENT_RING_CAPACITY];
+};
+
+struct Vector_Clock {
+  unsigned int clock[RACE_MAX_THREADS];
+};
+
+// Shadow of one 8-byte word of program memory: the epochs (thread and its clock)
+// of the last write and the last read, 0 if none
+struct Shadow_Word {
+  unsigned int write;
+  unsigned int read;
+};
+
+// State cache (CHESS_STATE_CACHE): a header followed by an open addressing table of
+// capacity states, shared by every execution of every chesstool run on the program.
+// An entry is the state hash with the low 8 bits replaced by the fewest preemptions
+// the state was reached with, 0 is a free slot.
+struct State_Cache_Header {
+  char magic[8];
+  int version;
+  int reserved;
+  long long capacity;
+  long long count;
+  // Size and modification time of the program the states belong to
+  long long program_size;
+  long long program_mtime;
+};
+
+// Decision file: a header followed by one decision per synchronization point.
+// Threads are creation indices and mutexes are numbered in order of first use,
+// so a file stays valid for another run of the same program.
+struct Decision_File_Header {
+  char magic[8];
+  int version;
+  int count;
+  // Set when chess.so found every thread waiting, a program may exit with
+  // DEADLOCK_EXIT_STATUS itself
+  int deadlocked;
+  int reserved;
+};
+
+struct Decision {
+  int sync_pt;
+  // Thread that reached the synchronization point, and the thread that ran after it
+  short running;
+  short next;
+  // Mutex or other object the operation uses, -1 for other kinds
+  int mutex;
+  char kind;
+  char reserved[3];
+};
+
 struct Thread_Arg {
   // start_routine is ptr to a func taking one arg, void *, and returns void *
   void* (*start_routine)(void*);
   void* arg;
+  struct Thread_State* state;
+};
+
+// A thread of the program run as a user-space context on the OS thread of the
+// program. Its address is its pthread_t.
+struct Fiber {
+#if defined(__x86_64__)
+  // Saved stack pointer, the registers are saved on the stack
+  void* sp;
+#else
+  ucontext_t context;
+#endif
+  // Mapping of the stack with its guard page, NULL for the main thread or once joined
+  void* stack;
+  size_t stack_size;
+  // Start of a created fiber, freed when it first runs
+  struct Thread_Arg* start;
+  void* retval;
+  // What is per OS thread is kept per fiber while it does not run
+  void* call_site;
+  int saved_errno;
 };
 
 // Pointers to functions
 int (*original_pthread_create)(pthread_t*, const pthread_attr_t*, void* (*)(void*), void*) = NULL;
 int (*original_pthread_join)(pthread_t, void**) = NULL;
+int (*original_pthread_detach)(pthread_t) = NULL;
+void (*original_pthread_exit)(void*) = NULL;
+pthread_t (*original_pthread_self)(void) = NULL;
 int (*original_pthread_mutex_lock)(pthread_mutex_t*) = NULL;
 int (*original_pthread_mutex_unlock)(pthread_mutex_t*) = NULL;
+int (*original_pthread_mutex_timedlock)(pthread_mutex_t*, const struct timespec*) = NULL;
+int (*original_pthread_mutex_clocklock)(pthread_mutex_t*, clockid_t, const struct timespec*) = NULL;
+int (*original_pthread_mutex_trylock)(pthread_mutex_t*) = NULL;
+int (*original_pthread_mutex_destroy)(pthread_mutex_t*) = NULL;
+int (*original_pthread_cond_wait)(pthread_cond_t*, pthread_mutex_t*) = NULL;
+int (*original_pthread_cond_timedwait)(pthread_cond_t*, pthread_mutex_t*, const struct timespec*) = NULL;
+int (*original_pthread_cond_clockwait)(pthread_cond_t*, pthread_mutex_t*, clockid_t, const struct timespec*) = NULL;
+int (*original_pthread_cond_signal)(pthread_cond_t*) = NULL;
+int (*original_pthread_cond_broadcast)(pthread_cond_t*) = NULL;
+int (*original_pthread_cond_init)(pthread_cond_t*, const pthread_condattr_t*) = NULL;
+int (*original_pthread_rwlock_init)(pthread_rwlock_t*, const pthread_rwlockattr_t*) = NULL;
+int (*original_pthread_rwlock_rdlock)(pthread_rwlock_t*) = NULL;
+int (*original_pthread_rwlock_wrlock)(pthread_rwlock_t*) = NULL;
+int (*original_pthread_rwlock_tryrdlock)(pthread_rwlock_t*) = NULL;
+int (*original_pthread_rwlock_trywrlock)(pthread_rwlock_t*) = NULL;
+int (*original_pthread_rwlock_timedrdlock)(pthread_rwlock_t*, const struct timespec*) = NULL;
+int (*original_pthread_rwlock_timedwrlock)(pthread_rwlock_t*, const struct timespec*) = NULL;
+int (*original_pthread_rwlock_clockrdlock)(pthread_rwlock_t*, clockid_t, const struct timespec*) = NULL;
+int (*original_pthread_rwlock_clockwrlock)(pthread_rwlock_t*, clockid_t, const struct timespec*) = NULL;
+int (*original_pthread_rwlock_unlock)(pthread_rwlock_t*) = NULL;
+int (*original_sem_init)(sem_t*, int, unsigned int) = NULL;
+int (*original_sem_wait)(sem_t*) = NULL;
+int (*original_sem_trywait)(sem_t*) = NULL;
+int (*original_sem_timedwait)(sem_t*, const struct timespec*) = NULL;
+int (*original_sem_clockwait)(sem_t*, clockid_t, const struct timespec*) = NULL;
+int (*original_sem_post)(sem_t*) = NULL;
+int (*original_sem_getvalue)(sem_t*, int*) = NULL;
+int (*original_pthread_barrier_init)(pthread_barrier_t*, const pthread_barrierattr_t*, unsigned int) = NULL;
+int (*original_pthread_barrier_wait)(pthread_barrier_t*) = NULL;
+void (*original_free)(void*) = NULL;
+void* (*original_realloc)(void*, size_t) = NULL;
+extern "C" void __libc_free(void*);
+extern "C" void* __libc_realloc(void*, size_t);
+unsigned int (*original_sleep)(unsigned int) = NULL;
+int (*original_usleep)(useconds_t) = NULL;
+int (*original_nanosleep)(const struct timespec*, struct timespec*) = NULL;
+int (*original_clock_gettime)(clockid_t, struct timespec*) = NULL;
+int (*original_gettimeofday)(struct timeval*, void*) = NULL;
 
 static void initialize_original_functions();
 static void update_track_sync_pts_file();
 static void deserialize_track_sync_pts_file(string);
-static void chess_switch_thread();
-static void synchronization_point();
+static void set_schedule(int, int);
+static void parse_preemptions(const char*);
+static void record_sync_pt(int, bool);
+static void record_event(char, void*);
+static void record_decision(int, char, void*);
+static int mutex_id(pthread_mutex_t*);
+static void open_record_file(const char*);
+static void close_record_file();
+static void read_replay_file(const char*);
+static unsigned long long read_timestamp();
+static void open_event_trace(const char*);
+static void trace_event(char, unsigned long long);
+static void write_event_trace();
+static void open_race_detector();
+static unsigned int current_epoch();
+static bool happens_before(unsigned int, struct Vector_Clock*);
+static void join_clock(struct Vector_Clock*, struct Vector_Clock*);
+static void tick_clock();
+static struct Vector_Clock* sync_clock(void*);
+static void race_acquire(void*);
+static void race_release(void*);
+static void race_fork(struct Thread_State*);
+static void race_join(struct Thread_State*);
+static struct Shadow_Word* shadow_word(uintptr_t);
+static void clear_shadow(void*, size_t);
+static void race_access(void*, size_t, bool, void*);
+static void report_race(void*, bool, unsigned int, bool, void*);
+static void print_race_summary();
+static void write_trace_file();
+static const char* site_location(void*, char, uintptr_t*);
+static void profile_sync_pt(char, void*);
+static void profile_contention();
+static void write_profile();
+static uintptr_t module_bias(const char*);
+static void read_preemption_filter(const char*);
+static bool preemptible(char, void*);
+static void read_checkpoints(const char*);
+static const char* checkpoint_file_name(const char*, int);
+static void checkpoint(int);
+static void fork_checkpoint(int);
+static void capture_checkpoint_output(const char*, off_t);
+static void reap_checkpoints(bool);
+static void finish_checkpoints();
+static void append_decision(struct Decision*);
+static void chess_switch_thread(int, bool);
+static unsigned long long pct_random();
+static void pct_switch_thread(int);
+static void preempt_current_thread(int);
+static void synchronization_point(char, void*);
 static void switch_back_to_other_running_thread();
+static struct Table_Entry* table_find(struct Table_Entry*, size_t, void*, bool);
+static void table_remove(struct Table_Entry*, size_t, void*);
+static struct Thread_State* new_thread_state();
+static void release_thread_state(struct Thread_State*);
+static void register_thread(pthread_t, struct Thread_State*);
+static struct Thread_State* find_thread(pthread_t);
+static long mutex_owner(pthread_mutex_t*);
+static void set_mutex_owner(pthread_mutex_t*, long);
+static bool acquire_mutex(pthread_mutex_t*, bool, long long);
+static void release_mutex(pthread_mutex_t*);
+static struct Sync_Object* sync_object(void*);
+static struct Sync_Object* reset_sync_object(void*);
+static void signal_condition(struct Sync_Object*, bool);
+static int wait_for_condition(pthread_cond_t*, pthread_mutex_t*, bool, long long);
+static bool rwlock_available(struct Sync_Object*, bool);
+static bool acquire_rwlock(pthread_rwlock_t*, bool, bool, long long);
+static struct Sync_Object* semaphore_object(sem_t*);
+static bool acquire_semaphore(sem_t*, bool, long long);
+static void use_sync_object(char, void*);
+static bool deadline_passed(struct Thread_State*);
+static bool thread_is_ready(struct Thread_State*);
+static bool thread_is_runnable(struct Thread_State*);
+static struct Thread_State* find_runnable_thread(struct Thread_State*);
+static void* run_thread(struct Thread_Arg*);
+static int create_fiber(const pthread_attr_t*, struct Thread_Arg*);
+static void fiber_main();
+static void switch_fiber(struct Thread_State*);
+static void exit_fiber(void*);
+#if defined(__x86_64__)
+extern "C" void chess_switch_stack(void**, void*);
+#endif
+static void wait_for_baton(struct Thread_State*);
+static void pass_baton(struct Thread_State*);
+static void switch_to_thread(struct Thread_State*);
+static void block_current_thread(struct Thread_State*);
+static struct Thread_State* waits_for(struct Thread_State*);
+static void print_wait(struct Thread_State*);
+static void exit_deadlocked();
+static void exit_execution(int);
+static unsigned long long mix_hash(unsigned long long, unsigned long long);
+static void update_state_hash(struct Thread_State*);
+static void open_state_cache(const char*);
+static bool visit_state(unsigned long long, int);
+static void prune_visited_state();
+static void resolve_time_functions();
+static void real_time(clockid_t, struct timespec*);
+static void virtual_sleep(long long);
+static const struct timespec* virtual_clock_base(clockid_t);
+static long long virtual_deadline(clockid_t, const struct timespec*);
+static void advance_virtual_time(long long);
 
 static pthread_t                                        CURRENT_THREAD = 0;
-static map<pthread_mutex_t*, pthread_t>                 MUTEX_MAP;
-static map<pthread_t, int>                              THREAD_MAP;
-static pthread_mutex_t                                  GLOBAL_LOCK = PTHREAD_MUTEX_INITIALIZER;
+// Mutex -> index of the owning thread, -1 when free
+static struct Table_Entry                               MUTEX_MAP[MUTEX_TABLE_CAPACITY];
+// pthread_t -> index into THREADS
+static struct Table_Entry                               THREAD_MAP[THREAD_TABLE_CAPACITY];
+// Threads in creation order, 0 is the main thread, joined threads leave their slot
+// to the next thread created
+static struct Thread_State                              THREADS[MAX_THREADS];
+static int                                              THREAD_COUNT = 0;
+static __thread struct Thread_State*                    SELF = NULL;
+// Return address of the hook the thread is in, where the program called it, or
+// the start routine of a starting thread
+static __thread void*                                   CALL_SITE = NULL;
+// Fiber mode (CHESS_FIBERS): every thread of the program is a fiber on one OS
+// thread, and a switch is a context switch instead of a futex handoff
+static bool                                             FIBERS = false;
+// Object address -> index into OBJECTS
+static struct Table_Entry                               OBJECT_MAP[OBJECT_TABLE_CAPACITY];
+static struct Sync_Object                               OBJECTS[MAX_SYNC_OBJECTS];
+static int                                              OBJECT_COUNT = 0;
 
 static const char*                                      TRACK_SYNC_PTS_FILE_NAME = ".tracksyncpts";
 static ifstream                                         TRACK_SYNC_PTS_FILE;
 static bool                                             FIRST_EXECUTION = false;
-static bool                                             THREAD_SWITCHED = false;
 static int                                              CURRENT_EXECUTION = -1;
 static int                                              TOTAL_EXECUTIONS = -1;
 static int                                              SYNC_PTS_ITERATED = 1;
-static bool                                             THREAD_WAITING_FOR_JOINEE = false;
+
+// Schedule as a list of preemptions sorted by synchronization point
+static vector<struct Preemption>                        PREEMPTIONS;
+static size_t                                           NEXT_PREEMPTION = 0;
+// Set when chesstool passed the schedule (CHESS_SCHEDULE or fork server) instead of .tracksyncpts
+static bool                                             SCHEDULE_FROM_TOOL = false;
+static int                                              FORK_SERVER_PREEMPTIONS = -1;
+static struct Preemption                                FORK_SERVER_SCHEDULE[MAX_PREEMPTIONS];
+static unsigned long long                               FORK_SERVER_SEED = 0;
+
+// Probabilistic concurrency testing (CHESS_PCT_SEED): threads get random priorities
+// from this generator state, and the preemptions are priority change points
+static bool                                             PCT = false;
+static unsigned long long                               PCT_RANDOM = 0;
+
+// Running thread and enabled threads at every synchronization point, for chesstool
+static const char*                                      TRACE_FILE_NAME = NULL;
+static string                                           TRACE;
+
+// Decisions of this execution, mapped from CHESS_RECORD_FILE so they survive a crash
+static int                                              RECORD_FD = -1;
+static struct Decision_File_Header*                     RECORD = NULL;
+static size_t                                           RECORD_CAPACITY = 0;
+// Decision at the synchronization point being passed, NULL when not recording
+static struct Decision*                                 CURRENT_DECISION = NULL;
+// Mutex -> order of first use
+static struct Table_Entry                               MUTEX_IDS[MUTEX_TABLE_CAPACITY];
+static int                                              MUTEX_COUNT = 0;
+// Decisions read from CHESS_REPLAY_FILE, checked against this execution
+static vector<struct Decision>                          REPLAY;
+static bool                                             REPLAY_DIVERGED = false;
+
+// One event ring per thread index, NULL unless CHESS_EVENT_TRACE is set
+static struct Event_Ring*                               EVENT_RINGS = NULL;
+static const char*                                      EVENT_TRACE_FILE_NAME = NULL;
+static unsigned long long                               EVENT_TRACE_START = 0;
+static struct timespec                                  EVENT_TRACE_START_TIME;
+
+// Race detector (CHESS_RACE_DETECT), fed by code compiled with -fsanitize=thread
+static bool                                             RACE_DETECTION = false;
+static struct Shadow_Word**                             SHADOW_DIRECTORY = NULL;
+static struct Vector_Clock*                             THREAD_CLOCKS = NULL;
+static struct Vector_Clock*                             SYNC_CLOCKS = NULL;
+// Synchronization object -> index into SYNC_CLOCKS
+static struct Table_Entry                               SYNC_CLOCK_MAP[2 * RACE_MAX_CLOCKS];
+static int                                              SYNC_CLOCK_COUNT = 0;
+// Program counters a race was reported at, each is reported once
+static struct Table_Entry                               RACE_REPORTS[RACE_REPORT_TABLE_CAPACITY];
+static long                                             RACES_FOUND = 0;
+
+// Call site profile (CHESS_PROFILE), and the call site of every synchronization
+// point of the first execution
+static const char*                                      PROFILE_FILE_NAME = NULL;
+static struct Table_Entry                               PROFILE_MAP[PROFILE_TABLE_CAPACITY];
+static struct Site_Profile                              PROFILE_SITES[MAX_PROFILE_SITES];
+static int                                              PROFILE_SITE_COUNT = 0;
+static struct Table_Entry                               PROFILE_OBJECTS[PROFILE_OBJECT_TABLE_CAPACITY];
+// Plain memory, the destructor writing the profile may run after C++ destructors
+static void**                                           PROFILE_POINTS = NULL;
+static size_t                                           PROFILE_POINT_COUNT = 0;
+static size_t                                           PROFILE_POINT_CAPACITY = 0;
+
+// Preemption filter (CHESS_PREEMPTION_FILTER): only synchronization points at a call
+// site in one of the ranges, or using one of the objects, may preempt
+static bool                                             FILTER = false;
+static struct Site_Range                                FILTER_SITES[MAX_FILTER_SITES];
+static int                                              FILTER_SITE_COUNT = 0;
+static struct Table_Entry                               FILTER_OBJECTS[FILTER_OBJECT_TABLE_CAPACITY];
+
+// Checkpoints (CHESS_CHECKPOINTS): an execution without preemptions forks a child
+// at each of these synchronization points that preempts there, so the children
+// share its prefix instead of running it again. Plain memory, the destructor
+// waiting for the children may run after C++ destructors.
+static int*                                             CHECKPOINTS = NULL;
+static int                                              CHECKPOINT_COUNT = 0;
+static int                                              NEXT_CHECKPOINT = 0;
+static int                                              CHECKPOINT_JOBS = 1;
+static struct Checkpoint_Child                          CHECKPOINT_CHILDREN[MAX_CHECKPOINT_JOBS];
+static int                                              CHECKPOINTS_RUNNING = 0;
+
+// State cache (CHESS_STATE_CACHE), STATE_HASH is the XOR of the hashes of every
+// thread and of every held mutex with its owner
+static struct State_Cache_Header*                       STATE_CACHE = NULL;
+static unsigned long long                               STATE_HASH = 0;
+
+// Virtual time (CHESS_VIRTUAL_TIME): clocks read the real time of initialization
+// plus VIRTUAL_NS, which only sleeps and timed waits advance
+static bool                                             VIRTUAL_TIME = false;
+static long long                                        VIRTUAL_NS = 0;
+static struct timespec                                  REALTIME_BASE;
+static struct timespec                                  MONOTONIC_BASE;
 
 static
 void* thread_main(void *arg)
 {
-  CURRENT_THREAD = pthread_self();
-
-  // Sync - Thread created
-  synchronization_point();
-
   struct Thread_Arg thread_arg = *(struct Thread_Arg*)arg;
   free(arg);
 
-  THREAD_MAP[pthread_self()] = THREAD_RUNNING_NOT_WAITING_FOR_LOCK;
+  // Enter a thread once the scheduler selects it
+  SELF = thread_arg.state;
+  CALL_SITE = (void*)thread_arg.start_routine;
+  wait_for_baton(SELF);
+
+  // The stack may have belonged to a thread that exited
+  if (RACE_DETECTION) {
+    pthread_attr_t attr;
+    void* stack;
+    size_t stackSize;
+    if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+      if (pthread_attr_getstack(&attr, &stack, &stackSize) == 0)
+        clear_shadow(stack, stackSize);
+      pthread_attr_destroy(&attr);
+    }
+  }
+
+  void* ret = run_thread(&thread_arg);
+
+  // Exit a thread
+  switch_back_to_other_running_thread();
 
-  while ( pthread_equal(CURRENT_THREAD, pthread_self()) == 0 ) {}
+  return ret;
+}
 
-  // Enter a thread
-  original_pthread_mutex_lock(&GLOBAL_LOCK);
+// A thread that was handed the baton for the first time
+static
+void* run_thread(struct Thread_Arg* thread_arg)
+{
+  // Sync - Thread created
+  synchronization_point(SYNC_PT_THREAD_START, NULL);
 
   if (CURRENT_MODE == DEBUG_MODE)
     fprintf(stderr, "thread: %u started\n", pthread_self());
 
-  void* ret = thread_arg.start_routine(thread_arg.arg);
+  void* ret = thread_arg->start_routine(thread_arg->arg);
 
   if (CURRENT_MODE == DEBUG_MODE)
     fprintf(stderr, "thread: %u terminated\n", pthread_self());
 
-  THREAD_MAP[pthread_self()] = THREAD_TERMINATED;
+  SELF->status = THREAD_TERMINATED;
+  return ret;
+}
+
+#if defined(__x86_64__)
+// Save the callee-saved registers, MXCSR and the x87 control word of the running
+// fiber on its stack and its stack pointer in *from, then restore those of the
+// fiber whose stack pointer is to. No system call, unlike swapcontext.
+asm(".text\n"
+    ".type chess_switch_stack, @function\n"
+    "chess_switch_stack:\n"
+    "  pushq %rbp\n"
+    "  pushq %rbx\n"
+    "  pushq %r12\n"
+    "  pushq %r13\n"
+    "  pushq %r14\n"
+    "  pushq %r15\n"
+    "  subq $8, %rsp\n"
+    "  stmxcsr (%rsp)\n"
+    "  fnstcw 4(%rsp)\n"
+    "  movq %rsp, (%rdi)\n"
+    "  movq %rsi, %rsp\n"
+    "  ldmxcsr (%rsp)\n"
+    "  fldcw 4(%rsp)\n"
+    "  addq $8, %rsp\n"
+    "  popq %r15\n"
+    "  popq %r14\n"
+    "  popq %r13\n"
+    "  popq %r12\n"
+    "  popq %rbx\n"
+    "  popq %rbp\n"
+    "  ret\n"
+    ".size chess_switch_stack, .-chess_switch_stack\n");
+#endif
+
+// A fiber starts here once the scheduler first switches to it
+static
+void fiber_main()
+{
+  struct Thread_Arg thread_arg = *SELF->fiber->start;
+  free(SELF->fiber->start);
+  SELF->fiber->start = NULL;
 
-  switch_back_to_other_running_thread();
+  CALL_SITE = (void*)thread_arg.start_routine;
+  // The stack may have belonged to a fiber that was joined
+  if (RACE_DETECTION)
+    clear_shadow(SELF->fiber->stack, SELF->fiber->stack_size);
 
-  // Exit a thread
-  original_pthread_mutex_unlock(&GLOBAL_LOCK);
+  exit_fiber(run_thread(&thread_arg));
+}
 
-  return ret;
+// The thread is a fiber with its own stack, below a guard page, that starts in
+// fiber_main. Returns an error number like pthread_create.
+static
+int create_fiber(const pthread_attr_t* attr, struct Thread_Arg* thread_arg)
+{
+  size_t stackSize = FIBER_STACK_SIZE;
+  if (attr)
+    pthread_attr_getstacksize(attr, &stackSize);
+  size_t page = sysconf(_SC_PAGESIZE);
+  stackSize = (stackSize + page - 1) & ~(page - 1);
+
+  struct Fiber* fiber = (struct Fiber*)calloc(1, sizeof(struct Fiber));
+  void* stack = mmap(NULL, stackSize + page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+  if (!fiber || stack == MAP_FAILED) {
+    free(fiber);
+    return EAGAIN;
+  }
+  mprotect(stack, page, PROT_NONE);
+
+  fiber->stack = stack;
+  fiber->stack_size = stackSize + page;
+  fiber->start = thread_arg;
+#if defined(__x86_64__)
+  // What chess_switch_stack restores: the control words of this thread, zeroed
+  // registers, and fiber_main as the return address, entered with the stack
+  // aligned like after a call
+  void** sp = (void**)((char*)stack + page + stackSize) - 9;
+  memset(sp, 0, 9 * sizeof(void*));
+  asm volatile("stmxcsr (%0)\n fnstcw 4(%0)" : : "r"(sp) : "memory");
+  sp[7] = (void*)fiber_main;
+  fiber->sp = sp;
+#else
+  getcontext(&fiber->context);
+  fiber->context.uc_stack.ss_sp = (char*)stack + page;
+  fiber->context.uc_stack.ss_size = stackSize;
+  fiber->context.uc_link = NULL;
+  makecontext(&fiber->context, fiber_main, 0);
+#endif
+
+  thread_arg->state->fiber = fiber;
+  return 0;
+}
+
+// Continue the fiber of thread state on this OS thread, returns once switched back.
+// SELF, CALL_SITE and errno belong to the OS thread, so they are kept per fiber.
+static
+void switch_fiber(struct Thread_State* state)
+{
+  if (!SELF->fiber)
+    SELF->fiber = (struct Fiber*)calloc(1, sizeof(struct Fiber));
+
+  struct Fiber* fiber = SELF->fiber;
+  fiber->call_site = CALL_SITE;
+  fiber->saved_errno = errno;
+  SELF = state;
+#if defined(__x86_64__)
+  chess_switch_stack(&fiber->sp, state->fiber->sp);
+#else
+  swapcontext(&fiber->context, &state->fiber->context);
+#endif
+
+  CALL_SITE = fiber->call_site;
+  errno = fiber->saved_errno;
+}
+
+// End the running fiber and switch to another for good, its stack stays until
+// it is joined. The program ends when the main thread called pthread_exit and
+// the last fiber ends.
+static
+void exit_fiber(void* retval)
+{
+  if (SELF->fiber)
+    SELF->fiber->retval = retval;
+  SELF->status = THREAD_TERMINATED;
+
+  struct Thread_State* next = find_runnable_thread(SELF);
+  if (!next) {
+    for (int i = 0; i < THREAD_COUNT; i++)
+      if (THREADS[i].status != THREAD_TERMINATED)
+        exit_deadlocked();
+    exit(0);
+  }
+
+  switch_to_thread(next);
+  abort();
 }
 
 extern "C"
@@ -99,11 +839,31 @@ int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
   struct Thread_Arg *thread_arg = (struct Thread_Arg*)malloc(sizeof(struct Thread_Arg));
   thread_arg->start_routine = start_routine;
   thread_arg->arg = arg;
+  thread_arg->state = new_thread_state();
+
+  // The new thread parks in thread_main until it is handed the baton, a fiber
+  // only starts then
+  int ret;
+  if (FIBERS) {
+    ret = create_fiber(attr, thread_arg);
+    if (ret == 0)
+      *thread = (pthread_t)thread_arg->state->fiber;
+  } else {
+    ret = original_pthread_create(thread, attr, thread_main, thread_arg);
+  }
 
-  // Lock global lock before entering a new thread
-  original_pthread_mutex_lock(&GLOBAL_LOCK);
-
-  int ret = original_pthread_create(thread, attr, thread_main, thread_arg);
+  if (ret == 0) {
+    register_thread(*thread, thread_arg->state);
+    if (RACE_DETECTION)
+      race_fork(thread_arg->state);
+    if (TRACE_FILE_NAME)
+      record_event(EVENT_THREAD_CREATE, (void*)(long)thread_arg->state->index);
+    if (EVENT_RINGS)
+      trace_event(TRACE_EVENT_CREATE, thread_arg->state->index);
+  } else {
+    release_thread_state(thread_arg->state);
+    free(thread_arg);
+  }
 
   return ret;
 }
@@ -113,244 +873,3000 @@ int pthread_join(pthread_t joinee, void **retval)
 {
   initialize_original_functions();
 
-  original_pthread_mutex_unlock(&GLOBAL_LOCK);
-
   // Select joinee thread if joinee is still running
-  if (THREAD_MAP[joinee] != THREAD_TERMINATED) {
+  struct Thread_State* state = find_thread(joinee);
+  if (EVENT_RINGS && state)
+    trace_event(TRACE_EVENT_JOIN, state->index);
+  if (SELF && state && state->status != THREAD_TERMINATED) {
     if (CURRENT_MODE == DEBUG_MODE)
-      fprintf(stderr, "\t\t\tpthread_join - thread: %u waiting on joinee thread: %u (%d)\n", pthread_self(), joinee, THREAD_MAP[joinee]);
-    CURRENT_THREAD = joinee;
+      fprintf(stderr, "\t\t\tpthread_join - thread: %u waiting on joinee thread: %u (%d)\n", pthread_self(), joinee, state->status);
+    SELF->status = THREAD_WAITING_FOR_JOINEE;
+    SELF->joinee = state;
+
+    block_current_thread(state);
+
+    SELF->status = THREAD_RUNNING_NOT_WAITING_FOR_LOCK;
+  }
+  if (RACE_DETECTION && SELF && state)
+    race_join(state);
+
+  // A fiber has no OS thread to join, its stack is free now
+  if (state && state->fiber && state->fiber->stack) {
+    if (retval)
+      *retval = state->fiber->retval;
+    munmap(state->fiber->stack, state->fiber->stack_size);
+    free(state->fiber);
+    state->fiber = NULL;
+    release_thread_state(state);
+    return 0;
+  }
+
+  int ret = original_pthread_join(joinee, retval);
+  if (ret == 0 && state)
+    release_thread_state(state);
+  return ret;
+}
+
+extern "C"
+int pthread_detach(pthread_t thread)
+{
+  initialize_original_functions();
+
+  // The stack of a detached fiber stays until the program exits
+  struct Thread_State* state = FIBERS ? find_thread(thread) : NULL;
+  if (state && state->fiber)
+    return 0;
+
+  return original_pthread_detach(thread);
+}
 
-    THREAD_WAITING_FOR_JOINEE = true;
+extern "C"
+void pthread_exit(void* retval)
+{
+  initialize_original_functions();
 
-    while ( THREAD_MAP[joinee] != THREAD_TERMINATED ) {}
+  if (FIBERS && SELF)
+    exit_fiber(retval);
 
-    THREAD_WAITING_FOR_JOINEE = false;
+  // Like returning from the start routine, the baton goes on
+  if (SELF) {
+    SELF->status = THREAD_TERMINATED;
+    switch_back_to_other_running_thread();
   }
+  original_pthread_exit(retval);
+  abort();
+}
 
-  original_pthread_mutex_lock(&GLOBAL_LOCK);
+// Fibers share the OS thread, each has its own pthread_t. Initialization calls
+// this too, so it does not initialize.
+extern "C"
+pthread_t pthread_self(void)
+{
+  if (FIBERS && SELF && SELF->index > 0)
+    return SELF->thread;
 
-  return original_pthread_join(joinee, retval);
+  if (!original_pthread_self)
+    original_pthread_self = (pthread_t (*)(void))dlsym(RTLD_NEXT, "pthread_self");
+  return original_pthread_self();
 }
 
 extern "C"
 int pthread_mutex_lock(pthread_mutex_t *mutex)
 {
   initialize_original_functions();
+  CALL_SITE = __builtin_return_address(0);
 
-  if (MUTEX_MAP[mutex] != 0) {
-    if (CURRENT_MODE == DEBUG_MODE)
-      fprintf(stderr, "thread: %u, program lock 1 > executing thread: %u and waiting for it\n", pthread_self(), MUTEX_MAP[mutex]);
-    original_pthread_mutex_unlock(&GLOBAL_LOCK);
+  // Locks taken by threads the scheduler does not know about are not scheduled
+  if (!SELF)
+    return original_pthread_mutex_lock(mutex);
 
-    // Select next available thread to execute, we select the thread holding this lock
-    CURRENT_THREAD = MUTEX_MAP[mutex];
+  // Sync - Before mutex is locked
+  synchronization_point(SYNC_PT_MUTEX_LOCK, mutex);
 
-    // Wait until program lock is not held by any other threads
-    THREAD_MAP[pthread_self()] = THREAD_RUNNING_WAITING_FOR_LOCK;
-    while (MUTEX_MAP[mutex] != 0) {}
+  acquire_mutex(mutex, false, 0);
 
-    CURRENT_THREAD = pthread_self();
+  // Continue execution
 
-    original_pthread_mutex_lock(&GLOBAL_LOCK);
+  return original_pthread_mutex_lock(mutex);
+}
 
-    if (CURRENT_MODE == DEBUG_MODE)
-      fprintf(stderr, "thread: %u now holds program lock %x\n", pthread_self(), mutex);
-    THREAD_MAP[pthread_self()] = THREAD_RUNNING_NOT_WAITING_FOR_LOCK;
+// Same as pthread_mutex_lock, but the scheduler may also end the wait by timeout
+// instead of waiting for the owner. In virtual time the timeout cannot end the wait
+// before the virtual clock reaches abstime, in real time it is a choice at any point.
+extern "C"
+int pthread_mutex_timedlock(pthread_mutex_t *mutex, const struct timespec *abstime)
+{
+  initialize_original_functions();
+  CALL_SITE = __builtin_return_address(0);
 
-    // Sync - Before mutex is locked
-    synchronization_point();
-    MUTEX_MAP[mutex] = pthread_self();
-  } else {
-    if (CURRENT_MODE == DEBUG_MODE) {
-      fprintf(stderr, "thread: %u, program lock 2 > ", pthread_self());
-      fprintf(stderr, "thread %u now holds program lock %x\n", pthread_self(), mutex);
-    }
-    THREAD_MAP[pthread_self()] = THREAD_RUNNING_NOT_WAITING_FOR_LOCK;
+  if (!SELF)
+    return original_pthread_mutex_timedlock(mutex, abstime);
 
-    // Sync - Before mutex is locked
-    synchronization_point();
-    MUTEX_MAP[mutex] = pthread_self();
-  }
+  // Sync - Before mutex is locked
+  synchronization_point(SYNC_PT_MUTEX_LOCK, mutex);
 
-  // Continue execution
+  if (!acquire_mutex(mutex, true, virtual_deadline(CLOCK_REALTIME, abstime)))
+    return ETIMEDOUT;
+
+  return original_pthread_mutex_lock(mutex);
+}
+
+// pthread_mutex_timedlock with abstime on clock, as libstdc++ uses for timed mutexes
+extern "C"
+int pthread_mutex_clocklock(pthread_mutex_t *mutex, clockid_t clock, const struct timespec *abstime)
+{
+  initialize_original_functions();
+  CALL_SITE = __builtin_return_address(0);
+
+  if (!SELF)
+    return original_pthread_mutex_clocklock(mutex, clock, abstime);
+
+  // Sync - Before mutex is locked
+  synchronization_point(SYNC_PT_MUTEX_LOCK, mutex);
+
+  if (!acquire_mutex(mutex, true, virtual_deadline(clock, abstime)))
+    return ETIMEDOUT;
 
   return original_pthread_mutex_lock(mutex);
 }
 
+extern "C"
+int pthread_mutex_trylock(pthread_mutex_t *mutex)
+{
+  initialize_original_functions();
+  CALL_SITE = __builtin_return_address(0);
+
+  if (!SELF)
+    return original_pthread_mutex_trylock(mutex);
+
+  // Sync - Before mutex is locked
+  synchronization_point(SYNC_PT_MUTEX_LOCK, mutex);
+
+  if (mutex_owner(mutex) >= 0)
+    return EBUSY;
+
+  acquire_mutex(mutex, false, 0);
+  return original_pthread_mutex_trylock(mutex);
+}
+
 extern "C"
 int pthread_mutex_unlock(pthread_mutex_t *mutex)
 {
   initialize_original_functions();
+  CALL_SITE = __builtin_return_address(0);
 
   if (CURRENT_MODE == DEBUG_MODE)
-    if (MUTEX_MAP[mutex] != 0)
-      fprintf(stderr, "\t\t\tthread: %u frees on program lock %x\n", MUTEX_MAP[mutex], mutex);
+    if (mutex_owner(mutex) >= 0)
+      fprintf(stderr, "\t\t\tthread: %u frees on program lock %x\n", THREADS[mutex_owner(mutex)].thread, mutex);
 
   int ret = original_pthread_mutex_unlock(mutex);
 
   // This program lock is no longer held by this thread
-  if ( pthread_equal(MUTEX_MAP[mutex], pthread_self()) ) {
-    MUTEX_MAP[mutex] = 0;
+  if (SELF && mutex_owner(mutex) == SELF->index) {
+    release_mutex(mutex);
     // Sync - After mutex is released
-    synchronization_point();
+    synchronization_point(SYNC_PT_MUTEX_UNLOCK, mutex);
   }
 
   return ret;
 }
 
+// A destroyed mutex leaves the tables, its memory may become another mutex
 extern "C"
-int sched_yield(void)
+int pthread_mutex_destroy(pthread_mutex_t *mutex)
 {
-  original_pthread_mutex_unlock(&GLOBAL_LOCK);
-
-  map<pthread_t, int>::iterator it;
+  initialize_original_functions();
 
-  for (it = THREAD_MAP.begin(); it != THREAD_MAP.end() && !THREAD_WAITING_FOR_JOINEE; it++) {
-    if ( it->first != pthread_self() && it->second == THREAD_RUNNING_NOT_WAITING_FOR_LOCK ) {
-      if (CURRENT_MODE == DEBUG_MODE)
-        fprintf(stderr, "\t\t\tsched_yield - thread: %u is yielding to thread: %u\n", pthread_self(), it->first);
-      CURRENT_THREAD = it->first;
-      break;
-    }
+  if (SELF) {
+    if (mutex_owner(mutex) >= 0)
+      set_mutex_owner(mutex, -1);
+    table_remove(MUTEX_MAP, MUTEX_TABLE_CAPACITY, mutex);
+    table_remove(MUTEX_IDS, MUTEX_TABLE_CAPACITY, mutex);
   }
+  return original_pthread_mutex_destroy(mutex);
+}
+
+// Condition variables are modelled entirely: a waiter releases the mutex and
+// blocks in the scheduler until a signal it may take is pending. Which of several
+// eligible waiters takes a signal is a scheduling choice, and a waiter can also be
+// picked without a signal, which is a spurious wakeup.
+extern "C"
+int pthread_cond_init(pthread_cond_t *cond, const pthread_condattr_t *attr)
+{
+  initialize_original_functions();
+
+  struct Sync_Object* object = reset_sync_object(cond);
+  if (attr)
+    pthread_condattr_getclock(attr, &object->clock);
+  return original_pthread_cond_init(cond, attr);
+}
 
-  while ( pthread_equal(CURRENT_THREAD, pthread_self()) == 0 ) {}
+extern "C"
+int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex)
+{
+  initialize_original_functions();
+  CALL_SITE = __builtin_return_address(0);
 
-  original_pthread_mutex_lock(&GLOBAL_LOCK);
+  if (!SELF)
+    return original_pthread_cond_wait(cond, mutex);
 
-  return 0;
+  return wait_for_condition(cond, mutex, false, 0);
 }
 
-static 
-void switch_back_to_other_running_thread()
+extern "C"
+int pthread_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex, const struct timespec *abstime)
 {
-  map<pthread_t, int>::iterator it;
+  initialize_original_functions();
+  CALL_SITE = __builtin_return_address(0);
 
-  for (it = THREAD_MAP.begin(); it != THREAD_MAP.end(); it++) {
-    if ( it->first != pthread_self() && it->second != THREAD_TERMINATED ) {
-      CURRENT_THREAD = it->first;
-      break;
-    }
-  }
+  if (!SELF)
+    return original_pthread_cond_timedwait(cond, mutex, abstime);
+
+  return wait_for_condition(cond, mutex, true, virtual_deadline(sync_object(cond)->clock, abstime));
 }
 
-static
-void synchronization_point()
+// libstdc++ waits with a timeout through this, std::condition_variable on CLOCK_MONOTONIC
+extern "C"
+int pthread_cond_clockwait(pthread_cond_t *cond, pthread_mutex_t *mutex, clockid_t clock, const struct timespec *abstime)
 {
-  if (CHESS_EXPLORE_MODE == EXPLORE_CHESS_SCHEDULES) {
-    if (FIRST_EXECUTION) {
-      TOTAL_EXECUTIONS++;
-      fprintf(stderr, "\t\tSynchronization point %d found here\n", TOTAL_EXECUTIONS);
-    } else {
-      chess_switch_thread();
-    }
-    update_track_sync_pts_file();
-  }
+  initialize_original_functions();
+  CALL_SITE = __builtin_return_address(0);
+
+  if (!SELF)
+    return original_pthread_cond_clockwait(cond, mutex, clock, abstime);
+
+  return wait_for_condition(cond, mutex, true, virtual_deadline(clock, abstime));
 }
 
-static
-void chess_switch_thread()
+extern "C"
+int pthread_cond_signal(pthread_cond_t *cond)
 {
-  if (SYNC_PTS_ITERATED == CURRENT_EXECUTION && !THREAD_SWITCHED) {
-    THREAD_SWITCHED = true;
-    CURRENT_EXECUTION++;
-    
-    // Reset current execution count when total reached
-    if (CURRENT_EXECUTION > TOTAL_EXECUTIONS)
-      CURRENT_EXECUTION = 1;
-    sched_yield();
-  }
-  SYNC_PTS_ITERATED++;
+  initialize_original_functions();
+  CALL_SITE = __builtin_return_address(0);
+
+  if (!SELF)
+    return original_pthread_cond_signal(cond);
+
+  // Sync - Before signaling
+  synchronization_point(SYNC_PT_COND_SIGNAL, cond);
+
+  use_sync_object(TRACE_EVENT_SIGNAL, cond);
+  if (RACE_DETECTION)
+    race_release(cond);
+  signal_condition(sync_object(cond), false);
+  return 0;
 }
 
-static
-void update_track_sync_pts_file()
+extern "C"
+int pthread_cond_broadcast(pthread_cond_t *cond)
 {
-  string newString;
-  stringstream temp1;
-  stringstream temp2;
-  temp1 << CURRENT_EXECUTION;
-  newString.append(temp1.str());
-  newString.append("/");
-  temp2 << TOTAL_EXECUTIONS;
-  newString.append(temp2.str());
+  initialize_original_functions();
+  CALL_SITE = __builtin_return_address(0);
 
-  if (CURRENT_MODE == DEBUG_MODE)
-    fprintf(stderr, "newString: %s\n", newString.c_str());
+  if (!SELF)
+    return original_pthread_cond_broadcast(cond);
 
-  // Write back to file
-  ofstream outfile;
-  outfile.open(TRACK_SYNC_PTS_FILE_NAME);
+  // Sync - Before signaling
+  synchronization_point(SYNC_PT_COND_SIGNAL, cond);
 
-  if (outfile)
-    outfile.write(newString.c_str(), (int)newString.length());
+  use_sync_object(TRACE_EVENT_SIGNAL, cond);
+  if (RACE_DETECTION)
+    race_release(cond);
+  signal_condition(sync_object(cond), true);
+  return 0;
+}
 
-  outfile.close();
+// Read-write locks prefer readers, like the glibc default. The program's lock is
+// taken once the model grants it, so it never blocks.
+extern "C"
+int pthread_rwlock_init(pthread_rwlock_t *rwlock, const pthread_rwlockattr_t *attr)
+{
+  initialize_original_functions();
+
+  reset_sync_object(rwlock);
+  return original_pthread_rwlock_init(rwlock, attr);
 }
 
-static
-void deserialize_track_sync_pts_file(string str)
+extern "C"
+int pthread_rwlock_rdlock(pthread_rwlock_t *rwlock)
 {
-  int len = str.length();
-  int DELIMITER_POS = str.find('/');
-  if (DELIMITER_POS == (int)string::npos) {
-    fprintf(stderr, "CORRUPT DATA\n");
-    return;
-  }
-  string current = str.substr(0, DELIMITER_POS);
-  string total = str.substr(DELIMITER_POS + 1, len);
+  initialize_original_functions();
+  CALL_SITE = __builtin_return_address(0);
 
-  // Read data and store them in static global int variables
-  CURRENT_EXECUTION = atoi(current.c_str());
-  TOTAL_EXECUTIONS = atoi(total.c_str());
+  if (!SELF)
+    return original_pthread_rwlock_rdlock(rwlock);
 
-  // Check if this is the first execution, set flag if so
-  if (CURRENT_EXECUTION == 0 && TOTAL_EXECUTIONS == 0) {
-    FIRST_EXECUTION = true;
-    CURRENT_EXECUTION = 1;
-    if (CURRENT_MODE == DEBUG_MODE)
-      fprintf(stderr, ">>>>>>>>>> FIRST EXECUTION <<<<<<<<<<\n");
-    return;
-  }
+  // Sync - Before rwlock is locked
+  synchronization_point(SYNC_PT_RWLOCK_LOCK, rwlock);
 
-  if (CURRENT_MODE == DEBUG_MODE)
-    fprintf(stderr, ">>>>>>>>>>>>>>> EXECUTION: %d/%d <<<<<<<<<<<<<<<\n", CURRENT_EXECUTION, TOTAL_EXECUTIONS);
+  acquire_rwlock(rwlock, false, false, 0);
+  return original_pthread_rwlock_rdlock(rwlock);
 }
 
-static
-void initialize_original_functions()
+extern "C"
+int pthread_rwlock_wrlock(pthread_rwlock_t *rwlock)
 {
-  static bool initialized = false;
-  if (!initialized) {
-    initialized = true;
+  initialize_original_functions();
+  CALL_SITE = __builtin_return_address(0);
 
-    if (CHESS_EXPLORE_MODE == EXPLORE_CHESS_SCHEDULES) {
-      string input;
-      TRACK_SYNC_PTS_FILE.open(TRACK_SYNC_PTS_FILE_NAME);
+  if (!SELF)
+    return original_pthread_rwlock_wrlock(rwlock);
 
-      if (TRACK_SYNC_PTS_FILE) {
-        while (!TRACK_SYNC_PTS_FILE.eof()) {
-          TRACK_SYNC_PTS_FILE >> input;
-        }
-        TRACK_SYNC_PTS_FILE.close();
-        deserialize_track_sync_pts_file(input);
-      } else {
-        FIRST_EXECUTION = true;
-        fprintf(stderr, "NO DATA IN .tracksyncpts\n");
-      }
-    }
+  // Sync - Before rwlock is locked
+  synchronization_point(SYNC_PT_RWLOCK_LOCK, rwlock);
 
-    if (CURRENT_MODE == DEBUG_MODE)
-      fprintf(stderr, "--------------------------------------------------\n");
+  acquire_rwlock(rwlock, true, false, 0);
+  return original_pthread_rwlock_wrlock(rwlock);
+}
+
+extern "C"
+int pthread_rwlock_tryrdlock(pthread_rwlock_t *rwlock)
+{
+  initialize_original_functions();
+  CALL_SITE = __builtin_return_address(0);
+
+  if (!SELF)
+    return original_pthread_rwlock_tryrdlock(rwlock);
+
+  // Sync - Before rwlock is locked
+  synchronization_point(SYNC_PT_RWLOCK_LOCK, rwlock);
+
+  if (!rwlock_available(sync_object(rwlock), false))
+    return EBUSY;
+
+  acquire_rwlock(rwlock, false, false, 0);
+  return original_pthread_rwlock_rdlock(rwlock);
+}
+
+extern "C"
+int pthread_rwlock_trywrlock(pthread_rwlock_t *rwlock)
+{
+  initialize_original_functions();
+  CALL_SITE = __builtin_return_address(0);
+
+  if (!SELF)
+    return original_pthread_rwlock_trywrlock(rwlock);
+
+  // Sync - Before rwlock is locked
+  synchronization_point(SYNC_PT_RWLOCK_LOCK, rwlock);
+
+  if (!rwlock_available(sync_object(rwlock), true))
+    return EBUSY;
+
+  acquire_rwlock(rwlock, true, false, 0);
+  return original_pthread_rwlock_wrlock(rwlock);
+}
+
+extern "C"
+int pthread_rwlock_timedrdlock(pthread_rwlock_t *rwlock, const struct timespec *abstime)
+{
+  initialize_original_functions();
+  CALL_SITE = __builtin_return_address(0);
+
+  if (!SELF)
+    return original_pthread_rwlock_timedrdlock(rwlock, abstime);
+
+  // Sync - Before rwlock is locked
+  synchronization_point(SYNC_PT_RWLOCK_LOCK, rwlock);
+
+  if (!acquire_rwlock(rwlock, false, true, virtual_deadline(CLOCK_REALTIME, abstime)))
+    return ETIMEDOUT;
+  return original_pthread_rwlock_rdlock(rwlock);
+}
+
+extern "C"
+int pthread_rwlock_timedwrlock(pthread_rwlock_t *rwlock, const struct timespec *abstime)
+{
+  initialize_original_functions();
+  CALL_SITE = __builtin_return_address(0);
+
+  if (!SELF)
+    return original_pthread_rwlock_timedwrlock(rwlock, abstime);
+
+  // Sync - Before rwlock is locked
+  synchronization_point(SYNC_PT_RWLOCK_LOCK, rwlock);
+
+  if (!acquire_rwlock(rwlock, true, true, virtual_deadline(CLOCK_REALTIME, abstime)))
+    return ETIMEDOUT;
+  return original_pthread_rwlock_wrlock(rwlock);
+}
+
+extern "C"
+int pthread_rwlock_clockrdlock(pthread_rwlock_t *rwlock, clockid_t clock, const struct timespec *abstime)
+{
+  initialize_original_functions();
+  CALL_SITE = __builtin_return_address(0);
+
+  if (!SELF)
+    return original_pthread_rwlock_clockrdlock(rwlock, clock, abstime);
+
+  // Sync - Before rwlock is locked
+  synchronization_point(SYNC_PT_RWLOCK_LOCK, rwlock);
+
+  if (!acquire_rwlock(rwlock, false, true, virtual_deadline(clock, abstime)))
+    return ETIMEDOUT;
+  return original_pthread_rwlock_rdlock(rwlock);
+}
+
+extern "C"
+int pthread_rwlock_clockwrlock(pthread_rwlock_t *rwlock, clockid_t clock, const struct timespec *abstime)
+{
+  initialize_original_functions();
+  CALL_SITE = __builtin_return_address(0);
+
+  if (!SELF)
+    return original_pthread_rwlock_clockwrlock(rwlock, clock, abstime);
+
+  // Sync - Before rwlock is locked
+  synchronization_point(SYNC_PT_RWLOCK_LOCK, rwlock);
+
+  if (!acquire_rwlock(rwlock, true, true, virtual_deadline(clock, abstime)))
+    return ETIMEDOUT;
+  return original_pthread_rwlock_wrlock(rwlock);
+}
+
+extern "C"
+int pthread_rwlock_unlock(pthread_rwlock_t *rwlock)
+{
+  initialize_original_functions();
+  CALL_SITE = __builtin_return_address(0);
+
+  int ret = original_pthread_rwlock_unlock(rwlock);
+
+  if (SELF && ret == 0) {
+    struct Sync_Object* object = sync_object(rwlock);
+    if (object->writer == SELF->index)
+      object->writer = -1;
+    else if (object->readers > 0)
+      object->readers--;
+    if (TRACE_FILE_NAME)
+      record_event(EVENT_SYNC_OBJECT, rwlock);
+    if (EVENT_RINGS)
+      trace_event(TRACE_EVENT_UNLOCK, (unsigned long long)rwlock);
+    if (RACE_DETECTION)
+      race_release(rwlock);
+    // Sync - After rwlock is released
+    synchronization_point(SYNC_PT_RWLOCK_UNLOCK, rwlock);
+  }
+
+  return ret;
+}
+
+// Semaphores keep their value in the model, the program's semaphore follows it
+// so that sem_getvalue and threads the scheduler does not know still see it
+extern "C"
+int sem_init(sem_t *sem, int pshared, unsigned int value)
+{
+  initialize_original_functions();
+
+  int ret = original_sem_init(sem, pshared, value);
+  if (ret == 0) {
+    struct Sync_Object* object = reset_sync_object(sem);
+    object->value = value;
+    object->initialized = true;
+  }
+  return ret;
+}
+
+extern "C"
+int sem_wait(sem_t *sem)
+{
+  initialize_original_functions();
+  CALL_SITE = __builtin_return_address(0);
+
+  if (!SELF)
+    return original_sem_wait(sem);
+
+  // Sync - Before semaphore is decremented
+  synchronization_point(SYNC_PT_SEM_WAIT, sem);
+
+  acquire_semaphore(sem, false, 0);
+  return original_sem_trywait(sem);
+}
+
+extern "C"
+int sem_trywait(sem_t *sem)
+{
+  initialize_original_functions();
+  CALL_SITE = __builtin_return_address(0);
+
+  if (!SELF)
+    return original_sem_trywait(sem);
+
+  // Sync - Before semaphore is decremented
+  synchronization_point(SYNC_PT_SEM_WAIT, sem);
+
+  if (semaphore_object(sem)->value == 0) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  acquire_semaphore(sem, false, 0);
+  return original_sem_trywait(sem);
+}
+
+extern "C"
+int sem_timedwait(sem_t *sem, const struct timespec *abstime)
+{
+  initialize_original_functions();
+  CALL_SITE = __builtin_return_address(0);
+
+  if (!SELF)
+    return original_sem_timedwait(sem, abstime);
+
+  // Sync - Before semaphore is decremented
+  synchronization_point(SYNC_PT_SEM_WAIT, sem);
+
+  if (!acquire_semaphore(sem, true, virtual_deadline(CLOCK_REALTIME, abstime))) {
+    errno = ETIMEDOUT;
+    return -1;
+  }
+  return original_sem_trywait(sem);
+}
+
+extern "C"
+int sem_clockwait(sem_t *sem, clockid_t clock, const struct timespec *abstime)
+{
+  initialize_original_functions();
+  CALL_SITE = __builtin_return_address(0);
+
+  if (!SELF)
+    return original_sem_clockwait(sem, clock, abstime);
+
+  // Sync - Before semaphore is decremented
+  synchronization_point(SYNC_PT_SEM_WAIT, sem);
+
+  if (!acquire_semaphore(sem, true, virtual_deadline(clock, abstime))) {
+    errno = ETIMEDOUT;
+    return -1;
+  }
+  return original_sem_trywait(sem);
+}
+
+extern "C"
+int sem_post(sem_t *sem)
+{
+  initialize_original_functions();
+  CALL_SITE = __builtin_return_address(0);
+
+  int ret = original_sem_post(sem);
+
+  if (SELF && ret == 0) {
+    semaphore_object(sem)->value++;
+    use_sync_object(TRACE_EVENT_SEM_POST, sem);
+    if (RACE_DETECTION)
+      race_release(sem);
+    // Sync - After semaphore is incremented
+    synchronization_point(SYNC_PT_SEM_POST, sem);
+  }
+
+  return ret;
+}
+
+// Barriers are modelled entirely, threads never wait on the program's barrier
+extern "C"
+int pthread_barrier_init(pthread_barrier_t *barrier, const pthread_barrierattr_t *attr, unsigned int count)
+{
+  initialize_original_functions();
+
+  int ret = original_pthread_barrier_init(barrier, attr, count);
+  if (ret == 0)
+    reset_sync_object(barrier)->needed = count;
+  return ret;
+}
+
+extern "C"
+int pthread_barrier_wait(pthread_barrier_t *barrier)
+{
+  initialize_original_functions();
+  CALL_SITE = __builtin_return_address(0);
+
+  struct Sync_Object* object = SELF ? sync_object(barrier) : NULL;
+  if (!object || object->needed == 0)
+    return original_pthread_barrier_wait(barrier);
+
+  // Sync - Before arriving at the barrier
+  synchronization_point(SYNC_PT_BARRIER, barrier);
+
+  use_sync_object(TRACE_EVENT_BARRIER, barrier);
+  if (RACE_DETECTION)
+    race_release(barrier);
+
+  // The last thread to arrive releases the others
+  if (++object->arrived == object->needed) {
+    object->arrived = 0;
+    object->cycle++;
+    if (RACE_DETECTION)
+      race_acquire(barrier);
+    return PTHREAD_BARRIER_SERIAL_THREAD;
+  }
+
+  SELF->status = THREAD_WAITING_FOR_BARRIER;
+  SELF->object = object;
+  SELF->ticket = object->cycle;
+
+  block_current_thread(NULL);
+
+  SELF->status = THREAD_RUNNING_NOT_WAITING_FOR_LOCK;
+  SELF->object = NULL;
+  if (RACE_DETECTION)
+    race_acquire(barrier);
+  return 0;
+}
+
+extern "C"
+int sched_yield(void)
+{
+  initialize_original_functions();
+
+  if (!SELF)
+    return 0;
+
+  if (EVENT_RINGS)
+    trace_event(TRACE_EVENT_YIELD, 0);
+
+  struct Thread_State* next = find_runnable_thread(SELF);
+  if (next) {
+    if (CURRENT_MODE == DEBUG_MODE)
+      fprintf(stderr, "\t\t\tsched_yield - thread: %u is yielding to thread: %u\n", pthread_self(), next->thread);
+    switch_to_thread(next);
+  }
+
+  return 0;
+}
+
+// Sleeps only advance the virtual clock: the sleeping thread waits until no other
+// thread can go on without time passing (or the scheduler picks it earlier)
+extern "C"
+unsigned int sleep(unsigned int seconds)
+{
+  initialize_original_functions();
+  CALL_SITE = __builtin_return_address(0);
+
+  if (!VIRTUAL_TIME || !SELF)
+    return original_sleep(seconds);
+
+  virtual_sleep(seconds * 1000000000LL);
+  return 0;
+}
+
+extern "C"
+int usleep(useconds_t usec)
+{
+  initialize_original_functions();
+  CALL_SITE = __builtin_return_address(0);
+
+  if (!VIRTUAL_TIME || !SELF)
+    return original_usleep(usec);
+
+  virtual_sleep(usec * 1000LL);
+  return 0;
+}
+
+extern "C"
+int nanosleep(const struct timespec *req, struct timespec *rem)
+{
+  initialize_original_functions();
+  CALL_SITE = __builtin_return_address(0);
+
+  if (!VIRTUAL_TIME || !SELF)
+    return original_nanosleep(req, rem);
+
+  if (req->tv_sec < 0 || req->tv_nsec < 0 || req->tv_nsec >= 1000000000L) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  virtual_sleep(req->tv_sec * 1000000000LL + req->tv_nsec);
+  if (rem)
+    rem->tv_sec = rem->tv_nsec = 0;
+  return 0;
+}
+
+// Clock reads do not initialize chess.so: every process started under the preload
+// reads clocks, including the shell that runs the program under test
+extern "C"
+int clock_gettime(clockid_t clock, struct timespec *tp)
+{
+  resolve_time_functions();
+
+  if (!VIRTUAL_TIME)
+    return original_clock_gettime(clock, tp);
+
+  const struct timespec* base = virtual_clock_base(clock);
+  // CPU time clocks stay real
+  if (!base)
+    return original_clock_gettime(clock, tp);
+
+  long long nsec = base->tv_nsec + VIRTUAL_NS;
+  tp->tv_sec = base->tv_sec + nsec / 1000000000LL;
+  tp->tv_nsec = nsec % 1000000000LL;
+  return 0;
+}
+
+extern "C"
+int gettimeofday(struct timeval *tv, void *tz)
+{
+  resolve_time_functions();
+
+  if (!VIRTUAL_TIME)
+    return original_gettimeofday(tv, tz);
+
+  if (tz)
+    original_gettimeofday(NULL, tz);
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  tv->tv_sec = now.tv_sec;
+  tv->tv_usec = now.tv_nsec / 1000;
+  return 0;
+}
+
+static
+void resolve_time_functions()
+{
+  if (!original_clock_gettime) {
+    original_gettimeofday = (int (*)(struct timeval*, void*))dlsym(RTLD_NEXT, "gettimeofday");
+    original_clock_gettime = (int (*)(clockid_t, struct timespec*))dlsym(RTLD_NEXT, "clock_gettime");
+  }
+}
+
+// The real clock for chess.so itself, whatever the program under test sees
+static
+void real_time(clockid_t clock, struct timespec* tp)
+{
+  resolve_time_functions();
+  original_clock_gettime(clock, tp);
+}
+
+// Real time a virtual clock starts at, NULL for clocks that stay real
+static
+const struct timespec* virtual_clock_base(clockid_t clock)
+{
+  switch (clock) {
+    case CLOCK_REALTIME:
+    case CLOCK_REALTIME_COARSE:
+      return &REALTIME_BASE;
+    case CLOCK_MONOTONIC:
+    case CLOCK_MONOTONIC_RAW:
+    case CLOCK_MONOTONIC_COARSE:
+    case CLOCK_BOOTTIME:
+      return &MONOTONIC_BASE;
+    default:
+      return NULL;
+  }
+}
+
+// Deadline on the virtual clock of an absolute timeout on clock, none in real time
+static
+long long virtual_deadline(clockid_t clock, const struct timespec* abstime)
+{
+  if (!VIRTUAL_TIME)
+    return LLONG_MAX;
+  const struct timespec* base = virtual_clock_base(clock);
+  if (!base)
+    base = &REALTIME_BASE;
+  return (abstime->tv_sec - base->tv_sec) * 1000000000LL + (abstime->tv_nsec - base->tv_nsec);
+}
+
+// A timed wait that ended by timeout lasted until its deadline
+static
+void advance_virtual_time(long long deadline)
+{
+  if (VIRTUAL_TIME && VIRTUAL_NS < deadline)
+    VIRTUAL_NS = deadline;
+}
+
+static
+void virtual_sleep(long long nsec)
+{
+  SELF->status = THREAD_SLEEPING;
+  SELF->timed = true;
+  SELF->deadline = VIRTUAL_NS + nsec;
+
+  // Sync - Before sleeping
+  synchronization_point(SYNC_PT_SLEEP, NULL);
+
+  block_current_thread(NULL);
+
+  advance_virtual_time(SELF->deadline);
+  SELF->status = THREAD_RUNNING_NOT_WAITING_FOR_LOCK;
+  SELF->timed = false;
+}
+
+static 
+void switch_back_to_other_running_thread()
+{
+  // Hand the baton over without waiting for it, the calling thread is exiting
+  struct Thread_State* next = find_runnable_thread(SELF);
+  if (next)
+    pass_baton(next);
+}
+
+// Find the entry for key, adding it if insert is set. Returns NULL if key is not
+// present (or the table is full and it cannot be added).
+static
+struct Table_Entry* table_find(struct Table_Entry* table, size_t capacity, void* key, bool insert)
+{
+  size_t mask = capacity - 1;
+  // Fibonacci hashing: the high bits of the product depend on every bit of the
+  // key, the low bits only on its low bits, which aligned objects share
+  size_t slot = ((unsigned long long)(uintptr_t)key * 0x9E3779B97F4A7C15ULL) >> (64 - __builtin_ctzll(capacity));
+
+  struct Table_Entry* removed = NULL;
+  for (size_t probe = 0; probe < capacity; probe++, slot = (slot + 1) & mask) {
+    void* entry = __atomic_load_n(&table[slot].key, __ATOMIC_ACQUIRE);
+    if (entry == key)
+      return &table[slot];
+    if (entry == TABLE_REMOVED && !removed)
+      removed = &table[slot];
+    if (entry == NULL) {
+      if (!removed)
+        removed = &table[slot];
+      break;
+    }
+  }
+  if (!insert || !removed)
+    return NULL;
+  removed->value = -1;
+  __atomic_store_n(&removed->key, key, __ATOMIC_RELEASE);
+  return removed;
+}
+
+static
+void table_remove(struct Table_Entry* table, size_t capacity, void* key)
+{
+  struct Table_Entry* entry = table_find(table, capacity, key, false);
+  if (entry) {
+    __atomic_store_n(&entry->value, -1L, __ATOMIC_RELEASE);
+    __atomic_store_n(&entry->key, TABLE_REMOVED, __ATOMIC_RELEASE);
+  }
+}
+
+// Next free slot of the thread arena, the lowest a joined thread left or a new one,
+// registered once the thread exists. MAX_THREADS bounds the threads not yet joined.
+static
+struct Thread_State* new_thread_state()
+{
+  int index = THREAD_COUNT;
+  for (int i = 1; i < THREAD_COUNT; i++)
+    if (THREADS[i].reusable) {
+      index = i;
+      break;
+    }
+  if (index >= MAX_THREADS) {
+    fprintf(stderr, "TOO MANY THREADS, RAISE MAX_THREADS\n");
+    abort();
+  }
+  struct Thread_State* state = &THREADS[index];
+  memset(state, 0, sizeof(struct Thread_State));
+  state->index = index;
+  return state;
+}
+
+// The thread was joined, or never started: it leaves the state and the lookup tables
+static
+void release_thread_state(struct Thread_State* state)
+{
+  if (state->status != 0)
+    table_remove(THREAD_MAP, THREAD_TABLE_CAPACITY, (void*)state->thread);
+  if (STATE_CACHE)
+    STATE_HASH ^= state->state_hash;
+  state->state_hash = 0;
+  state->status = THREAD_TERMINATED;
+  state->reusable = true;
+}
+
+static
+void register_thread(pthread_t thread, struct Thread_State* state)
+{
+  struct Table_Entry* entry = table_find(THREAD_MAP, THREAD_TABLE_CAPACITY, (void*)thread, true);
+  if (!entry) {
+    fprintf(stderr, "THREAD TABLE FULL, RAISE THREAD_TABLE_CAPACITY\n");
+    abort();
+  }
+
+  state->thread = thread;
+  state->status = THREAD_RUNNING_NOT_WAITING_FOR_LOCK;
+  THREAD_COUNT = max(THREAD_COUNT, state->index + 1);
+  __atomic_store_n(&entry->value, (long)state->index, __ATOMIC_RELEASE);
+  // Initial priorities are above those of the change points
+  if (PCT)
+    state->priority = PREEMPTIONS.size() + 1 + (pct_random() >> 2);
+  if (STATE_CACHE)
+    update_state_hash(state);
+}
+
+static
+struct Thread_State* find_thread(pthread_t thread)
+{
+  struct Table_Entry* entry = table_find(THREAD_MAP, THREAD_TABLE_CAPACITY, (void*)thread, false);
+  long index = entry ? __atomic_load_n(&entry->value, __ATOMIC_ACQUIRE) : -1;
+  return index >= 0 ? &THREADS[index] : NULL;
+}
+
+static
+long mutex_owner(pthread_mutex_t* mutex)
+{
+  struct Table_Entry* entry = table_find(MUTEX_MAP, MUTEX_TABLE_CAPACITY, mutex, false);
+  return entry ? __atomic_load_n(&entry->value, __ATOMIC_ACQUIRE) : -1;
+}
+
+static
+void set_mutex_owner(pthread_mutex_t* mutex, long owner)
+{
+  struct Table_Entry* entry = table_find(MUTEX_MAP, MUTEX_TABLE_CAPACITY, mutex, true);
+  if (!entry) {
+    fprintf(stderr, "MUTEX TABLE FULL, RAISE MUTEX_TABLE_CAPACITY\n");
+    abort();
+  }
+  if (STATE_CACHE) {
+    long previous = __atomic_load_n(&entry->value, __ATOMIC_RELAXED);
+    if (previous >= 0)
+      STATE_HASH ^= mix_hash((uintptr_t)mutex, previous);
+    if (owner >= 0)
+      STATE_HASH ^= mix_hash((uintptr_t)mutex, owner);
+  }
+  __atomic_store_n(&entry->value, owner, __ATOMIC_RELEASE);
+}
+
+// Wait in the scheduler until mutex is free and take it. A timed wait may end with
+// the mutex still held, false is returned then.
+static
+bool acquire_mutex(pthread_mutex_t* mutex, bool timed, long long deadline)
+{
+  long owner = mutex_owner(mutex);
+  if (owner >= 0) {
+    if (CURRENT_MODE == DEBUG_MODE)
+      fprintf(stderr, "thread: %u, program lock 1 > executing thread: %u and waiting for it\n", pthread_self(), THREADS[owner].thread);
+    if (PROFILE_FILE_NAME)
+      profile_contention();
+    SELF->status = THREAD_RUNNING_WAITING_FOR_LOCK;
+    SELF->mutex = mutex;
+    SELF->timed = timed;
+    SELF->deadline = deadline;
+
+    // Select next available thread to execute, we prefer the thread holding this lock
+    block_current_thread(&THREADS[owner]);
+
+    SELF->status = THREAD_RUNNING_NOT_WAITING_FOR_LOCK;
+    SELF->mutex = NULL;
+    SELF->timed = false;
+
+    // Still held, the wait timed out
+    if (mutex_owner(mutex) >= 0) {
+      advance_virtual_time(deadline);
+      return false;
+    }
+  }
+
+  if (CURRENT_MODE == DEBUG_MODE)
+    fprintf(stderr, "thread: %u now holds program lock %x\n", pthread_self(), mutex);
+  set_mutex_owner(mutex, SELF->index);
+  if (TRACE_FILE_NAME)
+    record_event(EVENT_MUTEX_ACQUIRE, mutex);
+  if (EVENT_RINGS)
+    trace_event(TRACE_EVENT_LOCK, (unsigned long long)mutex);
+  if (RACE_DETECTION)
+    race_acquire(mutex);
+  return true;
+}
+
+static
+void release_mutex(pthread_mutex_t* mutex)
+{
+  set_mutex_owner(mutex, -1);
+  if (TRACE_FILE_NAME)
+    record_event(EVENT_MUTEX_RELEASE, mutex);
+  if (EVENT_RINGS)
+    trace_event(TRACE_EVENT_UNLOCK, (unsigned long long)mutex);
+  if (RACE_DETECTION)
+    race_release(mutex);
+}
+
+// Model of the object at key, created on first use
+static
+struct Sync_Object* sync_object(void* key)
+{
+  struct Table_Entry* entry = table_find(OBJECT_MAP, OBJECT_TABLE_CAPACITY, key, true);
+  if (!entry || (entry->value < 0 && OBJECT_COUNT >= MAX_SYNC_OBJECTS)) {
+    fprintf(stderr, "OBJECT TABLE FULL, RAISE MAX_SYNC_OBJECTS AND OBJECT_TABLE_CAPACITY\n");
+    abort();
+  }
+
+  if (entry->value < 0) {
+    struct Sync_Object* object = &OBJECTS[OBJECT_COUNT];
+    memset(object, 0, sizeof(struct Sync_Object));
+    object->key = key;
+    object->writer = -1;
+    __atomic_store_n(&entry->value, (long)OBJECT_COUNT++, __ATOMIC_RELEASE);
+  }
+  return &OBJECTS[__atomic_load_n(&entry->value, __ATOMIC_ACQUIRE)];
+}
+
+// An object initialized again may sit where an old one was destroyed
+static
+struct Sync_Object* reset_sync_object(void* key)
+{
+  struct Sync_Object* object = sync_object(key);
+  memset(object, 0, sizeof(struct Sync_Object));
+  object->key = key;
+  object->writer = -1;
+  return object;
+}
+
+// Every waiter present now may take the signal, but only as many as were signaled
+// wake. A signal without waiters is lost.
+static
+void signal_condition(struct Sync_Object* object, bool broadcast)
+{
+  object->signaled_below = object->tickets;
+
+  long eligible = 0;
+  for (int i = 0; i < THREAD_COUNT; i++)
+    if (THREADS[i].status == THREAD_WAITING_FOR_CONDITION && THREADS[i].object == object)
+      eligible++;
+
+  object->signals = broadcast ? eligible : min(object->signals + 1, eligible);
+}
+
+static
+int wait_for_condition(pthread_cond_t* cond, pthread_mutex_t* mutex, bool timed, long long deadline)
+{
+  struct Sync_Object* object = sync_object(cond);
+
+  // Sync - Before waiting
+  synchronization_point(SYNC_PT_COND_WAIT, cond);
+
+  use_sync_object(TRACE_EVENT_WAIT, cond);
+  release_mutex(mutex);
+  original_pthread_mutex_unlock(mutex);
+
+  SELF->status = THREAD_WAITING_FOR_CONDITION;
+  SELF->object = object;
+  SELF->ticket = object->tickets++;
+  SELF->timed = timed;
+  SELF->deadline = deadline;
+
+  block_current_thread(NULL);
+
+  // Otherwise picked by timeout or spuriously
+  bool signaled = object->signals > 0 && SELF->ticket < object->signaled_below;
+  if (signaled)
+    object->signals--;
+
+  SELF->status = THREAD_RUNNING_NOT_WAITING_FOR_LOCK;
+  SELF->object = NULL;
+  SELF->timed = false;
+
+  int ret = 0;
+  if (!signaled && timed) {
+    advance_virtual_time(deadline);
+    ret = ETIMEDOUT;
+  }
+  if (RACE_DETECTION)
+    race_acquire(cond);
+
+  acquire_mutex(mutex, false, 0);
+  original_pthread_mutex_lock(mutex);
+  return ret;
+}
+
+static
+bool rwlock_available(struct Sync_Object* object, bool exclusive)
+{
+  return object->writer < 0 && (!exclusive || object->readers == 0);
+}
+
+// Wait in the scheduler until the read (or write, if exclusive) lock is free and
+// take it. A timed wait may end without the lock, false is returned then.
+static
+bool acquire_rwlock(pthread_rwlock_t* rwlock, bool exclusive, bool timed, long long deadline)
+{
+  struct Sync_Object* object = sync_object(rwlock);
+
+  if (!rwlock_available(object, exclusive)) {
+    SELF->status = THREAD_WAITING_FOR_RWLOCK;
+    SELF->object = object;
+    SELF->exclusive = exclusive;
+    SELF->timed = timed;
+    SELF->deadline = deadline;
+
+    block_current_thread(object->writer >= 0 ? &THREADS[object->writer] : NULL);
+
+    SELF->status = THREAD_RUNNING_NOT_WAITING_FOR_LOCK;
+    SELF->object = NULL;
+    SELF->timed = false;
+
+    if (!rwlock_available(object, exclusive)) {
+      advance_virtual_time(deadline);
+      return false;
+    }
+  }
+
+  if (exclusive)
+    object->writer = SELF->index;
+  else
+    object->readers++;
+  if (TRACE_FILE_NAME)
+    record_event(EVENT_SYNC_OBJECT, rwlock);
+  if (EVENT_RINGS)
+    trace_event(TRACE_EVENT_LOCK, (unsigned long long)rwlock);
+  if (RACE_DETECTION)
+    race_acquire(rwlock);
+  return true;
+}
+
+// A semaphore first seen in use starts from the value of the program's semaphore
+static
+struct Sync_Object* semaphore_object(sem_t* sem)
+{
+  struct Sync_Object* object = sync_object(sem);
+  if (!object->initialized) {
+    int value = 0;
+    original_sem_getvalue(sem, &value);
+    object->value = value;
+    object->initialized = true;
+  }
+  return object;
+}
+
+// Wait in the scheduler until the semaphore is positive and decrement it. A timed
+// wait may end without decrementing it, false is returned then.
+static
+bool acquire_semaphore(sem_t* sem, bool timed, long long deadline)
+{
+  struct Sync_Object* object = semaphore_object(sem);
+
+  if (object->value == 0) {
+    SELF->status = THREAD_WAITING_FOR_SEMAPHORE;
+    SELF->object = object;
+    SELF->timed = timed;
+    SELF->deadline = deadline;
+
+    block_current_thread(NULL);
+
+    SELF->status = THREAD_RUNNING_NOT_WAITING_FOR_LOCK;
+    SELF->object = NULL;
+    SELF->timed = false;
+
+    if (object->value == 0) {
+      advance_virtual_time(deadline);
+      return false;
+    }
+  }
+
+  object->value--;
+  use_sync_object(TRACE_EVENT_SEM_WAIT, sem);
+  if (RACE_DETECTION)
+    race_acquire(sem);
+  return true;
+}
+
+// Record an operation on a condition variable, rwlock, semaphore or barrier
+static
+void use_sync_object(char kind, void* key)
+{
+  if (TRACE_FILE_NAME)
+    record_event(EVENT_SYNC_OBJECT, key);
+  if (EVENT_RINGS)
+    trace_event(kind, (unsigned long long)key);
+}
+
+static
+bool deadline_passed(struct Thread_State* state)
+{
+  return state->timed && VIRTUAL_NS >= state->deadline;
+}
+
+// The thread can go on without time passing
+static
+bool thread_is_ready(struct Thread_State* state)
+{
+  switch (state->status) {
+    case THREAD_RUNNING_NOT_WAITING_FOR_LOCK:
+      return true;
+    case THREAD_RUNNING_WAITING_FOR_LOCK:
+      return mutex_owner(state->mutex) < 0 || deadline_passed(state);
+    case THREAD_WAITING_FOR_JOINEE:
+      return state->joinee == NULL || state->joinee->status == THREAD_TERMINATED;
+    case THREAD_SLEEPING:
+      return VIRTUAL_NS >= state->deadline;
+    case THREAD_WAITING_FOR_CONDITION:
+      return (state->object->signals > 0 && state->ticket < state->object->signaled_below) || deadline_passed(state);
+    case THREAD_WAITING_FOR_RWLOCK:
+      return rwlock_available(state->object, state->exclusive) || deadline_passed(state);
+    case THREAD_WAITING_FOR_SEMAPHORE:
+      return state->object->value > 0 || deadline_passed(state);
+    case THREAD_WAITING_FOR_BARRIER:
+      return state->object->cycle > state->ticket;
+  }
+  return false;
+}
+
+// A thread in a timed wait can always run: scheduling it ends the wait by timeout.
+// So can a thread waiting on a condition variable, that is a spurious wakeup.
+static
+bool thread_is_runnable(struct Thread_State* state)
+{
+  return thread_is_ready(state) || state->timed || state->status == THREAD_WAITING_FOR_CONDITION;
+}
+
+// Find the next ready thread after current in creation order (round robin), or
+// the ready thread with the highest priority under PCT. If none is ready, time
+// passes: the timed wait with the earliest deadline ends.
+static
+struct Thread_State* find_runnable_thread(struct Thread_State* current)
+{
+  int start = current ? current->index + 1 : 0;
+
+  struct Thread_State* highest = NULL;
+  for (int i = 0; i < THREAD_COUNT; i++) {
+    struct Thread_State* candidate = &THREADS[(start + i) % THREAD_COUNT];
+    if (candidate == current || !thread_is_ready(candidate))
+      continue;
+    if (!PCT)
+      return candidate;
+    if (!highest || candidate->priority > highest->priority)
+      highest = candidate;
+  }
+  if (highest)
+    return highest;
+
+  struct Thread_State* earliest = NULL;
+  for (int i = 0; i < THREAD_COUNT; i++) {
+    struct Thread_State* candidate = &THREADS[(start + i) % THREAD_COUNT];
+    if (candidate != current && candidate->timed && (!earliest || candidate->deadline < earliest->deadline))
+      earliest = candidate;
+  }
+  return earliest;
+}
+
+// Park the calling thread until the scheduler baton is handed to it
+static
+void wait_for_baton(struct Thread_State* state)
+{
+  while (__atomic_exchange_n(&state->baton, 0, __ATOMIC_ACQUIRE) == 0)
+    syscall(SYS_futex, &state->baton, FUTEX_WAIT_PRIVATE, 0, NULL, NULL, 0);
+}
+
+// Make thread the only running thread, waking exactly that thread
+static
+void pass_baton(struct Thread_State* state)
+{
+  if (EVENT_RINGS)
+    trace_event(TRACE_EVENT_SWITCH, state->index);
+  // Only the thread holding the baton changes its status
+  if (STATE_CACHE && SELF)
+    update_state_hash(SELF);
+
+  CURRENT_THREAD = state->thread;
+  if (FIBERS)
+    return;
+  __atomic_store_n(&state->baton, 1, __ATOMIC_RELEASE);
+  syscall(SYS_futex, &state->baton, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+// Hand the baton to thread and park until it is handed back
+static
+void switch_to_thread(struct Thread_State* state)
+{
+  if (state == SELF)
+    return;
+
+  pass_baton(state);
+  if (FIBERS)
+    switch_fiber(state);
+  else
+    wait_for_baton(SELF);
+}
+
+// Run other threads until the calling thread becomes ready again
+// preferred is selected first if it is ready, except under PCT
+static
+void block_current_thread(struct Thread_State* preferred)
+{
+  while (!thread_is_ready(SELF)) {
+    struct Thread_State* next = PCT ? NULL : preferred;
+    if (!next || !thread_is_ready(next)) {
+      next = find_runnable_thread(SELF);
+      // Time passes and the earliest timed wait ends, which may be this one
+      if (SELF->timed && (!next || (!thread_is_ready(next) && SELF->deadline <= next->deadline)))
+        break;
+      // No thread can run, this is a deadlock
+      if (!next)
+        exit_deadlocked();
+    }
+    switch_to_thread(next);
+
+    // Picked while not ready, the wait ends by timeout or spuriously
+    if (thread_is_runnable(SELF))
+      break;
+  }
+}
+
+// The thread state waits for in the lock-wait graph, NULL if it is not blocked
+// or waits for a thread that is not blocked
+static
+struct Thread_State* waits_for(struct Thread_State* state)
+{
+  long owner;
+  switch (state->status) {
+    case THREAD_RUNNING_WAITING_FOR_LOCK:
+      owner = mutex_owner(state->mutex);
+      return owner >= 0 ? &THREADS[owner] : NULL;
+    case THREAD_WAITING_FOR_JOINEE:
+      return state->joinee;
+    case THREAD_WAITING_FOR_RWLOCK:
+      return state->object->writer >= 0 ? &THREADS[state->object->writer] : NULL;
+  }
+  return NULL;
+}
+
+static
+void print_wait(struct Thread_State* state)
+{
+  struct Thread_State* other = waits_for(state);
+  switch (state->status) {
+    case THREAD_RUNNING_WAITING_FOR_LOCK:
+      fprintf(stderr, "\tthread %d waits for mutex %p held by thread %d%s\n", state->index, state->mutex, other->index, other->status == THREAD_TERMINATED ? " (terminated)" : "");
+      break;
+    case THREAD_WAITING_FOR_JOINEE:
+      fprintf(stderr, "\tthread %d joins thread %d\n", state->index, other->index);
+      break;
+    case THREAD_WAITING_FOR_CONDITION:
+      fprintf(stderr, "\tthread %d waits for condition variable %p\n", state->index, state->object->key);
+      break;
+    case THREAD_WAITING_FOR_RWLOCK:
+      if (other)
+        fprintf(stderr, "\tthread %d waits for rwlock %p held by thread %d%s\n", state->index, state->object->key, other->index, other->status == THREAD_TERMINATED ? " (terminated)" : "");
+      else
+        fprintf(stderr, "\tthread %d waits for rwlock %p held by %ld readers\n", state->index, state->object->key, state->object->readers);
+      break;
+    case THREAD_WAITING_FOR_SEMAPHORE:
+      fprintf(stderr, "\tthread %d waits for semaphore %p\n", state->index, state->object->key);
+      break;
+    case THREAD_WAITING_FOR_BARRIER:
+      fprintf(stderr, "\tthread %d waits for barrier %p (%ld of %ld arrived)\n", state->index, state->object->key, state->object->arrived, state->object->needed);
+      break;
+  }
+}
+
+// Every live thread waits for a lock, a joinee or another object. A thread waiting
+// for a lock or joinee waits for exactly one other thread, so following the waits
+// from the running thread may enter a cycle, then print the cycle. Otherwise print
+// every waiting thread, and exit with DEADLOCK_EXIT_STATUS.
+static
+void exit_deadlocked()
+{
+  fprintf(stderr, "DEADLOCK AT SYNCHRONIZATION POINT %d\n", SELF->sync_pt);
+
+  struct Thread_State* state = SELF;
+  for (int i = 0; i < THREAD_COUNT && state && waits_for(state); i++)
+    state = waits_for(state);
+
+  if (state && waits_for(state)) {
+    struct Thread_State* start = state;
+    do {
+      print_wait(state);
+      state = waits_for(state);
+    } while (state != start);
+  } else {
+    for (int i = 0; i < THREAD_COUNT; i++)
+      if (THREADS[i].status != THREAD_TERMINATED)
+        print_wait(&THREADS[i]);
+  }
+
+  if (RECORD)
+    RECORD->deadlocked = 1;
+  exit_execution(DEADLOCK_EXIT_STATUS);
+}
+
+// Keep what the destructors would have written and exit with status, the other
+// threads stay parked
+static
+void exit_execution(int status)
+{
+  update_track_sync_pts_file();
+  write_trace_file();
+  write_event_trace();
+  write_profile();
+  finish_checkpoints();
+  _exit(status);
+}
+
+static
+void synchronization_point(char kind, void* object)
+{
+  if (CHESS_EXPLORE_MODE == EXPLORE_CHESS_SCHEDULES) {
+    int syncPt = SYNC_PTS_ITERATED++;
+    SELF->sync_pt = syncPt;
+    bool preempt = !FILTER || preemptible(kind, object);
+
+    if (TRACE_FILE_NAME)
+      record_sync_pt(syncPt, preempt);
+    if (RECORD || !REPLAY.empty())
+      record_decision(syncPt, kind, object);
+    if (PROFILE_FILE_NAME)
+      profile_sync_pt(kind, object);
+
+    if (FIRST_EXECUTION) {
+      TOTAL_EXECUTIONS++;
+      uintptr_t offset;
+      const char* module = site_location(CALL_SITE, kind, &offset);
+      fprintf(stderr, "\t\tSynchronization point %d found here (%s+%#lx)\n", TOTAL_EXECUTIONS, strrchr(module, '/') ? strrchr(module, '/') + 1 : module, (unsigned long)offset);
+    } else {
+      if (CHECKPOINTS)
+        checkpoint(syncPt);
+      if (STATE_CACHE)
+        prune_visited_state();
+      if (PCT) {
+        if (preempt)
+          pct_switch_thread(syncPt);
+      } else {
+        chess_switch_thread(syncPt, preempt);
+      }
+    }
+  }
+}
+
+// A preemption the filter excludes is used up without a switch
+static
+void chess_switch_thread(int syncPt, bool preempt)
+{
+  if (NEXT_PREEMPTION >= PREEMPTIONS.size() || PREEMPTIONS[NEXT_PREEMPTION].sync_pt != syncPt)
+    return;
+
+  int thread = PREEMPTIONS[NEXT_PREEMPTION++].thread;
+  if (!preempt)
+    return;
+
+  if (!SCHEDULE_FROM_TOOL) {
+    CURRENT_EXECUTION++;
+
+    // Reset current execution count when total reached
+    if (CURRENT_EXECUTION > TOTAL_EXECUTIONS)
+      CURRENT_EXECUTION = 1;
+
+    // Record the next execution right away so a crash in this one still advances it
+    update_track_sync_pts_file();
+  }
+
+  preempt_current_thread(thread);
+}
+
+// splitmix64
+static
+unsigned long long pct_random()
+{
+  unsigned long long x = (PCT_RANDOM += 0x9E3779B97F4A7C15ULL);
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+  return x ^ (x >> 31);
+}
+
+// PCT: at the ith change point the running thread drops to priority i, below the
+// initial priority of every thread. Then the ready thread with the highest priority
+// runs, which may be a thread created or woken since the last synchronization point.
+static
+void pct_switch_thread(int syncPt)
+{
+  for (; NEXT_PREEMPTION < PREEMPTIONS.size() && PREEMPTIONS[NEXT_PREEMPTION].sync_pt <= syncPt; NEXT_PREEMPTION++)
+    if (PREEMPTIONS[NEXT_PREEMPTION].sync_pt == syncPt)
+      SELF->priority = NEXT_PREEMPTION + 1;
+
+  struct Thread_State* next = find_runnable_thread(SELF);
+  if (!next || !thread_is_ready(next) || (thread_is_ready(SELF) && next->priority <= SELF->priority))
+    return;
+
+  if (CURRENT_DECISION)
+    CURRENT_DECISION->next = next->index;
+  switch_to_thread(next);
+}
+
+// Switch to thread (creation index) although the running thread could go on
+static
+void preempt_current_thread(int thread)
+{
+  struct Thread_State* next = NULL;
+
+  if (thread < 0)
+    next = find_runnable_thread(SELF);
+  // The schedule no longer matches this execution if thread cannot run, ignore it
+  else if (thread < THREAD_COUNT && thread_is_runnable(&THREADS[thread]))
+    next = &THREADS[thread];
+
+  if (!next)
+    return;
+
+  if (CURRENT_DECISION)
+    CURRENT_DECISION->next = next->index;
+  switch_to_thread(next);
+}
+
+// Append "<sync point> <running thread> <enabled threads>" to the trace. Where the
+// filter allows no preemption only the running thread is enabled.
+static
+void record_sync_pt(int syncPt, bool preempt)
+{
+  char line[32];
+  snprintf(line, sizeof(line), "%d %d ", syncPt, SELF->index);
+  TRACE.append(line);
+  if (!preempt) {
+    snprintf(line, sizeof(line), "%d\n", SELF->index);
+    TRACE.append(line);
+    return;
+  }
+
+  const char* separator = "";
+  for (int i = 0; i < THREAD_COUNT; i++) {
+    if (thread_is_runnable(&THREADS[i])) {
+      snprintf(line, sizeof(line), "%s%d", separator, i);
+      TRACE.append(line);
+      separator = ",";
+    }
+  }
+  TRACE.append("\n");
+}
+
+// Append "E <sync point> <kind> <object>" to the trace: the running thread performed
+// an operation after passing that synchronization point, so preempting it there
+// delays the operation
+static
+void record_event(char kind, void* object)
+{
+  char line[64];
+  snprintf(line, sizeof(line), "E %d %c %p\n", SELF->sync_pt, kind, object);
+  TRACE.append(line);
+}
+
+static __attribute__((destructor))
+void write_trace_file()
+{
+  if (!TRACE_FILE_NAME)
+    return;
+
+  ofstream outfile;
+  outfile.open(TRACE_FILE_NAME);
+
+  if (outfile)
+    outfile.write(TRACE.c_str(), (int)TRACE.length());
+
+  outfile.close();
+}
+
+// Append the decision at this synchronization point to the record file and check
+// it against the decision being replayed. The thread that runs next is filled in
+// by preempt_current_thread if the running thread is switched out.
+static
+void record_decision(int syncPt, char kind, void* object)
+{
+  struct Decision decision;
+  memset(&decision, 0, sizeof(decision));
+  decision.sync_pt = syncPt;
+  decision.running = SELF->index;
+  decision.next = SELF->index;
+  decision.mutex = object ? mutex_id((pthread_mutex_t*)object) : -1;
+  decision.kind = kind;
+
+  if (!REPLAY.empty() && !REPLAY_DIVERGED) {
+    struct Decision* expected = syncPt <= (int)REPLAY.size() ? &REPLAY[syncPt - 1] : NULL;
+    if (!expected || expected->running != decision.running || expected->kind != decision.kind || expected->mutex != decision.mutex) {
+      fprintf(stderr, "REPLAY DIVERGED AT SYNCHRONIZATION POINT %d\n", syncPt);
+      REPLAY_DIVERGED = true;
+    }
+  }
+
+  append_decision(&decision);
+}
+
+// Append a decision to the record file, growing it when it is full
+static
+void append_decision(struct Decision* decision)
+{
+  if (!RECORD)
+    return;
+
+  if ((size_t)RECORD->count == RECORD_CAPACITY) {
+    size_t capacity = RECORD_CAPACITY * 2;
+    size_t size = sizeof(struct Decision_File_Header) + capacity * sizeof(struct Decision);
+    void* mapped = MAP_FAILED;
+    if (ftruncate(RECORD_FD, size) == 0)
+      mapped = mremap(RECORD, sizeof(struct Decision_File_Header) + RECORD_CAPACITY * sizeof(struct Decision), size, MREMAP_MAYMOVE);
+    if (mapped == MAP_FAILED) {
+      fprintf(stderr, "CANNOT GROW RECORD FILE, RECORDING STOPPED\n");
+      close_record_file();
+      CURRENT_DECISION = NULL;
+      return;
+    }
+    RECORD = (struct Decision_File_Header*)mapped;
+    RECORD_CAPACITY = capacity;
+  }
+
+  CURRENT_DECISION = (struct Decision*)(RECORD + 1) + RECORD->count;
+  *CURRENT_DECISION = *decision;
+  RECORD->count++;
+}
+
+// Module of a call site and its offset in it. A return address is just after the
+// call, the start routine of a thread is the site itself.
+static
+const char* site_location(void* site, char kind, uintptr_t* offset)
+{
+  Dl_info info;
+  *offset = (uintptr_t)site;
+  if (!site || !dladdr(site, &info) || !info.dli_fname)
+    return "?";
+  *offset = (uintptr_t)site - (uintptr_t)info.dli_fbase - (kind == SYNC_PT_THREAD_START ? 0 : 1);
+  return info.dli_fname;
+}
+
+// Count the synchronization point at the call site of the running thread, and the
+// object it uses if the site did not use it before
+static
+void profile_sync_pt(char kind, void* object)
+{
+  struct Table_Entry* entry = table_find(PROFILE_MAP, PROFILE_TABLE_CAPACITY, CALL_SITE, true);
+  if (!entry)
+    return;
+  if (entry->value < 0) {
+    if (PROFILE_SITE_COUNT >= MAX_PROFILE_SITES)
+      return;
+    entry->value = PROFILE_SITE_COUNT++;
+    PROFILE_SITES[entry->value].site = CALL_SITE;
+    PROFILE_SITES[entry->value].kind = kind;
+  }
+
+  struct Site_Profile* profile = &PROFILE_SITES[entry->value];
+  profile->sync_pts++;
+  if (FIRST_EXECUTION) {
+    if (PROFILE_POINT_COUNT == PROFILE_POINT_CAPACITY) {
+      PROFILE_POINT_CAPACITY = PROFILE_POINT_CAPACITY ? 2 * PROFILE_POINT_CAPACITY : 1024;
+      PROFILE_POINTS = (void**)realloc(PROFILE_POINTS, PROFILE_POINT_CAPACITY * sizeof(void*));
+    }
+    PROFILE_POINTS[PROFILE_POINT_COUNT++] = CALL_SITE;
+  }
+
+  // One entry per pair of call site and object
+  void* pair = (void*)((uintptr_t)object ^ ((uintptr_t)CALL_SITE * 0x9E3779B97F4A7C15ULL));
+  struct Table_Entry* used = object ? table_find(PROFILE_OBJECTS, PROFILE_OBJECT_TABLE_CAPACITY, pair, true) : NULL;
+  if (used && used->value < 0) {
+    used->value = 1;
+    profile->objects++;
+  }
+}
+
+static
+void profile_contention()
+{
+  struct Table_Entry* entry = table_find(PROFILE_MAP, PROFILE_TABLE_CAPACITY, CALL_SITE, false);
+  if (entry && entry->value >= 0)
+    PROFILE_SITES[entry->value].contended++;
+}
+
+// "site <module> <offset> <kind> <sync points> <objects> <contended>" per call site,
+// then for the first execution "point <sync point> <module> <offset>" per point
+static __attribute__((destructor))
+void write_profile()
+{
+  if (!PROFILE_FILE_NAME)
+    return;
+
+  FILE* file = fopen(PROFILE_FILE_NAME, "w");
+  if (!file)
+    return;
+
+  uintptr_t offset;
+  for (int i = 0; i < PROFILE_SITE_COUNT; i++) {
+    struct Site_Profile* profile = &PROFILE_SITES[i];
+    const char* module = site_location(profile->site, profile->kind, &offset);
+    fprintf(file, "site %s %#lx %c %ld %ld %ld\n", module, (unsigned long)offset, profile->kind, profile->sync_pts, profile->objects, profile->contended);
+  }
+  for (size_t i = 0; i < PROFILE_POINT_COUNT; i++) {
+    struct Table_Entry* entry = table_find(PROFILE_MAP, PROFILE_TABLE_CAPACITY, PROFILE_POINTS[i], false);
+    const char* module = site_location(PROFILE_POINTS[i], PROFILE_SITES[entry->value].kind, &offset);
+    fprintf(file, "point %d %s %#lx\n", (int)i + 1, module, (unsigned long)offset);
+  }
+  fclose(file);
+  PROFILE_FILE_NAME = NULL;
+}
+
+struct Module_Search {
+  const char* name;
+  const char* program;
+  uintptr_t bias;
+  bool found;
+};
+
+static
+int find_module(struct dl_phdr_info* info, size_t, void* data)
+{
+  struct Module_Search* search = (struct Module_Search*)data;
+  const char* path = info->dlpi_name && *info->dlpi_name ? info->dlpi_name : search->program;
+  const char* name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+  if (strcmp(name, search->name) != 0)
+    return 0;
+  search->bias = info->dlpi_addr;
+  search->found = true;
+  return 1;
+}
+
+// Load bias of the loaded module with that file name, what turns its link time
+// addresses (nm, objdump) into addresses of this process. The program is the
+// module without a name.
+static
+uintptr_t module_bias(const char* name)
+{
+  static char program[PATH_MAX];
+  if (!*program) {
+    ssize_t length = readlink("/proc/self/exe", program, sizeof(program) - 1);
+    program[length > 0 ? length : 0] = 0;
+  }
+
+  struct Module_Search search = { name, program, 0, false };
+  dl_iterate_phdr(find_module, &search);
+  return search.found ? search.bias : UINTPTR_MAX;
+}
+
+// Lines chesstool resolved from --filter, in link time addresses of a module:
+//   "site <module> <first> <last>"     call sites in [first, last)
+//   "object <module> <address>"        mutex or other synchronization object
+// The module "-" takes the addresses as they are. Modules not loaded are skipped.
+static
+void read_preemption_filter(const char* fileName)
+{
+  FILE* file = fopen(fileName, "r");
+  if (!file) {
+    fprintf(stderr, "CANNOT READ PREEMPTION FILTER %s\n", fileName);
+    return;
+  }
+
+  FILTER = true;
+  char line[PATH_MAX + 64], tag[16], module[PATH_MAX];
+  unsigned long first, last;
+  while (fgets(line, sizeof(line), file)) {
+    int fields = sscanf(line, "%15s %4095s %lx %lx", tag, module, &first, &last);
+    if (fields < 3)
+      continue;
+    uintptr_t bias = strcmp(module, "-") == 0 ? 0 : module_bias(module);
+    if (bias == UINTPTR_MAX)
+      continue;
+
+    if (strcmp(tag, "site") == 0 && fields == 4 && FILTER_SITE_COUNT < MAX_FILTER_SITES) {
+      FILTER_SITES[FILTER_SITE_COUNT].first = bias + first;
+      FILTER_SITES[FILTER_SITE_COUNT].last = bias + last;
+      FILTER_SITE_COUNT++;
+    } else if (strcmp(tag, "object") == 0) {
+      struct Table_Entry* entry = table_find(FILTER_OBJECTS, FILTER_OBJECT_TABLE_CAPACITY, (void*)(bias + first), true);
+      if (entry)
+        entry->value = 1;
+    }
+  }
+  fclose(file);
+}
+
+// Whether the filter lets the running thread be preempted at a synchronization
+// point, by the call site (the call instruction, before the return address) or
+// by the object it uses
+static
+bool preemptible(char kind, void* object)
+{
+  uintptr_t site = (uintptr_t)CALL_SITE - (kind == SYNC_PT_THREAD_START ? 0 : 1);
+  for (int i = 0; i < FILTER_SITE_COUNT; i++)
+    if (site >= FILTER_SITES[i].first && site < FILTER_SITES[i].last)
+      return true;
+
+  struct Table_Entry* entry = object ? table_find(FILTER_OBJECTS, FILTER_OBJECT_TABLE_CAPACITY, object, false) : NULL;
+  return entry && entry->value > 0;
+}
+
+// Mutexes are named by order of first use, their addresses change between runs
+static
+int mutex_id(pthread_mutex_t* mutex)
+{
+  struct Table_Entry* entry = table_find(MUTEX_IDS, MUTEX_TABLE_CAPACITY, mutex, true);
+  if (!entry)
+    return -1;
+  if (entry->value < 0)
+    entry->value = MUTEX_COUNT++;
+  return entry->value;
+}
+
+// The record file is mapped shared, every decision reaches the file even if the
+// program crashes before its destructors run. The header count says how many
+// decisions are valid, so a file left by the previous execution is reused as is.
+static
+void open_record_file(const char* fileName)
+{
+  RECORD_FD = open(fileName, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (RECORD_FD < 0)
+    return;
+
+  struct stat st;
+  size_t size = sizeof(struct Decision_File_Header) + DECISION_FILE_INITIAL_CAPACITY * sizeof(struct Decision);
+  void* mapped = MAP_FAILED;
+  if (fstat(RECORD_FD, &st) == 0 && ((size_t)st.st_size >= size || ftruncate(RECORD_FD, size) == 0))
+    mapped = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, RECORD_FD, 0);
+  if (mapped == MAP_FAILED) {
+    fprintf(stderr, "CANNOT MAP RECORD FILE %s\n", fileName);
+    close(RECORD_FD);
+    RECORD_FD = -1;
+    return;
+  }
+
+  RECORD = (struct Decision_File_Header*)mapped;
+  RECORD_CAPACITY = DECISION_FILE_INITIAL_CAPACITY;
+  memcpy(RECORD->magic, DECISION_FILE_MAGIC, sizeof(RECORD->magic));
+  RECORD->version = DECISION_FILE_VERSION;
+  RECORD->count = 0;
+  RECORD->deadlocked = 0;
+}
+
+// Report a replay that ended early and unmap the record file
+static __attribute__((destructor))
+void close_record_file()
+{
+  if (!REPLAY.empty() && !REPLAY_DIVERGED && original_pthread_mutex_lock && SYNC_PTS_ITERATED - 1 != (int)REPLAY.size()) {
+    fprintf(stderr, "REPLAY DIVERGED AT SYNCHRONIZATION POINT %d\n", SYNC_PTS_ITERATED);
+    REPLAY_DIVERGED = true;
+  }
+
+  if (!RECORD)
+    return;
+
+  munmap(RECORD, sizeof(struct Decision_File_Header) + RECORD_CAPACITY * sizeof(struct Decision));
+  close(RECORD_FD);
+  RECORD = NULL;
+  RECORD_FD = -1;
+}
+
+static
+unsigned long long mix_hash(unsigned long long a, unsigned long long b)
+{
+  unsigned long long x = a * 0x9E3779B97F4A7C15ULL ^ b;
+  x ^= x >> 30;
+  x *= 0xBF58476D1CE4E5B9ULL;
+  x ^= x >> 27;
+  x *= 0x94D049BB133111EBULL;
+  return x ^ (x >> 31);
+}
+
+// Replace the part of STATE_HASH for thread state by its current status and count
+static
+void update_state_hash(struct Thread_State* state)
+{
+  unsigned long long hash = mix_hash(mix_hash(state->index, state->status), state->sync_pts);
+  STATE_HASH ^= state->state_hash ^ hash;
+  state->state_hash = hash;
+}
+
+// The state cache file is created by chesstool and mapped shared like the record file
+static
+void open_state_cache(const char* fileName)
+{
+  int fd = open(fileName, O_RDWR | O_CLOEXEC);
+  if (fd < 0)
+    return;
+
+  struct State_Cache_Header header;
+  void* mapped = MAP_FAILED;
+  if (pread(fd, &header, sizeof(header), 0) == sizeof(header) && memcmp(header.magic, STATE_CACHE_MAGIC, sizeof(header.magic)) == 0
+    && header.version == STATE_CACHE_VERSION && header.capacity > 0 && (header.capacity & (header.capacity - 1)) == 0)
+    mapped = mmap(NULL, sizeof(header) + header.capacity * sizeof(unsigned long long), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (mapped == MAP_FAILED) {
+    fprintf(stderr, "CANNOT MAP STATE CACHE %s\n", fileName);
+    return;
+  }
+  STATE_CACHE = (struct State_Cache_Header*)mapped;
+}
+
+// Add the state hash reached with preemptions, returns true if it was already reached
+// with no more preemptions. Executions in parallel share the table, slots are claimed
+// with compare and swap. A table three quarters full takes no more states.
+static
+bool visit_state(unsigned long long hash, int preemptions)
+{
+  unsigned long long* entries = (unsigned long long*)(STATE_CACHE + 1);
+  size_t mask = STATE_CACHE->capacity - 1;
+  unsigned long long key = hash & ~0xFFULL;
+  unsigned long long entry = key | (preemptions < 0xFF ? preemptions : 0xFF);
+  if (key == 0)
+    key = entry = 0x100;
+
+  size_t slot = (key >> 8) & mask;
+  for (size_t probe = 0; probe <= mask; probe++, slot = (slot + 1) & mask) {
+    unsigned long long found = __atomic_load_n(&entries[slot], __ATOMIC_ACQUIRE);
+    while ((found & ~0xFFULL) == key) {
+      if (found <= entry)
+        return true;
+      // Reached with fewer preemptions than before
+      if (__atomic_compare_exchange_n(&entries[slot], &found, entry, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return false;
+    }
+    if (found != 0)
+      continue;
+
+    if (__atomic_load_n(&STATE_CACHE->count, __ATOMIC_RELAXED) * 4 >= STATE_CACHE->capacity * 3)
+      return false;
+    if (__atomic_compare_exchange_n(&entries[slot], &found, entry, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      __atomic_fetch_add(&STATE_CACHE->count, 1, __ATOMIC_RELAXED);
+      return false;
+    }
+    // Another execution took the slot, look at it again
+    slot = (slot - 1) & mask;
+    probe--;
+  }
+  return false;
+}
+
+// The abstract state at this synchronization point is the status and the number of
+// synchronization points passed of every thread, the owner of every held mutex and
+// the running thread. Every state reached with n preemptions was run on from without
+// further preemptions by some execution, and iterative bounding gave those executions
+// at least the preemptions left to this one. So once its last preemption is made, an
+// execution reaching a state cached with no more preemptions stops: the rest of it,
+// and of every schedule extending it from here, was explored before.
+static
+void prune_visited_state()
+{
+  if (!SCHEDULE_FROM_TOOL || !REPLAY.empty())
+    return;
+
+  SELF->sync_pts++;
+  update_state_hash(SELF);
+  unsigned long long hash = STATE_HASH ^ mix_hash(SELF->index, ~0ULL);
+
+  // An execution forking checkpoints has preemptions ahead as long as checkpoints are
+  if (visit_state(hash, NEXT_PREEMPTION) && NEXT_PREEMPTION >= PREEMPTIONS.size() && NEXT_CHECKPOINT >= CHECKPOINT_COUNT) {
+    fprintf(stderr, "STATE AT SYNCHRONIZATION POINT %d ALREADY EXPLORED, EXECUTION PRUNED\n", SELF->sync_pt);
+    exit_execution(PRUNED_EXIT_STATUS);
+  }
+}
+
+// Force the schedule of a decision file: the running thread is switched out
+// wherever the recorded next thread differs from it
+static
+void read_replay_file(const char* fileName)
+{
+  struct Decision_File_Header header;
+  FILE* file = fopen(fileName, "rb");
+  if (!file || fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, DECISION_FILE_MAGIC, sizeof(header.magic)) != 0 || header.version != DECISION_FILE_VERSION || header.count < 0) {
+    fprintf(stderr, "CORRUPT REPLAY FILE %s\n", fileName);
+    if (file)
+      fclose(file);
+    return;
+  }
+
+  REPLAY.resize(header.count);
+  if (header.count > 0 && fread(&REPLAY[0], sizeof(struct Decision), header.count, file) != (size_t)header.count) {
+    fprintf(stderr, "CORRUPT REPLAY FILE %s\n", fileName);
+    REPLAY.clear();
+  }
+  fclose(file);
+
+  for (size_t i = 0; i < REPLAY.size(); i++) {
+    if (REPLAY[i].next == REPLAY[i].running)
+      continue;
+    struct Preemption preemption;
+    preemption.sync_pt = REPLAY[i].sync_pt;
+    preemption.thread = REPLAY[i].next;
+    PREEMPTIONS.push_back(preemption);
+  }
+}
+
+// Timestamp counter ticks, or nanoseconds where there is no TSC
+static
+unsigned long long read_timestamp()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec now;
+  real_time(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000ULL + now.tv_nsec;
+#endif
+}
+
+// Rings for every possible thread are reserved up front, pages are only
+// backed once a thread records into them
+static
+void open_event_trace(const char* fileName)
+{
+  void* mapped = mmap(NULL, MAX_THREADS * sizeof(struct Event_Ring), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (mapped == MAP_FAILED) {
+    fprintf(stderr, "CANNOT ALLOCATE EVENT TRACE BUFFERS\n");
+    return;
+  }
+
+  EVENT_TRACE_FILE_NAME = fileName;
+  real_time(CLOCK_MONOTONIC, &EVENT_TRACE_START_TIME);
+  EVENT_TRACE_START = read_timestamp();
+  EVENT_RINGS = (struct Event_Ring*)mapped;
+}
+
+// Append an event to the ring of the calling thread, no locks and no allocation
+static
+void trace_event(char kind, unsigned long long object)
+{
+  if (!SELF)
+    return;
+
+  struct Event_Ring* ring = &EVENT_RINGS[SELF->index];
+  unsigned long long head = ring->head;
+  struct Trace_Event* event = &ring->events[head & (EVENT_RING_CAPACITY - 1)];
+  event->timestamp = read_timestamp();
+  event->object = object;
+  event->sync_pt = SELF->sync_pt;
+  event->thread = SELF->index;
+  event->kind = kind;
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Flush every ring to CHESS_EVENT_TRACE, chesstrace converts the file to JSON
+static __attribute__((destructor))
+void write_event_trace()
+{
+  if (!EVENT_RINGS)
+    return;
+
+  struct timespec end;
+  real_time(CLOCK_MONOTONIC, &end);
+  unsigned long long ticks = read_timestamp() - EVENT_TRACE_START;
+  double us = (end.tv_sec - EVENT_TRACE_START_TIME.tv_sec) * 1e6 + (end.tv_nsec - EVENT_TRACE_START_TIME.tv_nsec) / 1e3;
+
+  struct Event_File_Header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, EVENT_FILE_MAGIC, sizeof(header.magic));
+  header.version = EVENT_FILE_VERSION;
+  header.start = EVENT_TRACE_START;
+  header.ticks_per_us = us > 0 ? ticks / us : 1;
+  for (int i = 0; i < THREAD_COUNT; i++) {
+    unsigned long long head = __atomic_load_n(&EVENT_RINGS[i].head, __ATOMIC_ACQUIRE);
+    header.count += head < EVENT_RING_CAPACITY ? head : EVENT_RING_CAPACITY;
+    header.dropped += head < EVENT_RING_CAPACITY ? 0 : head - EVENT_RING_CAPACITY;
+  }
+
+  FILE* file = fopen(EVENT_TRACE_FILE_NAME, "wb");
+  if (!file) {
+    fprintf(stderr, "CANNOT WRITE EVENT TRACE %s\n", EVENT_TRACE_FILE_NAME);
+    return;
+  }
+
+  fwrite(&header, sizeof(header), 1, file);
+  for (int i = 0; i < THREAD_COUNT; i++) {
+    struct Event_Ring* ring = &EVENT_RINGS[i];
+    unsigned long long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    unsigned long long first = head < EVENT_RING_CAPACITY ? 0 : head - EVENT_RING_CAPACITY;
+    for (unsigned long long e = first; e < head; e++)
+      fwrite(&ring->events[e & (EVENT_RING_CAPACITY - 1)], sizeof(struct Trace_Event), 1, file);
+  }
+  fclose(file);
+}
+
+// Happens-before race detection in the style of FastTrack. Every thread has a vector
+// clock, and so has every mutex or other object it synchronizes through: a release
+// joins the thread clock into the object clock, an acquire joins it back. Each
+// 8-byte word of memory keeps the epochs of its last write and last read in 8 bytes
+// of shadow, an access not ordered after them is a race. Only the last read is
+// kept, so of two unordered reads the older one is no longer checked, and accesses
+// are tracked per word, so unordered writes to different bytes of a word race too.
+static
+void open_race_detector()
+{
+  size_t directorySize = (1UL << (SHADOW_ADDRESS_BITS - SHADOW_CHUNK_SHIFT)) * sizeof(struct Shadow_Word*);
+  void* directory = mmap(NULL, directorySize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  void* threadClocks = mmap(NULL, RACE_MAX_THREADS * sizeof(struct Vector_Clock), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  void* syncClocks = mmap(NULL, RACE_MAX_CLOCKS * sizeof(struct Vector_Clock), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (directory == MAP_FAILED || threadClocks == MAP_FAILED || syncClocks == MAP_FAILED) {
+    fprintf(stderr, "CANNOT ALLOCATE RACE DETECTOR SHADOW MEMORY\n");
+    return;
+  }
+
+  SHADOW_DIRECTORY = (struct Shadow_Word**)directory;
+  THREAD_CLOCKS = (struct Vector_Clock*)threadClocks;
+  SYNC_CLOCKS = (struct Vector_Clock*)syncClocks;
+  // The initializing thread starts at clock 1, 0 means no access in the shadow
+  THREAD_CLOCKS[0].clock[0] = 1;
+  RACE_DETECTION = true;
+}
+
+static
+unsigned int current_epoch()
+{
+  return ((unsigned int)SELF->index << RACE_CLOCK_BITS) | THREAD_CLOCKS[SELF->index].clock[SELF->index];
+}
+
+static
+bool happens_before(unsigned int epoch, struct Vector_Clock* clock)
+{
+  return (epoch & ((1U << RACE_CLOCK_BITS) - 1)) <= clock->clock[epoch >> RACE_CLOCK_BITS];
+}
+
+static
+void join_clock(struct Vector_Clock* into, struct Vector_Clock* from)
+{
+  int threads = min(THREAD_COUNT, RACE_MAX_THREADS);
+  for (int i = 0; i < threads; i++)
+    if (into->clock[i] < from->clock[i])
+      into->clock[i] = from->clock[i];
+}
+
+// Start a new epoch of the calling thread after it released something
+static
+void tick_clock()
+{
+  unsigned int* clock = &THREAD_CLOCKS[SELF->index].clock[SELF->index];
+  if (++*clock >= (1U << RACE_CLOCK_BITS) - 1) {
+    fprintf(stderr, "RACE DETECTOR CLOCK OVERFLOW, RACE DETECTION STOPPED\n");
+    RACE_DETECTION = false;
+  }
+}
+
+// Vector clock of a synchronization object, NULL once all are in use
+static
+struct Vector_Clock* sync_clock(void* object)
+{
+  struct Table_Entry* entry = table_find(SYNC_CLOCK_MAP, 2 * RACE_MAX_CLOCKS, object, true);
+  if (!entry || (entry->value < 0 && SYNC_CLOCK_COUNT >= RACE_MAX_CLOCKS))
+    return NULL;
+  if (entry->value < 0)
+    entry->value = SYNC_CLOCK_COUNT++;
+  return &SYNC_CLOCKS[entry->value];
+}
+
+static
+void race_acquire(void* object)
+{
+  if (!SELF || SELF->index >= RACE_MAX_THREADS)
+    return;
+  struct Vector_Clock* clock = sync_clock(object);
+  if (clock)
+    join_clock(&THREAD_CLOCKS[SELF->index], clock);
+}
+
+static
+void race_release(void* object)
+{
+  if (!SELF || SELF->index >= RACE_MAX_THREADS)
+    return;
+  struct Vector_Clock* clock = sync_clock(object);
+  if (clock)
+    join_clock(clock, &THREAD_CLOCKS[SELF->index]);
+  tick_clock();
+}
+
+// The new thread starts after everything its creator did so far. In the slot of
+// a joined thread, its epochs go on from those of the joined thread.
+static
+void race_fork(struct Thread_State* child)
+{
+  if (!SELF || SELF->index >= RACE_MAX_THREADS || child->index >= RACE_MAX_THREADS)
+    return;
+  struct Vector_Clock* clock = &THREAD_CLOCKS[child->index];
+  unsigned int previous = clock->clock[child->index];
+  memcpy(clock, &THREAD_CLOCKS[SELF->index], sizeof(struct Vector_Clock));
+  clock->clock[child->index] = max(previous, clock->clock[child->index]) + 1;
+  tick_clock();
+}
+
+static
+void race_join(struct Thread_State* joinee)
+{
+  if (!SELF || SELF->index >= RACE_MAX_THREADS || joinee->index >= RACE_MAX_THREADS)
+    return;
+  join_clock(&THREAD_CLOCKS[SELF->index], &THREAD_CLOCKS[joinee->index]);
+}
+
+// Shadow of the word at address, NULL outside the covered address space
+static
+struct Shadow_Word* shadow_word(uintptr_t address)
+{
+  if (address >> SHADOW_ADDRESS_BITS)
+    return NULL;
+
+  struct Shadow_Word** chunk = &SHADOW_DIRECTORY[address >> SHADOW_CHUNK_SHIFT];
+  if (!*chunk) {
+    void* mapped = mmap(NULL, 1UL << SHADOW_CHUNK_SHIFT, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mapped == MAP_FAILED)
+      return NULL;
+    *chunk = (struct Shadow_Word*)mapped;
+  }
+  return &(*chunk)[(address & ((1UL << SHADOW_CHUNK_SHIFT) - 1)) >> 3];
+}
+
+// Forget the accesses to memory that is freed or becomes a new thread's stack.
+// Whole pages of shadow are dropped instead of written, so large ranges stay cheap.
+static
+void clear_shadow(void* begin, size_t size)
+{
+  uintptr_t address = (uintptr_t)begin & ~7UL;
+  uintptr_t end = (uintptr_t)begin + size;
+  if (end >> SHADOW_ADDRESS_BITS)
+    return;
+
+  while (address < end) {
+    uintptr_t chunkEnd = min(end, (address | ((1UL << SHADOW_CHUNK_SHIFT) - 1)) + 1);
+    struct Shadow_Word* chunk = SHADOW_DIRECTORY[address >> SHADOW_CHUNK_SHIFT];
+    if (chunk) {
+      char* from = (char*)&chunk[(address & ((1UL << SHADOW_CHUNK_SHIFT) - 1)) >> 3];
+      char* to = from + ((chunkEnd - address + 7) >> 3) * sizeof(struct Shadow_Word);
+      char* pagesFrom = (char*)(((uintptr_t)from + 4095) & ~4095UL);
+      char* pagesTo = (char*)((uintptr_t)to & ~4095UL);
+      if (pagesFrom < pagesTo) {
+        memset(from, 0, pagesFrom - from);
+        madvise(pagesFrom, pagesTo - pagesFrom, MADV_DONTNEED);
+        memset(pagesTo, 0, to - pagesTo);
+      } else {
+        memset(from, 0, to - from);
+      }
+    }
+    address = chunkEnd;
+  }
+}
+
+static
+void race_access(void* address, size_t size, bool write, void* pc)
+{
+  if (!SELF || SELF->index >= RACE_MAX_THREADS)
+    return;
+
+  struct Vector_Clock* clock = &THREAD_CLOCKS[SELF->index];
+  unsigned int epoch = current_epoch();
+  uintptr_t end = (uintptr_t)address + size;
+
+  for (uintptr_t word = (uintptr_t)address & ~7UL; word < end; word += 8) {
+    struct Shadow_Word* shadow = shadow_word(word);
+    if (!shadow)
+      return;
+
+    if (write) {
+      if (shadow->write == epoch)
+        continue;
+      if (shadow->write && !happens_before(shadow->write, clock))
+        report_race(address, true, shadow->write, true, pc);
+      else if (shadow->read && !happens_before(shadow->read, clock))
+        report_race(address, true, shadow->read, false, pc);
+      shadow->write = epoch;
+    } else {
+      if (shadow->read == epoch)
+        continue;
+      if (shadow->write && !happens_before(shadow->write, clock))
+        report_race(address, false, shadow->write, true, pc);
+      shadow->read = epoch;
+    }
+  }
+}
+
+// Print a race once per program counter, as module+offset for addr2line
+static
+void report_race(void* address, bool write, unsigned int previous, bool previousWrite, void* pc)
+{
+  RACES_FOUND++;
+
+  struct Table_Entry* entry = table_find(RACE_REPORTS, RACE_REPORT_TABLE_CAPACITY, pc, true);
+  if (!entry || entry->value >= 0)
+    return;
+  entry->value = 1;
+
+  Dl_info info;
+  const char* module = "?";
+  uintptr_t offset = (uintptr_t)pc;
+  if (dladdr(pc, &info) && info.dli_fname) {
+    module = strrchr(info.dli_fname, '/') ? strrchr(info.dli_fname, '/') + 1 : info.dli_fname;
+    // The return address of the callback is just after the access
+    offset = (uintptr_t)pc - 1 - (uintptr_t)info.dli_fbase;
+  }
+
+  fprintf(stderr, "DATA RACE AT SYNCHRONIZATION POINT %d: thread %d %s %p at %s+%#lx, unordered with a %s by thread %d\n",
+    SELF->sync_pt, SELF->index, write ? "writes" : "reads", address, module, (unsigned long)offset,
+    previousWrite ? "write" : "read", previous >> RACE_CLOCK_BITS);
+}
+
+static __attribute__((destructor))
+void print_race_summary()
+{
+  if (RACE_DETECTION && RACES_FOUND > 0)
+    fprintf(stderr, "%ld RACING ACCESSES FOUND\n", RACES_FOUND);
+}
+
+// Callbacks of code compiled with -fsanitize=thread. The instrumented program
+// is linked against chess.so, which takes the place of the sanitizer runtime.
+extern "C" void __tsan_init() {}
+extern "C" void __tsan_func_entry(void*) {}
+extern "C" void __tsan_func_exit() {}
+
+#define TSAN_ACCESS_CALLBACKS(size) \
+  extern "C" void __tsan_read##size(void* address) { if (RACE_DETECTION) race_access(address, size, false, __builtin_return_address(0)); } \
+  extern "C" void __tsan_write##size(void* address) { if (RACE_DETECTION) race_access(address, size, true, __builtin_return_address(0)); } \
+  extern "C" void __tsan_unaligned_read##size(void* address) { if (RACE_DETECTION) race_access(address, size, false, __builtin_return_address(0)); } \
+  extern "C" void __tsan_unaligned_write##size(void* address) { if (RACE_DETECTION) race_access(address, size, true, __builtin_return_address(0)); }
+
+TSAN_ACCESS_CALLBACKS(1)
+TSAN_ACCESS_CALLBACKS(2)
+TSAN_ACCESS_CALLBACKS(4)
+TSAN_ACCESS_CALLBACKS(8)
+TSAN_ACCESS_CALLBACKS(16)
+
+extern "C"
+void __tsan_read_range(void* address, unsigned long size)
+{
+  if (RACE_DETECTION)
+    race_access(address, size, false, __builtin_return_address(0));
+}
+
+extern "C"
+void __tsan_write_range(void* address, unsigned long size)
+{
+  if (RACE_DETECTION)
+    race_access(address, size, true, __builtin_return_address(0));
+}
+
+extern "C"
+void __tsan_vptr_read(void** address)
+{
+  if (RACE_DETECTION)
+    race_access(address, sizeof(void*), false, __builtin_return_address(0));
+}
+
+extern "C"
+void __tsan_vptr_update(void** address, void* value)
+{
+  if (RACE_DETECTION && *address != value)
+    race_access(address, sizeof(void*), true, __builtin_return_address(0));
+}
+
+// Atomics of instrumented code come here instead of being inlined. An atomic
+// access does not race, but one with a release order publishes everything its
+// thread did before to the next access with an acquire order to the same address.
+// The memory orders are the __ATOMIC_* values.
+static
+bool acquire_order(int order)
+{
+  return order == __ATOMIC_CONSUME || order == __ATOMIC_ACQUIRE || order == __ATOMIC_ACQ_REL || order == __ATOMIC_SEQ_CST;
+}
+
+static
+bool release_order(int order)
+{
+  return order == __ATOMIC_RELEASE || order == __ATOMIC_ACQ_REL || order == __ATOMIC_SEQ_CST;
+}
+
+static
+void atomic_before(const volatile void* address, int order)
+{
+  if (RACE_DETECTION && release_order(order))
+    race_release((void*)address);
+}
+
+static
+void atomic_after(const volatile void* address, int order)
+{
+  if (RACE_DETECTION && acquire_order(order))
+    race_acquire((void*)address);
+}
+
+#define TSAN_ATOMIC_RMW_CALLBACK(bits, type, operation, builtin) \
+  extern "C" type __tsan_atomic##bits##_##operation(volatile type* address, type value, int order) { \
+    atomic_before(address, order); \
+    type old = builtin(address, value, __ATOMIC_SEQ_CST); \
+    atomic_after(address, order); \
+    return old; \
+  }
+
+#define TSAN_ATOMIC_CALLBACKS(bits, type) \
+  extern "C" type __tsan_atomic##bits##_load(const volatile type* address, int order) { \
+    type value = __atomic_load_n(address, __ATOMIC_SEQ_CST); \
+    atomic_after(address, order); \
+    return value; \
+  } \
+  extern "C" void __tsan_atomic##bits##_store(volatile type* address, type value, int order) { \
+    atomic_before(address, order); \
+    __atomic_store_n(address, value, __ATOMIC_SEQ_CST); \
+  } \
+  TSAN_ATOMIC_RMW_CALLBACK(bits, type, exchange, __atomic_exchange_n) \
+  TSAN_ATOMIC_RMW_CALLBACK(bits, type, fetch_add, __atomic_fetch_add) \
+  TSAN_ATOMIC_RMW_CALLBACK(bits, type, fetch_sub, __atomic_fetch_sub) \
+  TSAN_ATOMIC_RMW_CALLBACK(bits, type, fetch_and, __atomic_fetch_and) \
+  TSAN_ATOMIC_RMW_CALLBACK(bits, type, fetch_or, __atomic_fetch_or) \
+  TSAN_ATOMIC_RMW_CALLBACK(bits, type, fetch_xor, __atomic_fetch_xor) \
+  TSAN_ATOMIC_RMW_CALLBACK(bits, type, fetch_nand, __atomic_fetch_nand) \
+  extern "C" int __tsan_atomic##bits##_compare_exchange_strong(volatile type* address, type* expected, type desired, int order, int failureOrder) { \
+    atomic_before(address, order); \
+    bool exchanged = __atomic_compare_exchange_n(address, expected, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); \
+    atomic_after(address, exchanged ? order : failureOrder); \
+    return exchanged; \
+  } \
+  extern "C" int __tsan_atomic##bits##_compare_exchange_weak(volatile type* address, type* expected, type desired, int order, int failureOrder) { \
+    return __tsan_atomic##bits##_compare_exchange_strong(address, expected, desired, order, failureOrder); \
+  } \
+  extern "C" type __tsan_atomic##bits##_compare_exchange_val(volatile type* address, type expected, type desired, int order, int failureOrder) { \
+    __tsan_atomic##bits##_compare_exchange_strong(address, &expected, desired, order, failureOrder); \
+    return expected; \
+  }
+
+TSAN_ATOMIC_CALLBACKS(8, char)
+TSAN_ATOMIC_CALLBACKS(16, short)
+TSAN_ATOMIC_CALLBACKS(32, int)
+TSAN_ATOMIC_CALLBACKS(64, long long)
+
+// Fences are not tied to an address, they only order the calling thread
+extern "C"
+void __tsan_atomic_thread_fence(int)
+{
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+extern "C"
+void __tsan_atomic_signal_fence(int)
+{
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+}
+
+// Freed memory is reused by other threads without synchronizing with the one that
+// freed it, its shadow is cleared first. Until the next allocator is resolved,
+// glibc's own functions are used.
+extern "C"
+void free(void* ptr)
+{
+  if (RACE_DETECTION && ptr)
+    clear_shadow(ptr, malloc_usable_size(ptr));
+  if (original_free)
+    original_free(ptr);
+  else
+    __libc_free(ptr);
+}
+
+extern "C"
+void* realloc(void* ptr, size_t size)
+{
+  size_t oldSize = RACE_DETECTION && ptr ? malloc_usable_size(ptr) : 0;
+  void* ret = original_realloc ? original_realloc(ptr, size) : __libc_realloc(ptr, size);
+  if (RACE_DETECTION && ret && ret != ptr && oldSize > 0)
+    clear_shadow(ptr, oldSize);
+  return ret;
+}
+
+static __attribute__((constructor))
+void resolve_allocator_functions()
+{
+  original_realloc = (void* (*)(void*, size_t))dlsym(RTLD_NEXT, "realloc");
+  original_free = (void (*)(void*))dlsym(RTLD_NEXT, "free");
+}
+
+// Read a schedule given as "<sync point>:<thread>,..."
+static
+void parse_preemptions(const char* str)
+{
+  while (*str) {
+    char* end;
+    struct Preemption preemption;
+    preemption.sync_pt = strtol(str, &end, 10);
+    if (*end != ':') {
+      fprintf(stderr, "CORRUPT SCHEDULE\n");
+      return;
+    }
+    preemption.thread = strtol(end + 1, &end, 10);
+    PREEMPTIONS.push_back(preemption);
+    str = (*end == ',') ? end + 1 : end;
+  }
+}
+
+// Counters are kept in memory and the tracking file is written when the
+// program exits, instead of at every synchronization point
+static __attribute__((destructor))
+void update_track_sync_pts_file()
+{
+  // Nothing to record for processes that never reached a pthread hook
+  // or that were given their schedule by chesstool
+  if (original_pthread_mutex_lock == NULL || SCHEDULE_FROM_TOOL)
+    return;
+
+  string newString;
+  stringstream temp1;
+  stringstream temp2;
+  temp1 << CURRENT_EXECUTION;
+  newString.append(temp1.str());
+  newString.append("/");
+  temp2 << TOTAL_EXECUTIONS;
+  newString.append(temp2.str());
+
+  if (CURRENT_MODE == DEBUG_MODE)
+    fprintf(stderr, "newString: %s\n", newString.c_str());
+
+  // Write back to file
+  ofstream outfile;
+  outfile.open(TRACK_SYNC_PTS_FILE_NAME);
+
+  if (outfile)
+    outfile.write(newString.c_str(), (int)newString.length());
+
+  outfile.close();
+}
+
+static
+void deserialize_track_sync_pts_file(string str)
+{
+  int len = str.length();
+  int DELIMITER_POS = str.find('/');
+  if (DELIMITER_POS == (int)string::npos) {
+    fprintf(stderr, "CORRUPT DATA\n");
+    return;
+  }
+  string current = str.substr(0, DELIMITER_POS);
+  string total = str.substr(DELIMITER_POS + 1, len);
+
+  set_schedule(atoi(current.c_str()), atoi(total.c_str()));
+}
+
+static
+void set_schedule(int current, int total)
+{
+  // Read data and store them in static global int variables
+  CURRENT_EXECUTION = current;
+  TOTAL_EXECUTIONS = total;
+
+  // The Nth execution preempts at the Nth synchronization point
+  struct Preemption preemption;
+  preemption.sync_pt = CURRENT_EXECUTION;
+  preemption.thread = -1;
+  PREEMPTIONS.clear();
+  PREEMPTIONS.push_back(preemption);
+
+  // Check if this is the first execution, set flag if so
+  if (CURRENT_EXECUTION == 0 && TOTAL_EXECUTIONS == 0) {
+    FIRST_EXECUTION = true;
+    CURRENT_EXECUTION = 1;
+    if (CURRENT_MODE == DEBUG_MODE)
+      fprintf(stderr, ">>>>>>>>>> FIRST EXECUTION <<<<<<<<<<\n");
+    return;
+  }
+
+  if (CURRENT_MODE == DEBUG_MODE)
+    fprintf(stderr, ">>>>>>>>>>>>>>> EXECUTION: %d/%d <<<<<<<<<<<<<<<\n", CURRENT_EXECUTION, TOTAL_EXECUTIONS);
+}
+
+// Fork server: when started by chesstool with CHESS_FORK_SERVER set, the
+// program stops here before main and forks a fresh child for every schedule
+// chesstool writes to FORK_SERVER_CONTROL_FD (a Fork_Server_Request followed by
+// the preemptions). The pid of each child, then its exit status and resource
+// usage are written back to FORK_SERVER_STATUS_FD. CHESS_CPU_LIMIT limits the
+// CPU seconds of every child. Only raw system calls and plain data are used, the
+// C++ globals of this file may not be constructed yet.
+static __attribute__((constructor))
+void fork_server()
+{
+  const char* forkServer = getenv("CHESS_FORK_SERVER");
+  if (!forkServer || !*forkServer)
+    return;
+
+  // Children inherit the shared mapping of the record file, they only reset it,
+  // and of the state cache
+  const char* recordFileName = getenv("CHESS_RECORD_FILE");
+  if (recordFileName && *recordFileName)
+    open_record_file(recordFileName);
+  const char* stateCacheFileName = getenv("CHESS_STATE_CACHE");
+  if (stateCacheFileName && *stateCacheFileName)
+    open_state_cache(stateCacheFileName);
+
+  const char* cpuLimit = getenv("CHESS_CPU_LIMIT");
+  int cpuSeconds = cpuLimit ? atoi(cpuLimit) : 0;
+
+  // Tell chesstool we are ready, run normally if nobody is listening
+  int status = 0;
+  if (write(FORK_SERVER_STATUS_FD, &status, sizeof(status)) != sizeof(status))
+    return;
+
+  struct Fork_Server_Request request;
+  while (read(FORK_SERVER_CONTROL_FD, &request, sizeof(request)) == sizeof(request)) {
+    int count = request.count;
+    if (count < 0 || count > MAX_PREEMPTIONS)
+      break;
+
+    ssize_t size = count * sizeof(struct Preemption);
+    if (size > 0 && read(FORK_SERVER_CONTROL_FD, FORK_SERVER_SCHEDULE, size) != size)
+      break;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+      close(FORK_SERVER_CONTROL_FD);
+      close(FORK_SERVER_STATUS_FD);
+      unsetenv("CHESS_FORK_SERVER");
+      FORK_SERVER_PREEMPTIONS = count;
+      FORK_SERVER_SEED = request.seed;
+      if (RECORD) {
+        RECORD->count = 0;
+        RECORD->deadlocked = 0;
+      }
+      if (cpuSeconds > 0) {
+        struct rlimit limit = { (rlim_t)cpuSeconds, (rlim_t)cpuSeconds + 1 };
+        setrlimit(RLIMIT_CPU, &limit);
+      }
+      return;
+    }
+
+    if (write(FORK_SERVER_STATUS_FD, &pid, sizeof(pid)) != sizeof(pid))
+      break;
+
+    struct Fork_Server_Result result;
+    struct rusage usage;
+    memset(&result, 0, sizeof(result));
+    memset(&usage, 0, sizeof(usage));
+    result.status = -1;
+    if (pid > 0)
+      wait4(pid, &result.status, 0, &usage);
+    result.user_us = usage.ru_utime.tv_sec * 1000000LL + usage.ru_utime.tv_usec;
+    result.sys_us = usage.ru_stime.tv_sec * 1000000LL + usage.ru_stime.tv_usec;
+    result.max_rss_kb = usage.ru_maxrss;
+    if (write(FORK_SERVER_STATUS_FD, &result, sizeof(result)) != sizeof(result))
+      break;
+  }
+
+  _exit(0);
+}
+
+// Read the synchronization points to fork children at, one per line in order.
+// CHESS_CHECKPOINT_JOBS bounds how many children run at once. fork() copies only
+// the calling OS thread, the other threads survive it only as fibers.
+static
+void read_checkpoints(const char* fileName)
+{
+  if (!FIBERS) {
+    fprintf(stderr, "CHECKPOINTS NEED CHESS_FIBERS, NOT FORKING ANY\n");
+    return;
+  }
+
+  FILE* file = fopen(fileName, "r");
+  if (!file) {
+    fprintf(stderr, "CANNOT READ CHECKPOINTS %s\n", fileName);
+    return;
+  }
+
+  int capacity = 0;
+  int syncPt;
+  while (fscanf(file, "%d", &syncPt) == 1) {
+    if (CHECKPOINT_COUNT == capacity) {
+      capacity = capacity ? capacity * 2 : 256;
+      CHECKPOINTS = (int*)realloc(CHECKPOINTS, capacity * sizeof(int));
+    }
+    CHECKPOINTS[CHECKPOINT_COUNT++] = syncPt;
+  }
+  fclose(file);
+
+  const char* jobs = getenv("CHESS_CHECKPOINT_JOBS");
+  CHECKPOINT_JOBS = jobs ? atoi(jobs) : 1;
+  if (CHECKPOINT_JOBS < 1)
+    CHECKPOINT_JOBS = 1;
+  if (CHECKPOINT_JOBS > MAX_CHECKPOINT_JOBS)
+    CHECKPOINT_JOBS = MAX_CHECKPOINT_JOBS;
+}
+
+// chesstool names the record file and profile of the checkpointing execution
+// "<name>.0", its child at synchronization point n writes "<name>.<n>"
+static
+const char* checkpoint_file_name(const char* fileName, int syncPt)
+{
+  const char* dot = strrchr(fileName, '.');
+  int length = dot ? dot - fileName : strlen(fileName);
+  char* name = (char*)malloc(length + 16);
+  snprintf(name, length + 16, "%.*s.%d", length, fileName, syncPt);
+  return name;
+}
+
+// Before the switch at a synchronization point: collect finished children, and
+// fork the child that preempts here if this is a checkpoint
+static
+void checkpoint(int syncPt)
+{
+  reap_checkpoints(false);
+
+  while (NEXT_CHECKPOINT < CHECKPOINT_COUNT && CHECKPOINTS[NEXT_CHECKPOINT] < syncPt)
+    NEXT_CHECKPOINT++;
+  if (NEXT_CHECKPOINT >= CHECKPOINT_COUNT || CHECKPOINTS[NEXT_CHECKPOINT] != syncPt)
+    return;
+  NEXT_CHECKPOINT++;
+
+  while (CHECKPOINTS_RUNNING >= CHECKPOINT_JOBS)
+    reap_checkpoints(true);
+  fork_checkpoint(syncPt);
+}
+
+// The child keeps the state of every thread and continues as the schedule that
+// preempts at syncPt, with its own record file and profile
+static
+void fork_checkpoint(int syncPt)
+{
+  // The output so far, a captured child starts its own output with it
+  fflush(NULL);
+  const char* outputFileName = getenv("CHESS_OUTPUT_FILE");
+  off_t outputSize = outputFileName ? lseek(STDOUT_FILENO, 0, SEEK_CUR) : -1;
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    if (outputSize >= 0)
+      capture_checkpoint_output(checkpoint_file_name(outputFileName, syncPt), outputSize);
+    close(FORK_SERVER_STATUS_FD);
+    free(CHECKPOINTS);
+    CHECKPOINTS = NULL;
+    CHECKPOINT_COUNT = NEXT_CHECKPOINT = 0;
+    CHECKPOINTS_RUNNING = 0;
+
+    // The shared mapping is the record file of the parent, copy its decisions
+    const char* recordFileName = getenv("CHESS_RECORD_FILE");
+    if (RECORD && recordFileName) {
+      struct Decision_File_Header* parent = RECORD;
+      size_t parentSize = sizeof(struct Decision_File_Header) + RECORD_CAPACITY * sizeof(struct Decision);
+      int parentFd = RECORD_FD;
+      RECORD = NULL;
+      CURRENT_DECISION = NULL;
+      open_record_file(checkpoint_file_name(recordFileName, syncPt));
+      for (int i = 0; i < parent->count; i++)
+        append_decision((struct Decision*)(parent + 1) + i);
+      munmap(parent, parentSize);
+      close(parentFd);
+    }
+    if (PROFILE_FILE_NAME)
+      PROFILE_FILE_NAME = checkpoint_file_name(PROFILE_FILE_NAME, syncPt);
+
+    struct Preemption preemption = { syncPt, -1 };
+    PREEMPTIONS.assign(1, preemption);
+    NEXT_PREEMPTION = 0;
+    return;
+  }
+  if (pid < 0)
+    return;
+
+  struct Checkpoint_Child* child = &CHECKPOINT_CHILDREN[CHECKPOINTS_RUNNING++];
+  child->pid = pid;
+  child->pidfd = syscall(SYS_pidfd_open, pid, 0);
+  child->sync_pt = syncPt;
+
+  struct Checkpoint_Message message;
+  memset(&message, 0, sizeof(message));
+  message.sync_pt = syncPt;
+  message.pid = pid;
+  if (write(FORK_SERVER_STATUS_FD, &message, sizeof(message)) != sizeof(message))
+    fprintf(stderr, "CANNOT REPORT CHECKPOINT AT SYNCHRONIZATION POINT %d\n", syncPt);
+}
+
+// chesstool captures the output of the checkpointing execution in CHESS_OUTPUT_FILE,
+// a child writes to a file of its own that starts with the first size bytes of it
+static
+void capture_checkpoint_output(const char* fileName, off_t size)
+{
+  int fd = open(fileName, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return;
+
+  char buffer[65536];
+  for (off_t offset = 0; offset < size; ) {
+    ssize_t count = pread(STDOUT_FILENO, buffer, size - offset < (off_t)sizeof(buffer) ? size - offset : sizeof(buffer), offset);
+    if (count <= 0 || write(fd, buffer, count) != count)
+      break;
+    offset += count;
+  }
+
+  dup2(fd, STDOUT_FILENO);
+  dup2(fd, STDERR_FILENO);
+  close(fd);
+}
+
+// Report every child that exited to chesstool, if block after waiting for one
+static
+void reap_checkpoints(bool block)
+{
+  if (CHECKPOINTS_RUNNING == 0)
+    return;
+
+  // Children without a pidfd (Linux before 5.3) are checked for having exited
+  // every CHECKPOINT_POLL_MS
+  if (block) {
+    struct pollfd fds[MAX_CHECKPOINT_JOBS];
+    int timeout = -1;
+    for (int i = 0; i < CHECKPOINTS_RUNNING; i++) {
+      fds[i].fd = CHECKPOINT_CHILDREN[i].pidfd;
+      fds[i].events = POLLIN;
+      if (fds[i].fd < 0)
+        timeout = CHECKPOINT_POLL_MS;
+    }
+    poll(fds, CHECKPOINTS_RUNNING, timeout);
+  }
+
+  for (int i = 0; i < CHECKPOINTS_RUNNING; ) {
+    struct Checkpoint_Child* child = &CHECKPOINT_CHILDREN[i];
+    struct Checkpoint_Message message;
+    struct rusage usage;
+    memset(&message, 0, sizeof(message));
+    memset(&usage, 0, sizeof(usage));
+    if (wait4(child->pid, &message.result.status, WNOHANG, &usage) != child->pid) {
+      i++;
+      continue;
+    }
+
+    message.sync_pt = child->sync_pt;
+    message.pid = child->pid;
+    message.finished = 1;
+    message.result.user_us = usage.ru_utime.tv_sec * 1000000LL + usage.ru_utime.tv_usec;
+    message.result.sys_us = usage.ru_stime.tv_sec * 1000000LL + usage.ru_stime.tv_usec;
+    message.result.max_rss_kb = usage.ru_maxrss;
+    if (write(FORK_SERVER_STATUS_FD, &message, sizeof(message)) != sizeof(message))
+      fprintf(stderr, "CANNOT REPORT CHECKPOINT AT SYNCHRONIZATION POINT %d\n", child->sync_pt);
+
+    if (child->pidfd >= 0)
+      close(child->pidfd);
+    *child = CHECKPOINT_CHILDREN[--CHECKPOINTS_RUNNING];
+  }
+}
+
+// The checkpointing execution exits once its children did
+static __attribute__((destructor))
+void finish_checkpoints()
+{
+  while (CHECKPOINTS_RUNNING > 0)
+    reap_checkpoints(true);
+}
+
+static
+void initialize_original_functions()
+{
+  static bool initialized = false;
+  if (!initialized) {
+    initialized = true;
+
+    // chesstool passes every execution its own schedule and asks for a trace
+    // and a record of its decisions
+    const char* schedule = getenv("CHESS_SCHEDULE");
+    const char* traceFileName = getenv("CHESS_TRACE_FILE");
+    const char* recordFileName = getenv("CHESS_RECORD_FILE");
+    const char* replayFileName = getenv("CHESS_REPLAY_FILE");
+    const char* eventTraceFileName = getenv("CHESS_EVENT_TRACE");
+    const char* virtualTime = getenv("CHESS_VIRTUAL_TIME");
+    const char* raceDetect = getenv("CHESS_RACE_DETECT");
+    const char* stateCacheFileName = getenv("CHESS_STATE_CACHE");
+    const char* pctSeed = getenv("CHESS_PCT_SEED");
+    const char* profileFileName = getenv("CHESS_PROFILE");
+    const char* filterFileName = getenv("CHESS_PREEMPTION_FILTER");
+    const char* fibers = getenv("CHESS_FIBERS");
+    const char* checkpoints = getenv("CHESS_CHECKPOINTS");
+    if (fibers && *fibers)
+      FIBERS = true;
+    if (checkpoints && *checkpoints)
+      read_checkpoints(checkpoints);
+    if (filterFileName && *filterFileName)
+      read_preemption_filter(filterFileName);
+    if (profileFileName && *profileFileName)
+      PROFILE_FILE_NAME = profileFileName;
+    if (pctSeed && *pctSeed) {
+      PCT = true;
+      PCT_RANDOM = FORK_SERVER_PREEMPTIONS >= 0 ? FORK_SERVER_SEED : strtoull(pctSeed, NULL, 10);
+    }
+    if (stateCacheFileName && *stateCacheFileName && !STATE_CACHE)
+      open_state_cache(stateCacheFileName);
+    if (raceDetect && *raceDetect)
+      open_race_detector();
+    if (virtualTime && *virtualTime) {
+      real_time(CLOCK_REALTIME, &REALTIME_BASE);
+      real_time(CLOCK_MONOTONIC, &MONOTONIC_BASE);
+      VIRTUAL_TIME = true;
+    }
+    if (eventTraceFileName && *eventTraceFileName)
+      open_event_trace(eventTraceFileName);
+    if (traceFileName && *traceFileName)
+      TRACE_FILE_NAME = traceFileName;
+    if (recordFileName && *recordFileName && !RECORD)
+      open_record_file(recordFileName);
+
+    if (replayFileName && *replayFileName) {
+      SCHEDULE_FROM_TOOL = true;
+      read_replay_file(replayFileName);
+    } else if (FORK_SERVER_PREEMPTIONS >= 0) {
+      SCHEDULE_FROM_TOOL = true;
+      PREEMPTIONS.assign(FORK_SERVER_SCHEDULE, FORK_SERVER_SCHEDULE + FORK_SERVER_PREEMPTIONS);
+    } else if (schedule) {
+      SCHEDULE_FROM_TOOL = true;
+      parse_preemptions(schedule);
+    }
+
+    if (CHESS_EXPLORE_MODE == EXPLORE_CHESS_SCHEDULES && !SCHEDULE_FROM_TOOL) {
+      string input;
+      TRACK_SYNC_PTS_FILE.open(TRACK_SYNC_PTS_FILE_NAME);
+
+      if (TRACK_SYNC_PTS_FILE) {
+        while (!TRACK_SYNC_PTS_FILE.eof()) {
+          TRACK_SYNC_PTS_FILE >> input;
+        }
+        TRACK_SYNC_PTS_FILE.close();
+        deserialize_track_sync_pts_file(input);
+      } else {
+        FIRST_EXECUTION = true;
+        fprintf(stderr, "NO DATA IN .tracksyncpts\n");
+      }
+    }
+
+    if (CURRENT_MODE == DEBUG_MODE)
+      fprintf(stderr, "--------------------------------------------------\n");
+
+    // The initializing thread holds the baton
+    SELF = new_thread_state();
+    register_thread(pthread_self(), SELF);
+    CURRENT_THREAD = pthread_self();
 
     original_pthread_create =
     (int (*)(pthread_t*, const pthread_attr_t*, void* (*)(void*), void*))dlsym(RTLD_NEXT, "pthread_create");
     original_pthread_join = 
     (int (*)(pthread_t, void**))dlsym(RTLD_NEXT, "pthread_join");
+    original_pthread_detach =
+    (int (*)(pthread_t))dlsym(RTLD_NEXT, "pthread_detach");
+    original_pthread_exit =
+    (void (*)(void*))dlsym(RTLD_NEXT, "pthread_exit");
     original_pthread_mutex_lock =
     (int (*)(pthread_mutex_t*))dlsym(RTLD_NEXT, "pthread_mutex_lock");
     original_pthread_mutex_unlock =
     (int (*)(pthread_mutex_t*))dlsym(RTLD_NEXT, "pthread_mutex_unlock");
+    original_pthread_mutex_timedlock =
+    (int (*)(pthread_mutex_t*, const struct timespec*))dlsym(RTLD_NEXT, "pthread_mutex_timedlock");
+    original_pthread_mutex_clocklock =
+    (int (*)(pthread_mutex_t*, clockid_t, const struct timespec*))dlsym(RTLD_NEXT, "pthread_mutex_clocklock");
+    original_pthread_mutex_trylock =
+    (int (*)(pthread_mutex_t*))dlsym(RTLD_NEXT, "pthread_mutex_trylock");
+    original_pthread_mutex_destroy =
+    (int (*)(pthread_mutex_t*))dlsym(RTLD_NEXT, "pthread_mutex_destroy");
+    original_pthread_cond_wait =
+    (int (*)(pthread_cond_t*, pthread_mutex_t*))dlsym(RTLD_NEXT, "pthread_cond_wait");
+    original_pthread_cond_timedwait =
+    (int (*)(pthread_cond_t*, pthread_mutex_t*, const struct timespec*))dlsym(RTLD_NEXT, "pthread_cond_timedwait");
+    original_pthread_cond_clockwait =
+    (int (*)(pthread_cond_t*, pthread_mutex_t*, clockid_t, const struct timespec*))dlsym(RTLD_NEXT, "pthread_cond_clockwait");
+    original_pthread_cond_signal =
+    (int (*)(pthread_cond_t*))dlsym(RTLD_NEXT, "pthread_cond_signal");
+    original_pthread_cond_broadcast =
+    (int (*)(pthread_cond_t*))dlsym(RTLD_NEXT, "pthread_cond_broadcast");
+    original_pthread_cond_init =
+    (int (*)(pthread_cond_t*, const pthread_condattr_t*))dlsym(RTLD_NEXT, "pthread_cond_init");
+    original_pthread_rwlock_init =
+    (int (*)(pthread_rwlock_t*, const pthread_rwlockattr_t*))dlsym(RTLD_NEXT, "pthread_rwlock_init");
+    original_pthread_rwlock_rdlock =
+    (int (*)(pthread_rwlock_t*))dlsym(RTLD_NEXT, "pthread_rwlock_rdlock");
+    original_pthread_rwlock_wrlock =
+    (int (*)(pthread_rwlock_t*))dlsym(RTLD_NEXT, "pthread_rwlock_wrlock");
+    original_pthread_rwlock_tryrdlock =
+    (int (*)(pthread_rwlock_t*))dlsym(RTLD_NEXT, "pthread_rwlock_tryrdlock");
+    original_pthread_rwlock_trywrlock =
+    (int (*)(pthread_rwlock_t*))dlsym(RTLD_NEXT, "pthread_rwlock_trywrlock");
+    original_pthread_rwlock_timedrdlock =
+    (int (*)(pthread_rwlock_t*, const struct timespec*))dlsym(RTLD_NEXT, "pthread_rwlock_timedrdlock");
+    original_pthread_rwlock_timedwrlock =
+    (int (*)(pthread_rwlock_t*, const struct timespec*))dlsym(RTLD_NEXT, "pthread_rwlock_timedwrlock");
+    original_pthread_rwlock_clockrdlock =
+    (int (*)(pthread_rwlock_t*, clockid_t, const struct timespec*))dlsym(RTLD_NEXT, "pthread_rwlock_clockrdlock");
+    original_pthread_rwlock_clockwrlock =
+    (int (*)(pthread_rwlock_t*, clockid_t, const struct timespec*))dlsym(RTLD_NEXT, "pthread_rwlock_clockwrlock");
+    original_pthread_rwlock_unlock =
+    (int (*)(pthread_rwlock_t*))dlsym(RTLD_NEXT, "pthread_rwlock_unlock");
+    original_sem_init =
+    (int (*)(sem_t*, int, unsigned int))dlsym(RTLD_NEXT, "sem_init");
+    original_sem_wait =
+    (int (*)(sem_t*))dlsym(RTLD_NEXT, "sem_wait");
+    original_sem_trywait =
+    (int (*)(sem_t*))dlsym(RTLD_NEXT, "sem_trywait");
+    original_sem_timedwait =
+    (int (*)(sem_t*, const struct timespec*))dlsym(RTLD_NEXT, "sem_timedwait");
+    original_sem_clockwait =
+    (int (*)(sem_t*, clockid_t, const struct timespec*))dlsym(RTLD_NEXT, "sem_clockwait");
+    original_sem_post =
+    (int (*)(sem_t*))dlsym(RTLD_NEXT, "sem_post");
+    original_sem_getvalue =
+    (int (*)(sem_t*, int*))dlsym(RTLD_NEXT, "sem_getvalue");
+    original_pthread_barrier_init =
+    (int (*)(pthread_barrier_t*, const pthread_barrierattr_t*, unsigned int))dlsym(RTLD_NEXT, "pthread_barrier_init");
+    original_pthread_barrier_wait =
+    (int (*)(pthread_barrier_t*))dlsym(RTLD_NEXT, "pthread_barrier_wait");
+    original_sleep =
+    (unsigned int (*)(unsigned int))dlsym(RTLD_NEXT, "sleep");
+    original_usleep =
+    (int (*)(useconds_t))dlsym(RTLD_NEXT, "usleep");
+    original_nanosleep =
+    (int (*)(const struct timespec*, struct timespec*))dlsym(RTLD_NEXT, "nanosleep");
   }
 }
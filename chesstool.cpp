@@ -4,34 +4,403 @@
 #include <dlfcn.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <limits.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/personality.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <deque>
 #include <map>
+#include <set>
+#include <vector>
 #include <iostream>
 #include <fstream>
 #include <sstream>
 
 using namespace std;
 
+// File descriptors chess.so reads schedules from and writes statuses to
+#define FORK_SERVER_CONTROL_FD                  198
+#define FORK_SERVER_STATUS_FD                   199
+// Without pidfd_open (Linux before 5.3), exited executions are polled for this often
+#define EXIT_POLL_MS                            10
+
+// Exit status chess.so gives an execution in which every live thread waits for another
+#define DEADLOCK_EXIT_STATUS                    86
+// Thread of a preemption that is a priority change point of a PCT schedule
+#define PCT_CHANGE_POINT                        -2
+// Exit status chess.so gives an execution it stopped in an already explored state
+#define PRUNED_EXIT_STATUS                      87
+
+#define DECISION_FILE_MAGIC                     "CHESSDEC"
+#define DECISION_FILE_VERSION                   2
+
+#define STATE_CACHE_MAGIC                       "CHESSSTC"
+#define STATE_CACHE_VERSION                     1
+// States a new state cache file holds (8 bytes each), a power of two
+#define STATE_CACHE_CAPACITY                    (1 << 20)
+
+// Version of the first line of the journal, "H <version> <parameters>"
+#define JOURNAL_VERSION                         2
+
+// Deepest bugs PCT is asked to find, change points are preemptions of a schedule
+#define MAX_PCT_DEPTH                           65
+
+// Phases of --minimize, in the order of a round
+#define MINIMIZE_VERIFY                         0
+#define MINIMIZE_DROP                           1
+#define MINIMIZE_EARLIER                        2
+#define MINIMIZE_THREADS                        3
+#define MINIMIZE_DONE                           4
+
 struct SyncPts {
   int current;
   int total;
 };
 
+// Switch to thread (creation index, 0 is the main thread) at synchronization point syncPt
+// thread -1 selects the next runnable thread, PCT_CHANGE_POINT lowers the priority
+// of the running thread instead. Same layout as in chess.so.
+struct Preemption {
+  int syncPt;
+  int thread;
+};
+
+// What the fork server is sent for every execution, followed by count preemptions
+// Same layout as in chess.so
+struct ForkServerRequest {
+  int count;
+  int reserved;
+  unsigned long long seed;
+};
+
+// Decision file chess.so records every execution in, same layout as in chess.so
+struct DecisionFileHeader {
+  char magic[8];
+  int version;
+  int count;
+  // chess.so found every thread waiting. Same layout as in chess.so.
+  int deadlocked;
+  int reserved;
+};
+
+struct Decision {
+  int syncPt;
+  short running;
+  short next;
+  int mutex;
+  char kind;
+  char reserved[3];
+};
+
+// State cache chess.so adds every state it reaches to, same layout as in chess.so.
+// chesstool appends the crashes it found as text after the table.
+struct StateCacheHeader {
+  char magic[8];
+  int version;
+  int reserved;
+  long long capacity;
+  long long count;
+  long long programSize;
+  long long programMtime;
+};
+
+struct Schedule {
+  // Synchronization point of the sweep, or execution number when bounding preemptions
+  // or running PCT
+  int id;
+  vector<Preemption> preemptions;
+  // Seed of the thread priorities of a PCT schedule, 0 otherwise
+  unsigned long long seed;
+};
+
+// One line of the trace chess.so writes for chesstool, with the operations the
+// running thread performed between this synchronization point and its next one
+struct SyncPtTrace {
+  int syncPt;
+  int running;
+  vector<int> enabled;
+  vector<string> mutexes;
+  bool createsThread;
+};
+
+// What the fork server reports for every child, same layout as in chess.so
+struct ForkServerResult {
+  int status;
+  int reserved;
+  long long userUs;
+  long long sysUs;
+  long long maxRssKb;
+};
+
+// What a checkpointing execution reports for every child it forks, once when it
+// starts and once with its result. Same layout as in chess.so.
+struct CheckpointMessage {
+  int syncPt;
+  int pid;
+  int finished;
+  int reserved;
+  ForkServerResult result;
+};
+
+// A child of the checkpointing execution that is still running
+struct Checkpoint {
+  int syncPt;
+  struct timespec started;
+  bool timedOut;
+};
+
+// Measurements of one execution for the results file
+struct ExecutionResult {
+  Schedule schedule;
+  // Wait status of the execution
+  int status;
+  double wallSeconds;
+  double userSeconds;
+  double sysSeconds;
+  long maxRssKb;
+  // Synchronization points the execution passed, -1 if unknown
+  int syncPts;
+  // Killed by chesstool after WALL_TIMEOUT seconds
+  bool timedOut;
+  // chess.so recorded a deadlock, the exit status alone could be the program's own
+  bool deadlocked;
+  // Hash of the captured output
+  unsigned long long outputHash;
+  // Decisions of the execution, kept only to verify determinism
+  vector<Decision> decisions;
+};
+
+// Executions that printed the same output
+struct OutputGroup {
+  // First execution with the output, whether it ended normally or not
+  int first;
+  int executions;
+  // Executions that ended normally with it, the first one keeps its replay
+  vector<int> schedules;
+};
+
+// Synchronization points at one call site of the program over all executions
+struct SiteProfile {
+  string module;
+  string offset;
+  char kind;
+  long syncPts;
+  // Most distinct mutexes and other objects used there by one execution
+  long objects;
+  // Locks there that found the mutex held
+  long contended;
+  // Schedules whose first preemption is there, and their wall time
+  int schedules;
+  double seconds;
+};
+
+struct Worker {
+  // Running execution, or the fork server in fork server mode
+  pid_t pid;
+  bool busy;
+  Schedule schedule;
+  struct timespec started;
+  // Process the fork server forked for the running execution
+  pid_t child;
+  // Becomes readable when a running execution (not in fork server mode) exits
+  int pidFd;
+  bool timedOut;
+  // Fork server pipes, -1 when not in fork server mode
+  int controlFd;
+  int statusFd;
+  // Memory file the output of its executions is captured in, -1 unless capturing
+  int outputFd;
+};
+
+// Called for every finished execution, may queue more schedules
+typedef void (*ExecutionFinished)(ExecutionResult&, const char*, deque<Schedule>&);
+
 void check_arguments(int, char**);
 void check_file_exists();
 void initialize_chess_tool();
 void first_execution();
 int run_command(string);
+void limit_cpu_time();
+void disable_address_randomization();
+void open_state_cache();
+long long cached_states();
+vector<string> cached_crashes();
+int report_cached_crashes(vector<ExecutionResult>&);
+pid_t start_command(string, Schedule&, int, int);
+string worker_file_name(const char*, int);
+string replay_file_name(int);
+void save_replay_file(const char*, int);
+void write_replay_file(vector<Decision>&, int);
+string format_preemptions(vector<Preemption>&);
+bool start_fork_server(Worker&, string, int);
+void stop_fork_server(Worker&);
+void start_execution(Worker&, Schedule&, string, int);
+int wait_for_execution(vector<Worker>&, ExecutionResult&);
+bool reap_execution(Worker&, ExecutionResult&, int);
+void kill_execution(Worker&);
+int run_schedules(deque<Schedule>&, ExecutionFinished);
+int run_checkpointed(deque<Schedule>&, ExecutionFinished);
+double elapsed_seconds(struct timespec);
+vector<SyncPtTrace> read_trace(const char*);
+vector<bool> redundant_preemptions(vector<SyncPtTrace>&);
+bool read_decisions(const char*, vector<Decision>&);
+bool recorded_deadlock(const char*);
+vector<Preemption> replay_preemptions(vector<Decision>&);
+void replay_program();
 SyncPts read_sync_pts();
 int read_total_sync_pts();
 int read_current_sync_pts();
+void update_track_sync_pts_file(SyncPts);
 void explore_program();
-void print_crash_report(int*);
+void sweep_finished(ExecutionResult&, const char*, deque<Schedule>&);
+void explore_bounded();
+void bounded_finished(ExecutionResult&, const char*, deque<Schedule>&);
+bool earlier_schedule(const ExecutionResult&, const ExecutionResult&);
+const char* outcome(ExecutionResult&);
+bool pruned(ExecutionResult&);
+bool failed(ExecutionResult&);
+void print_state_coverage(int);
+string failure_note(ExecutionResult&);
+void print_crash_report(vector<ExecutionResult>&);
+int exit_code(int);
+int exit_signal(int);
+void write_results_file(int, double);
+string json_escape(const char*);
+void print_bounded_crash_report();
+unsigned long long hash_bytes(const char*, size_t, unsigned long long);
+string read_output(int);
+string output_file_name(int);
+void check_output(ExecutionResult&, const string&, const char*);
+void print_output_report();
+void verify_determinism();
+void verify_finished(ExecutionResult&, const char*, deque<Schedule>&);
+string describe_decision(vector<Decision>&, size_t);
+void explore_pct();
+void pct_finished(ExecutionResult&, const char*, deque<Schedule>&);
+unsigned long long next_random(unsigned long long&);
+void minimize_schedule();
+bool same_failure(ExecutionResult&, ExecutionResult&);
+void minimize_finished(ExecutionResult&, const char*, deque<Schedule>&);
+void advance_minimize(bool);
+vector<vector<Preemption> > minimize_candidates();
+void print_minimized_schedule(double);
+void read_profile(const char*, ExecutionResult*);
+bool more_sync_pts(const SiteProfile&, const SiteProfile&);
+const char* sync_pt_kind_name(char);
+map<string, string> resolve_locations(vector<SiteProfile>&);
+void write_profile();
+void read_filter_file(const char*);
+vector<string> command_output(string);
+bool parse_address(string, unsigned long long&);
+void resolve_filter();
+void read_preemptible_sync_pts(const char*);
+string journal_header();
+void open_journal();
+void read_journal();
+void append_journal(string);
+string journal_schedule(Schedule&);
+bool parse_preemptions(string, vector<Preemption>&);
+void journal_census(deque<Schedule>&, size_t);
+void journal_execution(ExecutionResult&, deque<Schedule>&, size_t, int);
+int restore_executions(vector<ExecutionResult>&);
 void print_oreo_cookie();
 
 static const char*                                      RUN_SH = "./run.sh ";
 static const char*                                      TRACK_SYNC_PTS_FILE_NAME = ".tracksyncpts";
+static const char*                                      TRACE_FILE_NAME = ".chesstrace";
+static const char*                                      RECORD_FILE_NAME = ".chessrecord";
+static const char*                                      REPLAY_FILE_NAME = NULL;
 static const char*                                      TEST_PROGRAM;
 static int                                              TOTAL_SYNC_PTS = -1;
+static int                                              JOBS = 1;
+static bool                                             FORK_SERVER = false;
+static int                                              PREEMPTION_BOUND = -1;
+static bool                                             REDUCTION = false;
+static int                                              PRUNED_SCHEDULES = 0;
+static int                                              WALL_TIMEOUT = 10;
+static int                                              CPU_TIMEOUT = 10;
+static bool                                             REAL_TIME = false;
+static const char*                                      STATE_CACHE_FILE_NAME = NULL;
+static long long                                        STATES_BEFORE = 0;
+static int                                              PRUNED_EXECUTIONS = 0;
+static int                                              PCT_RUNS = 0;
+static int                                              PCT_DEPTH = 3;
+static unsigned long long                               PCT_SEED = 0;
+// Append-only record of the census of synchronization points, of the queued
+// schedules of bounded exploration and of every finished execution
+static const char*                                      JOURNAL_FILE_NAME = ".chessjournal";
+static int                                              JOURNAL_FD = -1;
+static bool                                             RESUME = false;
+// What --resume found in the journal
+static int                                              JOURNAL_SYNC_PTS = -1;
+static vector<Schedule>                                 JOURNAL_QUEUED;
+static int                                              JOURNAL_PRUNED_SCHEDULES = 0;
+static vector<ExecutionResult>                          JOURNAL_EXECUTIONS;
+static set<int>                                         JOURNAL_FINISHED;
+static int                                              NEXT_SCHEDULE_ID = 1;
+// Delta debugging of a failing schedule (--minimize): MINIMUM is the smallest
+// schedule that failed like the original so far, candidates run in batches
+static const char*                                      MINIMIZE_SCHEDULE = NULL;
+// Run the threads of the program as fibers on one OS thread (--fibers)
+static bool                                             FIBERS = false;
+// Fork the executions of the sweep from one execution at their synchronization
+// points (--checkpoint), it lists them in CHECKPOINT_TRACE_NAME
+static bool                                             CHECKPOINT = false;
+static const char*                                      CHECKPOINT_TRACE_NAME = ".chesscheckpoints";
+static ExecutionResult                                  MINIMUM;
+static vector<Preemption>                               MINIMIZE_ORIGINAL;
+static int                                              MINIMIZE_PHASE = MINIMIZE_VERIFY;
+static size_t                                           MINIMIZE_GRANULARITY = 2;
+static size_t                                           MINIMIZE_INDEX = 0;
+static bool                                             MINIMIZE_CHANGED = false;
+static int                                              MINIMIZE_PENDING = 0;
+static bool                                             MINIMIZE_FOUND = false;
+static ExecutionResult                                  MINIMIZE_BEST;
+static set<string>                                      MINIMIZE_TRIED;
+static vector<int>                                      MINIMIZE_REPLAYS;
+// Call site profile (--profile), chess.so writes one per execution to PROFILE_TRACE_NAME
+static const char*                                      PROFILE_FILE_NAME = NULL;
+static const char*                                      PROFILE_TRACE_NAME = ".chessprofile";
+static map<string, SiteProfile>                         SITE_PROFILES;
+// Call site of every synchronization point of the first execution
+static vector<string>                                   POINT_SITES;
+// Preemption filter (--filter file, --only spec), resolved for chess.so into
+// FILTER_TRACE_NAME. FILTER_DIGEST tells filters apart in the journal.
+static vector<string>                                   FILTER_SPECS;
+static const char*                                      FILTER_TRACE_NAME = ".chessfilter";
+static string                                           FILTER_DIGEST;
+// Synchronization points of the first execution where the filter leaves a thread to switch to
+static vector<int>                                      PREEMPTIBLE_SYNC_PTS;
+// Output oracle (--capture, --expect file): executions print into OUTPUT_TRACE_NAME
+// or a memory file, and are grouped by the hash of what they printed
+static bool                                             CAPTURE = false;
+static const char*                                      EXPECTED_FILE_NAME = NULL;
+static unsigned long long                               EXPECTED_HASH = 0;
+static const char*                                      OUTPUT_TRACE_NAME = ".chessoutput";
+static map<unsigned long long, OutputGroup>             OUTPUT_GROUPS;
+// Determinism check (--verify-determinism runs): every schedule of the sweep runs
+// VERIFY_RUNS times and must make the same decisions, end the same way and print
+// the same output. The first run of a schedule to finish is the reference.
+static int                                              VERIFY_RUNS = 0;
+static map<int, ExecutionResult>                        VERIFY_REFERENCE;
+static map<int, int>                                    VERIFY_FINISHED;
+static map<int, string>                                 VERIFY_DIVERGED;
+static vector<ExecutionResult>                          CRASHES;
+static const char*                                      RESULTS_FILE_NAME = NULL;
+static vector<ExecutionResult>                          RESULTS;
+static vector<ExecutionResult>                          CRASHED_SCHEDULES;
 
 int main(int argc, char *argv[])
 {
@@ -39,11 +408,71 @@ int main(int argc, char *argv[])
 
   check_file_exists();
 
+  // What every execution that ends normally should print
+  if (EXPECTED_FILE_NAME) {
+    int fd = open(EXPECTED_FILE_NAME, O_RDONLY);
+    if (fd < 0) {
+      fprintf(stderr, "Error: Cannot read the expected output %s\n", EXPECTED_FILE_NAME);
+      exit(0);
+    }
+    string expected = read_output(fd);
+    close(fd);
+    EXPECTED_HASH = hash_bytes(expected.data(), expected.size(), 14695981039346656037ULL);
+  }
+
+  // The seed is part of the journal header, a resumed run takes it from there
+  if (PCT_RUNS > 0 && PCT_SEED == 0 && !RESUME)
+    PCT_SEED = time(NULL) ^ ((unsigned long long)getpid() << 32);
+
+  // Sleeps and clocks of the program run on chess.so's virtual clock unless -R
+  if (!REAL_TIME)
+    setenv("CHESS_VIRTUAL_TIME", "1", 1);
+  if (FIBERS)
+    setenv("CHESS_FIBERS", "1", 1);
+
+  if (REPLAY_FILE_NAME) {
+    replay_program();
+    return 0;
+  }
+
   initialize_chess_tool();
 
-  first_execution();
+  if (!FILTER_SPECS.empty())
+    resolve_filter();
+
+  if (MINIMIZE_SCHEDULE) {
+    minimize_schedule();
+    return 0;
+  }
+
+  // Verification repeats schedules, it has nothing to resume
+  if (VERIFY_RUNS == 0)
+    open_journal();
+
+  // A resumed run knows the synchronization points from the journal
+  if (JOURNAL_SYNC_PTS < 0) {
+    first_execution();
+  } else {
+    TOTAL_SYNC_PTS = JOURNAL_SYNC_PTS;
+    SyncPts pts = { 1, TOTAL_SYNC_PTS };
+    update_track_sync_pts_file(pts);
+    fprintf(stderr, "Resuming with %d synchronization points and %d finished executions from %s\n\n", TOTAL_SYNC_PTS, (int)JOURNAL_EXECUTIONS.size(), JOURNAL_FILE_NAME);
+  }
+
+  if (STATE_CACHE_FILE_NAME)
+    open_state_cache();
+
+  if (VERIFY_RUNS > 0) {
+    verify_determinism();
+    return VERIFY_DIVERGED.empty() ? 0 : 1;
+  }
 
-  explore_program();
+  if (PCT_RUNS > 0)
+    explore_pct();
+  else if (PREEMPTION_BOUND < 0)
+    explore_program();
+  else
+    explore_bounded();
 
   return 0;
 }
@@ -51,11 +480,138 @@ int main(int argc, char *argv[])
 // Check for program arguments, exit if invalid
 void check_arguments(int argc, char *argv[])
 {
-  if (argc != 2 || !*argv[1]) {
-    fprintf(stderr, "Invalid arguments provided to chesstool.\nUsage: ./chesstool <binaryfile>\n");
+  static struct option longOptions[] = {
+    { "replay", required_argument, NULL, 'r' },
+    { "resume", no_argument, NULL, 'e' },
+    { "profile", required_argument, NULL, 'A' },
+    { "filter", required_argument, NULL, 'F' },
+    { "only", required_argument, NULL, 'O' },
+    { "minimize", required_argument, NULL, 'M' },
+    { "fibers", no_argument, NULL, 'I' },
+    { "checkpoint", no_argument, NULL, 'K' },
+    { "capture", no_argument, NULL, 'U' },
+    { "expect", required_argument, NULL, 'X' },
+    { "verify-determinism", required_argument, NULL, 'V' },
+    { NULL, 0, NULL, 0 }
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "j:fk:po:t:c:Rs:P:d:S:", longOptions, NULL)) != -1) {
+    switch (opt) {
+      case 'j':
+        JOBS = atoi(optarg);
+        break;
+      case 'f':
+        FORK_SERVER = true;
+        break;
+      case 'k':
+        PREEMPTION_BOUND = atoi(optarg);
+        if (PREEMPTION_BOUND < 0)
+          JOBS = 0;
+        break;
+      case 'p':
+        REDUCTION = true;
+        break;
+      case 'r':
+        REPLAY_FILE_NAME = optarg;
+        break;
+      case 'e':
+        RESUME = true;
+        break;
+      case 'A':
+        PROFILE_FILE_NAME = optarg;
+        break;
+      case 'F':
+        read_filter_file(optarg);
+        break;
+      case 'O':
+        FILTER_SPECS.push_back(optarg);
+        break;
+      case 'M':
+        MINIMIZE_SCHEDULE = optarg;
+        break;
+      case 'I':
+        FIBERS = true;
+        break;
+      case 'K':
+        CHECKPOINT = true;
+        FIBERS = true;
+        break;
+      case 'U':
+        CAPTURE = true;
+        break;
+      case 'X':
+        EXPECTED_FILE_NAME = optarg;
+        CAPTURE = true;
+        break;
+      case 'V':
+        VERIFY_RUNS = atoi(optarg);
+        if (VERIFY_RUNS < 2)
+          JOBS = 0;
+        break;
+      case 'o':
+        RESULTS_FILE_NAME = optarg;
+        break;
+      case 't':
+        WALL_TIMEOUT = atoi(optarg);
+        if (WALL_TIMEOUT < 0)
+          JOBS = 0;
+        break;
+      case 'c':
+        CPU_TIMEOUT = atoi(optarg);
+        if (CPU_TIMEOUT < 0)
+          JOBS = 0;
+        break;
+      case 'R':
+        REAL_TIME = true;
+        break;
+      case 's':
+        STATE_CACHE_FILE_NAME = optarg;
+        break;
+      case 'P':
+        PCT_RUNS = atoi(optarg);
+        if (PCT_RUNS < 1)
+          JOBS = 0;
+        break;
+      case 'd':
+        PCT_DEPTH = atoi(optarg);
+        if (PCT_DEPTH < 1 || PCT_DEPTH > MAX_PCT_DEPTH)
+          JOBS = 0;
+        break;
+      case 'S':
+        PCT_SEED = strtoull(optarg, NULL, 10);
+        break;
+      default:
+        JOBS = 0;
+    }
+  }
+
+  // Partial-order reduction prunes the schedules of bounded exploration
+  if (REDUCTION && PREEMPTION_BOUND < 0)
+    JOBS = 0;
+  // PCT schedules are random, neither bounded nor prunable by the state cache
+  if (PCT_RUNS > 0 && (PREEMPTION_BOUND >= 0 || STATE_CACHE_FILE_NAME))
+    JOBS = 0;
+  if (RESUME && REPLAY_FILE_NAME)
+    JOBS = 0;
+  // Minimization runs candidates of one schedule, it neither explores nor prunes
+  if (MINIMIZE_SCHEDULE && (PREEMPTION_BOUND >= 0 || PCT_RUNS > 0 || STATE_CACHE_FILE_NAME || RESUME || REPLAY_FILE_NAME))
+    JOBS = 0;
+  // Minimization and replays look at how an execution fails, not at its output
+  if (CAPTURE && (MINIMIZE_SCHEDULE || REPLAY_FILE_NAME))
+    JOBS = 0;
+  // Verification repeats the schedules of the sweep, a state cache would prune the repeats
+  if (VERIFY_RUNS > 0 && (PREEMPTION_BOUND >= 0 || PCT_RUNS > 0 || STATE_CACHE_FILE_NAME || RESUME || MINIMIZE_SCHEDULE || REPLAY_FILE_NAME || CAPTURE || CHECKPOINT))
+    JOBS = 0;
+  // Checkpoints are taken by the sweep, from an execution chess.so forks itself
+  if (CHECKPOINT && (PREEMPTION_BOUND >= 0 || PCT_RUNS > 0 || FORK_SERVER || MINIMIZE_SCHEDULE || REPLAY_FILE_NAME))
+    JOBS = 0;
+
+  if (JOBS < 1 || optind != argc - 1 || !*argv[optind]) {
+    fprintf(stderr, "Invalid arguments provided to chesstool.\nUsage: ./chesstool [-j jobs] [-f] [-k preemptions [-p]] [-o results.json|results.csv] [-t wall_seconds] [-c cpu_seconds] [-R] [--fibers] [--checkpoint] [--capture] [--expect output] [-s statecache] [--resume] [--profile profile.tsv] [--filter file] [--only spec] <binaryfile>\n       ./chesstool -P runs [-d depth] [-S seed] [-j jobs] [-f] [-o results.json|results.csv] [-t wall_seconds] [-c cpu_seconds] [-R] [--fibers] [--capture] [--expect output] [--resume] [--profile profile.tsv] [--filter file] [--only spec] <binaryfile>\n       ./chesstool [-R] [--fibers] --replay <replayfile> <binaryfile>\n       ./chesstool --minimize <replayfile|preemptions> [-j jobs] [-f] [-t wall_seconds] [-c cpu_seconds] [-R] [--fibers] [--filter file] [--only spec] <binaryfile>\n       ./chesstool --verify-determinism <runs> [-j jobs] [-f] [-o results.json|results.csv] [-t wall_seconds] [-c cpu_seconds] [-R] [--fibers] [--filter file] [--only spec] <binaryfile>\n");
     exit(0);
   }
-  TEST_PROGRAM = argv[1];
+  TEST_PROGRAM = argv[optind];
 }
 
 // Check if file exists
@@ -83,146 +639,2298 @@ void first_execution()
 {
   fprintf(stderr, "========== Finding Synchronization Points ==========\n");
 
+  // The first execution has no preemptions, its trace is where bounded exploration starts
+  // and tells where the filter allows preemptions
+  if (PREEMPTION_BOUND >= 0 || !FILTER_SPECS.empty())
+    setenv("CHESS_TRACE_FILE", TRACE_FILE_NAME, 1);
+  // Its profile also gives the call site of every synchronization point
+  if (PROFILE_FILE_NAME)
+    setenv("CHESS_PROFILE", PROFILE_TRACE_NAME, 1);
+
   string firstExecutionCommand = RUN_SH;
   firstExecutionCommand.append(TEST_PROGRAM);
-  run_command(firstExecutionCommand);
+  int statusCode = run_command(firstExecutionCommand);
+
+  unsetenv("CHESS_TRACE_FILE");
+  unsetenv("CHESS_PROFILE");
+  if (PROFILE_FILE_NAME)
+    read_profile(PROFILE_TRACE_NAME, NULL);
+
+  // Without a complete first execution the synchronization points are unknown.
+  // chess.so records them as the program exits, which a killed program never does.
+  int signal = exit_signal(statusCode);
+  if (signal == SIGKILL || signal == SIGXCPU) {
+    fprintf(stderr, "Error: The first execution of %s did not finish in time\n", TEST_PROGRAM);
+    fprintf(stderr, "!!!!!!!!!! Terminating CHESS tool !!!!!!!!!!\n\n");
+    exit(1);
+  }
+  if (signal != 0) {
+    fprintf(stderr, "Error: The first execution of %s was killed by signal %d (%s) without preemptions, its synchronization points are unknown\n", TEST_PROGRAM, signal, strsignal(signal));
+    fprintf(stderr, "!!!!!!!!!! Terminating CHESS tool !!!!!!!!!!\n\n");
+    exit(1);
+  }
 
   SyncPts pts;
   try {
     pts = read_sync_pts();
   } catch (int e) {
     fprintf(stderr, "!!!!!!!!!! Terminating CHESS tool !!!!!!!!!!\n\n");
-    exit(0);
+    exit(1);
   }
 
   fprintf(stderr, "========== Finding Synchronization Points Complete ==========\n\n");
 
   TOTAL_SYNC_PTS = pts.total;
+
+  if (!FILTER_SPECS.empty()) {
+    read_preemptible_sync_pts(TRACE_FILE_NAME);
+    fprintf(stderr, "The preemption filter allows preemptions at %d of %d synchronization points\n\n", (int)PREEMPTIBLE_SYNC_PTS.size(), TOTAL_SYNC_PTS);
+    if (PREEMPTION_BOUND < 0)
+      remove(TRACE_FILE_NAME);
+  }
+
+  // Bounded exploration journals the census with the schedules extending the first execution
+  if (PREEMPTION_BOUND < 0) {
+    deque<Schedule> none;
+    journal_census(none, 0);
+  }
 }
 
-// Helper method for executing bash script
+// Helper method for executing bash script, killed after WALL_TIMEOUT seconds
+// Returns the wait status like system()
 int run_command(string command)
 {
-  const char *cmd = command.c_str();
-  // fprintf(stderr, "Running command: %s\n", cmd);
-  return system(cmd);
+  pid_t pid = fork();
+  if (pid == 0) {
+    setpgid(0, 0);
+    limit_cpu_time();
+    execl("/bin/sh", "sh", "-c", command.c_str(), (char *)NULL);
+    _exit(127);
+  }
+  if (pid < 0)
+    return -1;
+  setpgid(pid, pid);
+
+  int statusCode = -1;
+  int pidFd = syscall(SYS_pidfd_open, pid, 0);
+  struct pollfd fd = { pidFd, POLLIN, 0 };
+  bool timedOut = false;
+  if (WALL_TIMEOUT > 0 && pidFd >= 0) {
+    timedOut = poll(&fd, 1, WALL_TIMEOUT * 1000) == 0;
+  } else if (WALL_TIMEOUT > 0) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (waitpid(pid, &statusCode, WNOHANG) == 0) {
+      if (elapsed_seconds(start) >= WALL_TIMEOUT) {
+        timedOut = true;
+        break;
+      }
+      usleep(EXIT_POLL_MS * 1000);
+    }
+    if (!timedOut)
+      return statusCode;
+  }
+  if (timedOut) {
+    fprintf(stderr, "!!!!!!!!!! Program did not finish within %d s, killed !!!!!!!!!!\n", WALL_TIMEOUT);
+    kill(-pid, SIGKILL);
+  }
+  if (pidFd >= 0)
+    close(pidFd);
+
+  waitpid(pid, &statusCode, 0);
+  return statusCode;
 }
 
-// Read tracking file and returns SyncPts struct
-SyncPts read_sync_pts()
+// Executions that use more than CPU_TIMEOUT seconds of CPU get SIGXCPU
+// Inherited across exec, every process of the execution counts separately
+void limit_cpu_time()
 {
-  string input;
-  ifstream infile;
-  infile.open(TRACK_SYNC_PTS_FILE_NAME);
+  if (CPU_TIMEOUT <= 0)
+    return;
+  struct rlimit limit = { (rlim_t)CPU_TIMEOUT, (rlim_t)CPU_TIMEOUT + 1 };
+  setrlimit(RLIMIT_CPU, &limit);
+}
 
-  if (!infile) {
-    fprintf(stderr, "Error: No data in %s\n", TRACK_SYNC_PTS_FILE_NAME);
-    throw -1;
-  }
+// Heap and global addresses stay the same from one execution to the next, and from
+// one chesstool run to the next, which keeps mutexes recognizable in state hashes
+void disable_address_randomization()
+{
+  if (STATE_CACHE_FILE_NAME)
+    personality(personality(0xffffffff) | ADDR_NO_RANDOMIZE);
+}
 
-  while (!infile.eof())
-    infile >> input;
+// Check the state cache belongs to this build of the program, otherwise start a
+// new one, and hand it to the executions
+void open_state_cache()
+{
+  struct stat program;
+  stat(TEST_PROGRAM, &program);
+
+  StateCacheHeader header;
+  ifstream infile(STATE_CACHE_FILE_NAME, ios_base::binary);
+  bool valid = infile.read((char *)&header, sizeof(header)) && memcmp(header.magic, STATE_CACHE_MAGIC, sizeof(header.magic)) == 0
+    && header.version == STATE_CACHE_VERSION && header.programSize == program.st_size && header.programMtime == program.st_mtime;
   infile.close();
 
-  int len = input.length();
-  int DELIMITER_POS = input.find('/');
-  if (DELIMITER_POS == (int)string::npos) {
-    fprintf(stderr, "Error: Corrupt data in %s\n", TRACK_SYNC_PTS_FILE_NAME);
-    throw -1;
+  if (valid) {
+    STATES_BEFORE = header.count;
+    fprintf(stderr, "State cache %s holds %lld states and %d crashes\n\n", STATE_CACHE_FILE_NAME, header.count, (int)cached_crashes().size());
+  } else {
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, STATE_CACHE_MAGIC, sizeof(header.magic));
+    header.version = STATE_CACHE_VERSION;
+    header.capacity = STATE_CACHE_CAPACITY;
+    header.programSize = program.st_size;
+    header.programMtime = program.st_mtime;
+
+    int fd = open(STATE_CACHE_FILE_NAME, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || write(fd, &header, sizeof(header)) != sizeof(header) || ftruncate(fd, sizeof(header) + header.capacity * sizeof(unsigned long long)) != 0) {
+      fprintf(stderr, "Error: Cannot create state cache %s\n", STATE_CACHE_FILE_NAME);
+      exit(0);
+    }
+    close(fd);
+    fprintf(stderr, "Starting state cache %s for %s\n\n", STATE_CACHE_FILE_NAME, TEST_PROGRAM);
   }
 
-  string current = input.substr(0, DELIMITER_POS);
-  string total = input.substr(DELIMITER_POS + 1, len);
+  setenv("CHESS_STATE_CACHE", STATE_CACHE_FILE_NAME, 1);
+}
 
-  SyncPts syncPts;
-  syncPts.current = atoi(current.c_str());
-  syncPts.total = atoi(total.c_str());
+// States in the state cache, chess.so counts them in its header
+long long cached_states()
+{
+  StateCacheHeader header;
+  ifstream infile(STATE_CACHE_FILE_NAME, ios_base::binary);
+  if (!infile.read((char *)&header, sizeof(header)))
+    return 0;
+  return header.count;
+}
 
-  return syncPts;
+// Failed executions of the runs that filled the state cache, one line each after
+// the states chess.so maps: "<preemptions> <seed> <outcome>". Executions that reach
+// their states again are pruned, so their crashes are only known from here.
+vector<string> cached_crashes()
+{
+  vector<string> crashes;
+  StateCacheHeader header;
+  ifstream infile(STATE_CACHE_FILE_NAME, ios_base::binary);
+  if (!infile.read((char *)&header, sizeof(header)) || !infile.seekg(sizeof(header) + header.capacity * sizeof(unsigned long long)))
+    return crashes;
+
+  string line;
+  while (getline(infile, line))
+    if (!line.empty())
+      crashes.push_back(line);
+  return crashes;
 }
 
-// Read tracking file and returns the total synchronization points found
-int read_total_sync_pts()
+// Add the crashes of this run to the state cache and print those of earlier runs
+// Returns the number of earlier crashes
+int report_cached_crashes(vector<ExecutionResult> &crashes)
 {
-  SyncPts pts = read_sync_pts();
-  return pts.total;
+  if (!STATE_CACHE_FILE_NAME)
+    return 0;
+
+  vector<string> cached = cached_crashes();
+  set<string> known(cached.begin(), cached.end());
+  set<string> found;
+  string lines;
+  for (size_t i = 0; i < crashes.size(); i++) {
+    stringstream line;
+    line << journal_schedule(crashes[i].schedule) << " " << crashes[i].schedule.seed << " " << outcome(crashes[i]);
+    found.insert(line.str());
+    if (known.insert(line.str()).second)
+      lines += line.str() + "\n";
+  }
+
+  int fd = open(STATE_CACHE_FILE_NAME, O_WRONLY | O_APPEND);
+  if (!lines.empty() && (fd < 0 || write(fd, lines.data(), lines.size()) != (ssize_t)lines.size()))
+    fprintf(stderr, "Error: Cannot add crashes to the state cache %s\n", STATE_CACHE_FILE_NAME);
+  if (fd >= 0)
+    close(fd);
+
+  int earlier = 0;
+  for (size_t i = 0; i < cached.size(); i++) {
+    if (found.count(cached[i]))
+      continue;
+    stringstream fields(cached[i]);
+    string preemptions, kind;
+    unsigned long long seed;
+    if (!(fields >> preemptions >> seed >> kind))
+      continue;
+    if (seed != 0)
+      fprintf(stderr, "Crash found by an earlier run with state cache %s, PCT seed %llu, change points: %s (%s)\n", STATE_CACHE_FILE_NAME, seed, preemptions.c_str(), kind.c_str());
+    else
+      fprintf(stderr, "Crash found by an earlier run with state cache %s, preemptions: %s (%s)\n", STATE_CACHE_FILE_NAME, preemptions.c_str(), kind.c_str());
+    earlier++;
+  }
+  return earlier;
 }
 
-// Read tracking file and returns the current synchronization point found
-int read_current_sync_pts()
+// Helper method for starting bash script in a child process
+// The child gets its schedule, trace file and record file through the environment
+pid_t start_command(string command, Schedule &schedule, int worker, int outputFd)
 {
-  SyncPts pts = read_sync_pts();
-  return pts.current;
+  pid_t pid = fork();
+  if (pid == 0) {
+    // Own process group, a timeout kills the shell and the program
+    setpgid(0, 0);
+    if (outputFd >= 0) {
+      dup2(outputFd, STDOUT_FILENO);
+      dup2(outputFd, STDERR_FILENO);
+    }
+    limit_cpu_time();
+    disable_address_randomization();
+    setenv("CHESS_SCHEDULE", format_preemptions(schedule.preemptions).c_str(), 1);
+    if (PCT_RUNS > 0) {
+      stringstream seed;
+      seed << schedule.seed;
+      setenv("CHESS_PCT_SEED", seed.str().c_str(), 1);
+    }
+    if (PREEMPTION_BOUND >= 0)
+      setenv("CHESS_TRACE_FILE", worker_file_name(TRACE_FILE_NAME, worker).c_str(), 1);
+    setenv("CHESS_RECORD_FILE", worker_file_name(RECORD_FILE_NAME, worker).c_str(), 1);
+    if (PROFILE_FILE_NAME)
+      setenv("CHESS_PROFILE", worker_file_name(PROFILE_TRACE_NAME, worker).c_str(), 1);
+    execl("/bin/sh", "sh", "-c", command.c_str(), (char *)NULL);
+    _exit(127);
+  }
+  if (pid > 0)
+    setpgid(pid, pid);
+  return pid;
 }
 
-// Write to tracking file with values in SyncPts argument
-void update_track_sync_pts_file(SyncPts pts)
+// Trace or record file private to a parallel worker
+string worker_file_name(const char *fileName, int worker)
 {
-    string newString;
-    stringstream temp1;
-    stringstream temp2;
-    temp1 << pts.current;
-    newString.append(temp1.str());
-    newString.append("/");
-    temp2 << pts.total;
-    newString.append(temp2.str());
+  stringstream name;
+  name << fileName << "." << worker;
+  return name.str();
+}
 
-    // Write back to file
-    ofstream outfile;
-    outfile.open(TRACK_SYNC_PTS_FILE_NAME);
+// Where the decisions of a crashing schedule are kept, "<program>.<schedule>.replay"
+// Candidates of --minimize get their own names, the replay being minimized may be one
+string replay_file_name(int id)
+{
+  const char *program = strrchr(TEST_PROGRAM, '/');
+  stringstream name;
+  name << (program ? program + 1 : TEST_PROGRAM) << (MINIMIZE_SCHEDULE ? ".min." : ".") << id << ".replay";
+  return name.str();
+}
 
-    if (outfile)
-        outfile.write(newString.c_str(), (int)newString.length());
+// Keep the decisions of a crashing execution, the next one overwrites the record file
+// The record file is copied rather than renamed, a fork server keeps it mapped
+void save_replay_file(const char *recordFileName, int id)
+{
+  vector<Decision> decisions;
+  if (read_decisions(recordFileName, decisions))
+    write_replay_file(decisions, id);
+}
 
-    outfile.close();
+void write_replay_file(vector<Decision> &decisions, int id)
+{
+  DecisionFileHeader header;
+  memcpy(header.magic, DECISION_FILE_MAGIC, sizeof(header.magic));
+  header.version = DECISION_FILE_VERSION;
+  header.count = decisions.size();
+  header.deadlocked = 0;
+  header.reserved = 0;
+
+  ofstream outfile(replay_file_name(id).c_str(), ios_base::binary | ios_base::trunc);
+  outfile.write((char *)&header, sizeof(header));
+  if (!decisions.empty())
+    outfile.write((char *)&decisions[0], decisions.size() * sizeof(Decision));
+  outfile.close();
 }
 
-// Use CHESS algorithm to explore test program
-// If program does not return appropriate status code, we assume a crash occurred
-// Iterate through each synchronization point for a total of TOTAL_SYNC_PTS
-void explore_program()
+// Preemptions as "<sync point>:<thread>,...", the format chess.so reads from CHESS_SCHEDULE
+string format_preemptions(vector<Preemption> &preemptions)
 {
-  int current = read_current_sync_pts();
-  int *crashes = (int *)malloc(sizeof(int) * TOTAL_SYNC_PTS);
-  int numCrashes = 0;
+  stringstream str;
+  for (size_t i = 0; i < preemptions.size(); i++) {
+    if (i > 0)
+      str << ",";
+    str << preemptions[i].syncPt << ":" << preemptions[i].thread;
+  }
+  return str.str();
+}
+
+// Start the program as a fork server, it stops before main and waits for schedules
+// Returns false if the program never checked in
+bool start_fork_server(Worker &worker, string command, int w)
+{
+  int control[2];
+  int status[2];
+  if (pipe2(control, O_CLOEXEC) != 0 || pipe2(status, O_CLOEXEC) != 0)
+    return false;
 
-  while (current <= TOTAL_SYNC_PTS) {
-    string NthExecutionCommand = RUN_SH;
-    NthExecutionCommand.append(TEST_PROGRAM);
+  worker.pid = fork();
+  if (worker.pid == 0) {
+    // dup2 clears close-on-exec, only these two ends reach the program
+    dup2(control[0], FORK_SERVER_CONTROL_FD);
+    dup2(status[1], FORK_SERVER_STATUS_FD);
+    // Every child writes to the output file as it is when chesstool starts it
+    if (worker.outputFd >= 0) {
+      dup2(worker.outputFd, STDOUT_FILENO);
+      dup2(worker.outputFd, STDERR_FILENO);
+    }
+    disable_address_randomization();
+    setenv("CHESS_FORK_SERVER", "1", 1);
+    // Every child gets its seed with its schedule
+    if (PCT_RUNS > 0)
+      setenv("CHESS_PCT_SEED", "1", 1);
+    // The fork server limits the CPU time of every child it forks, not its own
+    if (CPU_TIMEOUT > 0) {
+      stringstream limit;
+      limit << CPU_TIMEOUT;
+      setenv("CHESS_CPU_LIMIT", limit.str().c_str(), 1);
+    }
+    if (PREEMPTION_BOUND >= 0)
+      setenv("CHESS_TRACE_FILE", worker_file_name(TRACE_FILE_NAME, w).c_str(), 1);
+    setenv("CHESS_RECORD_FILE", worker_file_name(RECORD_FILE_NAME, w).c_str(), 1);
+    if (PROFILE_FILE_NAME)
+      setenv("CHESS_PROFILE", worker_file_name(PROFILE_TRACE_NAME, w).c_str(), 1);
+    execl("/bin/sh", "sh", "-c", command.c_str(), (char *)NULL);
+    _exit(127);
+  }
 
-    fprintf(stderr, "========== Executing program %d/%d ==========\n", current, TOTAL_SYNC_PTS);
-    int statusCode = run_command(NthExecutionCommand);
+  close(control[0]);
+  close(status[1]);
+  worker.controlFd = control[1];
+  worker.statusFd = status[0];
 
-    if (statusCode != 0) {
-      fprintf(stderr, "!!!!!!!!!! Program crashed at synchronization point %d/%d !!!!!!!!!!\n\n", current, TOTAL_SYNC_PTS);
-      crashes[numCrashes++] = current;
-    } else {
-      fprintf(stderr, "========== Execution complete ==========\n\n");
+  int hello;
+  return worker.pid > 0 && read(worker.statusFd, &hello, sizeof(hello)) == sizeof(hello);
+}
+
+// Closing the control pipe makes the fork server exit
+void stop_fork_server(Worker &worker)
+{
+  close(worker.controlFd);
+  close(worker.statusFd);
+  waitpid(worker.pid, NULL, 0);
+  worker.controlFd = -1;
+  worker.statusFd = -1;
+}
+
+// Run schedule on worker, through its fork server or a new process
+void start_execution(Worker &worker, Schedule &schedule, string command, int w)
+{
+  worker.busy = true;
+  worker.schedule = schedule;
+  worker.timedOut = false;
+  clock_gettime(CLOCK_MONOTONIC, &worker.started);
+
+  // The program shares the file offset, it writes from the start again
+  if (worker.outputFd >= 0) {
+    ftruncate(worker.outputFd, 0);
+    lseek(worker.outputFd, 0, SEEK_SET);
+  }
+
+  if (worker.controlFd >= 0) {
+    ForkServerRequest header = { (int)schedule.preemptions.size(), 0, schedule.seed };
+    string request((char *)&header, sizeof(header));
+    if (!schedule.preemptions.empty())
+      request.append((char *)&schedule.preemptions[0], schedule.preemptions.size() * sizeof(Preemption));
+
+    // The fork server answers with the pid of the execution
+    ssize_t size = request.size();
+    if (write(worker.controlFd, request.data(), size) != size || read(worker.statusFd, &worker.child, sizeof(worker.child)) != sizeof(worker.child)) {
+      fprintf(stderr, "Error: Lost the fork server of %s\n", TEST_PROGRAM);
+      exit(0);
+    }
+    return;
+  }
+
+  worker.pid = start_command(command, schedule, w, worker.outputFd);
+  worker.pidFd = syscall(SYS_pidfd_open, worker.pid, 0);
+}
+
+// Wait for any busy worker to finish, returns its index and stores the exit status
+// and resource usage of the execution. Executions running longer than WALL_TIMEOUT
+// seconds are killed.
+int wait_for_execution(vector<Worker> &workers, ExecutionResult &result)
+{
+  while (true) {
+    vector<struct pollfd> fds;
+    vector<int> busy;
+    int timeout = -1;
+    bool polling = false;
+    for (int w = 0; w < (int)workers.size(); w++) {
+      if (!workers[w].busy)
+        continue;
+      struct pollfd fd = { FORK_SERVER ? workers[w].statusFd : workers[w].pidFd, POLLIN, 0 };
+      fds.push_back(fd);
+      busy.push_back(w);
+      if (fd.fd < 0)
+        polling = true;
+
+      if (WALL_TIMEOUT > 0 && !workers[w].timedOut) {
+        int left = (WALL_TIMEOUT - elapsed_seconds(workers[w].started)) * 1000;
+        if (left < 0)
+          left = 0;
+        if (timeout < 0 || left < timeout)
+          timeout = left;
+      }
+    }
+
+    if (polling && (timeout < 0 || timeout > EXIT_POLL_MS))
+      timeout = EXIT_POLL_MS;
+
+    int ready = poll(&fds[0], fds.size(), timeout);
+    if (ready < 0)
+      return -1;
+
+    // Executions without a pidfd are checked for having exited each time
+    for (size_t i = 0; polling && i < busy.size(); i++)
+      if (fds[i].fd < 0 && reap_execution(workers[busy[i]], result, WNOHANG))
+        return busy[i];
+
+    if (ready == 0) {
+      for (size_t i = 0; i < busy.size(); i++) {
+        Worker &worker = workers[busy[i]];
+        if (!worker.timedOut && elapsed_seconds(worker.started) >= WALL_TIMEOUT)
+          kill_execution(worker);
+      }
+      continue;
     }
 
-    current++;
+    for (int i = 0; i < (int)fds.size(); i++) {
+      if (fds[i].revents == 0)
+        continue;
+      Worker &worker = workers[busy[i]];
+      result.timedOut = worker.timedOut;
+
+      if (FORK_SERVER) {
+        ForkServerResult reply;
+        if (read(fds[i].fd, &reply, sizeof(reply)) != sizeof(reply)) {
+          fprintf(stderr, "Error: Lost the fork server of %s\n", TEST_PROGRAM);
+          exit(0);
+        }
+        result.status = reply.status;
+        result.userSeconds = reply.userUs / 1e6;
+        result.sysSeconds = reply.sysUs / 1e6;
+        result.maxRssKb = reply.maxRssKb;
+        return busy[i];
+      }
+
+      reap_execution(worker, result, 0);
+      return busy[i];
+    }
   }
+}
 
-  crashes[numCrashes] = '\0';
+// Wait for the execution of a worker without a fork server and store its exit
+// status and resource usage. Returns false if options has WNOHANG and it still runs.
+bool reap_execution(Worker &worker, ExecutionResult &result, int options)
+{
+  struct rusage usage;
+  if (wait4(worker.pid, &result.status, options, &usage) != worker.pid)
+    return false;
+  if (worker.pidFd >= 0)
+    close(worker.pidFd);
+  worker.pidFd = -1;
+  result.timedOut = worker.timedOut;
+  result.userSeconds = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+  result.sysSeconds = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+  result.maxRssKb = usage.ru_maxrss;
+  return true;
+}
 
-  print_crash_report(crashes);
+// The execution is waited for as usual once it is gone
+void kill_execution(Worker &worker)
+{
+  fprintf(stderr, "!!!!!!!!!! Schedule %d did not finish within %d s, killed !!!!!!!!!!\n", worker.schedule.id, WALL_TIMEOUT);
+  worker.timedOut = true;
+  if (FORK_SERVER)
+    kill(worker.child, SIGKILL);
+  else
+    kill(-worker.pid, SIGKILL);
 }
 
-// Print crash report
-void print_crash_report(int *crashes)
+// Execute queued schedules on up to JOBS workers until the queue runs dry
+// In fork server mode every worker forks its executions from one started program
+// Returns the number of executions
+int run_schedules(deque<Schedule> &queue, ExecutionFinished finished)
 {
-  fprintf(stderr, "========== Crash Report Begin ==========\n");
+  int explored = 0;
+  int running = 0;
 
-  if (!*crashes) {
-    fprintf(stderr, "No crash occurred! You get a cookie.\n");
-    print_oreo_cookie();
+  string NthExecutionCommand = RUN_SH;
+  NthExecutionCommand.append(TEST_PROGRAM);
+
+  vector<Worker> workers(JOBS);
+  for (int w = 0; w < JOBS; w++) {
+    workers[w].pid = 0;
+    workers[w].busy = false;
+    workers[w].controlFd = -1;
+    workers[w].statusFd = -1;
+    workers[w].pidFd = -1;
+    workers[w].timedOut = false;
+    workers[w].outputFd = CAPTURE || VERIFY_RUNS > 0 ? memfd_create("chess-output", MFD_CLOEXEC) : -1;
+
+    if (FORK_SERVER && !start_fork_server(workers[w], NthExecutionCommand, w)) {
+      fprintf(stderr, "Error: %s did not start as a fork server, is it dynamically linked?\n", TEST_PROGRAM);
+      exit(0);
+    }
+  }
+
+  while (!queue.empty() || running > 0) {
+    // Hand the next schedules to idle workers
+    for (int w = 0; w < JOBS && !queue.empty(); w++) {
+      if (workers[w].busy)
+        continue;
+
+      Schedule &schedule = queue.front();
+      if (MINIMIZE_SCHEDULE)
+        fprintf(stderr, "========== Executing candidate %d (preemptions: %s) ==========\n", schedule.id, format_preemptions(schedule.preemptions).c_str());
+      else if (VERIFY_RUNS > 0)
+        fprintf(stderr, "========== Executing run %d/%d of program %d/%d ==========\n", (schedule.id - 1) % VERIFY_RUNS + 1, VERIFY_RUNS, schedule.preemptions[0].syncPt, TOTAL_SYNC_PTS);
+      else if (PCT_RUNS > 0)
+        fprintf(stderr, "========== Executing PCT run %d/%d (seed: %llu, change points: %s) ==========\n", schedule.id, PCT_RUNS, schedule.seed, format_preemptions(schedule.preemptions).c_str());
+      else if (PREEMPTION_BOUND < 0)
+        fprintf(stderr, "========== Executing program %d/%d ==========\n", schedule.id, TOTAL_SYNC_PTS);
+      else
+        fprintf(stderr, "========== Executing schedule %d (preemptions: %s) ==========\n", schedule.id, format_preemptions(schedule.preemptions).c_str());
+
+      start_execution(workers[w], schedule, NthExecutionCommand, w);
+      queue.pop_front();
+      running++;
+    }
+
+    ExecutionResult result;
+    int w = wait_for_execution(workers, result);
+    if (w < 0)
+      continue;
+
+    running--;
+    explored++;
+    workers[w].busy = false;
+
+    // The record file of the execution counts its synchronization points
+    vector<Decision> decisions;
+    string recordFileName = worker_file_name(RECORD_FILE_NAME, w);
+    result.schedule = workers[w].schedule;
+    result.wallSeconds = elapsed_seconds(workers[w].started);
+    result.syncPts = read_decisions(recordFileName.c_str(), decisions) ? decisions.size() : -1;
+    result.deadlocked = recorded_deadlock(recordFileName.c_str());
+    if (workers[w].outputFd >= 0) {
+      string output = read_output(workers[w].outputFd);
+      result.outputHash = hash_bytes(output.data(), output.size(), 14695981039346656037ULL);
+      if (CAPTURE)
+        check_output(result, output, recordFileName.c_str());
+    }
+    if (RESULTS_FILE_NAME)
+      RESULTS.push_back(result);
+    if (VERIFY_RUNS > 0)
+      result.decisions.swap(decisions);
+
+    if (failed(result))
+      save_replay_file(recordFileName.c_str(), workers[w].schedule.id);
+
+    size_t queued = queue.size();
+    int prunedSchedules = PRUNED_SCHEDULES;
+    finished(result, worker_file_name(TRACE_FILE_NAME, w).c_str(), queue);
+    journal_execution(result, queue, queued, PRUNED_SCHEDULES - prunedSchedules);
+    if (PROFILE_FILE_NAME)
+      read_profile(worker_file_name(PROFILE_TRACE_NAME, w).c_str(), &result);
   }
 
-  for (int i = 0; crashes[i] != '\0'; i++) {
-    fprintf(stderr, "Crash occurred at synchronization point %d/%d\n", crashes[i], TOTAL_SYNC_PTS);
+  for (int w = 0; w < JOBS; w++) {
+    if (FORK_SERVER)
+      stop_fork_server(workers[w]);
+    if (workers[w].outputFd >= 0)
+      close(workers[w].outputFd);
+    remove(worker_file_name(TRACE_FILE_NAME, w).c_str());
+    remove(worker_file_name(RECORD_FILE_NAME, w).c_str());
   }
 
-  fprintf(stderr, "========== Crash Report End ==========\n");
+  return explored;
+}
+
+// Sweep the queued schedules from one execution without preemptions instead of
+// running each from the start: chess.so forks that execution at the synchronization
+// point of every schedule and the child preempts there. Up to JOBS children run at
+// once. Schedules the execution never reached, because it crashed first, run from
+// the start afterwards. Returns the number of executions.
+int run_checkpointed(deque<Schedule> &queue, ExecutionFinished finished)
+{
+  if (queue.empty())
+    return 0;
+
+  map<int, Schedule> schedules;
+  ofstream checkpoints(CHECKPOINT_TRACE_NAME, ios_base::trunc);
+  for (size_t i = 0; i < queue.size(); i++) {
+    schedules[queue[i].id] = queue[i];
+    checkpoints << queue[i].id << "\n";
+  }
+  checkpoints.close();
+  queue.clear();
+
+  int status[2];
+  if (pipe2(status, O_CLOEXEC) != 0) {
+    fprintf(stderr, "Error: Cannot start the checkpointing execution of %s\n", TEST_PROGRAM);
+    exit(0);
+  }
+
+  string command = RUN_SH;
+  command.append(TEST_PROGRAM);
+
+  // The children report to chesstool through the status pipe of the fork server
+  pid_t pid = fork();
+  if (pid == 0) {
+    dup2(status[1], FORK_SERVER_STATUS_FD);
+    limit_cpu_time();
+    disable_address_randomization();
+    setenv("CHESS_SCHEDULE", "", 1);
+    setenv("CHESS_CHECKPOINTS", CHECKPOINT_TRACE_NAME, 1);
+    stringstream jobs;
+    jobs << JOBS;
+    setenv("CHESS_CHECKPOINT_JOBS", jobs.str().c_str(), 1);
+    setenv("CHESS_RECORD_FILE", worker_file_name(RECORD_FILE_NAME, 0).c_str(), 1);
+    if (PROFILE_FILE_NAME)
+      setenv("CHESS_PROFILE", worker_file_name(PROFILE_TRACE_NAME, 0).c_str(), 1);
+    // A child copies the output of the checkpointing execution so far, which it
+    // reads through its stdout, into a file of its own
+    if (CAPTURE) {
+      string outputFileName = worker_file_name(OUTPUT_TRACE_NAME, 0);
+      int outputFd = open(outputFileName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+      dup2(outputFd, STDOUT_FILENO);
+      dup2(outputFd, STDERR_FILENO);
+      setenv("CHESS_OUTPUT_FILE", outputFileName.c_str(), 1);
+    }
+    execl("/bin/sh", "sh", "-c", command.c_str(), (char *)NULL);
+    _exit(127);
+  }
+  close(status[1]);
+
+  int explored = 0;
+  map<pid_t, Checkpoint> running;
+  while (pid > 0) {
+    int timeout = -1;
+    for (map<pid_t, Checkpoint>::iterator it = running.begin(); it != running.end() && WALL_TIMEOUT > 0; ++it) {
+      if (it->second.timedOut)
+        continue;
+      int left = (WALL_TIMEOUT - elapsed_seconds(it->second.started)) * 1000;
+      if (left < 0)
+        left = 0;
+      if (timeout < 0 || left < timeout)
+        timeout = left;
+    }
+
+    struct pollfd fd = { status[0], POLLIN, 0 };
+    int ready = poll(&fd, 1, timeout);
+    if (ready < 0)
+      continue;
+
+    if (ready == 0) {
+      for (map<pid_t, Checkpoint>::iterator it = running.begin(); it != running.end(); ++it) {
+        if (it->second.timedOut || elapsed_seconds(it->second.started) < WALL_TIMEOUT)
+          continue;
+        fprintf(stderr, "!!!!!!!!!! Schedule %d did not finish within %d s, killed !!!!!!!!!!\n", it->second.syncPt, WALL_TIMEOUT);
+        it->second.timedOut = true;
+        kill(it->first, SIGKILL);
+      }
+      continue;
+    }
+
+    // End of file once the checkpointing execution exited
+    CheckpointMessage message;
+    if (read(status[0], &message, sizeof(message)) != sizeof(message))
+      break;
+
+    if (!message.finished) {
+      Checkpoint checkpoint;
+      checkpoint.syncPt = message.syncPt;
+      checkpoint.timedOut = false;
+      clock_gettime(CLOCK_MONOTONIC, &checkpoint.started);
+      running[message.pid] = checkpoint;
+      fprintf(stderr, "========== Executing program %d/%d from its checkpoint ==========\n", message.syncPt, TOTAL_SYNC_PTS);
+      continue;
+    }
+
+    Checkpoint checkpoint = running[message.pid];
+    running.erase(message.pid);
+    explored++;
+
+    // Every child records its decisions and profile in files of its own
+    ExecutionResult result;
+    vector<Decision> decisions;
+    string recordFileName = worker_file_name(RECORD_FILE_NAME, message.syncPt);
+    result.schedule = schedules[message.syncPt];
+    result.status = message.result.status;
+    result.userSeconds = message.result.userUs / 1e6;
+    result.sysSeconds = message.result.sysUs / 1e6;
+    result.maxRssKb = message.result.maxRssKb;
+    result.timedOut = checkpoint.timedOut;
+    result.wallSeconds = elapsed_seconds(checkpoint.started);
+    result.syncPts = read_decisions(recordFileName.c_str(), decisions) ? decisions.size() : -1;
+    result.deadlocked = recorded_deadlock(recordFileName.c_str());
+    schedules.erase(message.syncPt);
+    if (CAPTURE) {
+      string outputFileName = worker_file_name(OUTPUT_TRACE_NAME, message.syncPt);
+      int outputFd = open(outputFileName.c_str(), O_RDONLY);
+      string output = read_output(outputFd);
+      close(outputFd);
+      result.outputHash = hash_bytes(output.data(), output.size(), 14695981039346656037ULL);
+      check_output(result, output, recordFileName.c_str());
+      remove(outputFileName.c_str());
+    }
+    if (RESULTS_FILE_NAME)
+      RESULTS.push_back(result);
+
+    if (failed(result))
+      save_replay_file(recordFileName.c_str(), result.schedule.id);
+    remove(recordFileName.c_str());
+
+    size_t queued = queue.size();
+    int prunedSchedules = PRUNED_SCHEDULES;
+    finished(result, TRACE_FILE_NAME, queue);
+    journal_execution(result, queue, queued, PRUNED_SCHEDULES - prunedSchedules);
+    if (PROFILE_FILE_NAME)
+      read_profile(worker_file_name(PROFILE_TRACE_NAME, message.syncPt).c_str(), &result);
+  }
+
+  close(status[0]);
+  if (pid > 0)
+    waitpid(pid, NULL, 0);
+  remove(CHECKPOINT_TRACE_NAME);
+  remove(worker_file_name(RECORD_FILE_NAME, 0).c_str());
+  if (PROFILE_FILE_NAME)
+    remove(worker_file_name(PROFILE_TRACE_NAME, 0).c_str());
+  if (CAPTURE)
+    remove(worker_file_name(OUTPUT_TRACE_NAME, 0).c_str());
+
+  if (schedules.empty())
+    return explored;
+
+  fprintf(stderr, "========== %d schedules were not reached from a checkpoint, executing them from the start ==========\n", (int)schedules.size());
+  for (map<int, Schedule>::iterator it = schedules.begin(); it != schedules.end(); ++it)
+    queue.push_back(it->second);
+  return explored + run_schedules(queue, finished);
+}
+
+double elapsed_seconds(struct timespec start)
+{
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+// Read the trace chess.so wrote for an execution, one line per synchronization point
+vector<SyncPtTrace> read_trace(const char *traceFileName)
+{
+  vector<SyncPtTrace> trace;
+  map<int, int> lines;
+  ifstream infile;
+  infile.open(traceFileName);
+
+  string line;
+  while (getline(infile, line)) {
+    SyncPtTrace syncPt;
+    string enabled;
+    stringstream fields(line);
+
+    // "E <sync point> <kind> <object>": an operation after that synchronization point
+    if (line[0] == 'E') {
+      int point;
+      char kind;
+      string object;
+      fields >> enabled >> point >> kind >> object;
+      if (lines.find(point) == lines.end())
+        continue;
+      if (kind == 'C')
+        trace[lines[point]].createsThread = true;
+      else
+        trace[lines[point]].mutexes.push_back(object);
+      continue;
+    }
+
+    if (!(fields >> syncPt.syncPt >> syncPt.running >> enabled))
+      continue;
+    syncPt.createsThread = false;
+    lines[syncPt.syncPt] = trace.size();
+
+    stringstream threads(enabled);
+    string thread;
+    while (getline(threads, thread, ','))
+      syncPt.enabled.push_back(atoi(thread.c_str()));
+    trace.push_back(syncPt);
+  }
+  infile.close();
+
+  return trace;
+}
+
+// Partial-order reduction: preempting the running thread at synchronization point i
+// and at its next synchronization point i + 1 give equivalent schedules when the
+// operations in between only touch mutexes (or condition variables, rwlocks,
+// semaphores and barriers) no other thread uses later in the trace.
+// Only the switch at i + 1 is kept then. Returns which trace lines are redundant.
+vector<bool> redundant_preemptions(vector<SyncPtTrace> &trace)
+{
+  vector<bool> redundant(trace.size(), false);
+  // Threads that use each mutex after the line being looked at
+  map<string, set<int> > laterUsers;
+
+  for (int i = (int)trace.size() - 1; i >= 0; i--) {
+    int running = trace[i].running;
+
+    if (i + 1 < (int)trace.size() && trace[i + 1].running == running && !trace[i].createsThread) {
+      bool independent = true;
+      for (size_t m = 0; m < trace[i].mutexes.size() && independent; m++) {
+        set<int> &users = laterUsers[trace[i].mutexes[m]];
+        if (users.size() > 1 || (users.size() == 1 && *users.begin() != running))
+          independent = false;
+      }
+      redundant[i] = independent;
+    }
+
+    for (size_t m = 0; m < trace[i].mutexes.size(); m++)
+      laterUsers[trace[i].mutexes[m]].insert(running);
+  }
+
+  return redundant;
+}
+
+// Read a decision file chess.so recorded, false if it is not one
+bool read_decisions(const char *fileName, vector<Decision> &decisions)
+{
+  ifstream infile(fileName, ios_base::binary);
+  DecisionFileHeader header;
+  if (!infile.read((char *)&header, sizeof(header)) || memcmp(header.magic, DECISION_FILE_MAGIC, sizeof(header.magic)) != 0 || header.version != DECISION_FILE_VERSION || header.count < 0)
+    return false;
+
+  decisions.resize(header.count);
+  return header.count == 0 || infile.read((char *)&decisions[0], header.count * sizeof(Decision));
+}
+
+// Whether the execution that wrote a record file ended in a deadlock chess.so found
+bool recorded_deadlock(const char *fileName)
+{
+  ifstream infile(fileName, ios_base::binary);
+  DecisionFileHeader header;
+  return infile.read((char *)&header, sizeof(header)) && memcmp(header.magic, DECISION_FILE_MAGIC, sizeof(header.magic)) == 0
+    && header.version == DECISION_FILE_VERSION && header.deadlocked;
+}
+
+// The switches of a recorded execution, as the schedule that makes them
+vector<Preemption> replay_preemptions(vector<Decision> &decisions)
+{
+  vector<Preemption> preemptions;
+  for (size_t i = 0; i < decisions.size(); i++) {
+    if (decisions[i].next == decisions[i].running)
+      continue;
+    Preemption preemption = { decisions[i].syncPt, decisions[i].next };
+    preemptions.push_back(preemption);
+  }
+  return preemptions;
+}
+
+// Run the program once with the schedule recorded in a decision file
+// chess.so reports where the execution stops following the recording
+void replay_program()
+{
+  vector<Decision> decisions;
+  if (!read_decisions(REPLAY_FILE_NAME, decisions)) {
+    fprintf(stderr, "Error: %s is not a replay file.\n", REPLAY_FILE_NAME);
+    exit(0);
+  }
+
+  vector<Preemption> preemptions = replay_preemptions(decisions);
+
+  fprintf(stderr, "========== Replaying %s (%d synchronization points, preemptions: %s) ==========\n", REPLAY_FILE_NAME, (int)decisions.size(), format_preemptions(preemptions).c_str());
+
+  setenv("CHESS_REPLAY_FILE", REPLAY_FILE_NAME, 1);
+  string command = RUN_SH;
+  command.append(TEST_PROGRAM);
+  int statusCode = run_command(command);
+
+  if (statusCode != 0)
+    fprintf(stderr, "!!!!!!!!!! Program crashed during replay !!!!!!!!!!\n");
+  else
+    fprintf(stderr, "========== Replay complete, no crash ==========\n");
+}
+
+// Read tracking file and returns SyncPts struct
+SyncPts read_sync_pts()
+{
+  string input;
+  ifstream infile;
+  infile.open(TRACK_SYNC_PTS_FILE_NAME);
+
+  if (!infile) {
+    fprintf(stderr, "Error: No data in %s\n", TRACK_SYNC_PTS_FILE_NAME);
+    throw -1;
+  }
+
+  while (!infile.eof())
+    infile >> input;
+  infile.close();
+
+  int len = input.length();
+  int DELIMITER_POS = input.find('/');
+  if (DELIMITER_POS == (int)string::npos) {
+    fprintf(stderr, "Error: Corrupt data in %s\n", TRACK_SYNC_PTS_FILE_NAME);
+    throw -1;
+  }
+
+  string current = input.substr(0, DELIMITER_POS);
+  string total = input.substr(DELIMITER_POS + 1, len);
+
+  SyncPts syncPts;
+  syncPts.current = atoi(current.c_str());
+  syncPts.total = atoi(total.c_str());
+
+  return syncPts;
+}
+
+// Read tracking file and returns the total synchronization points found
+int read_total_sync_pts()
+{
+  SyncPts pts = read_sync_pts();
+  return pts.total;
+}
+
+// Read tracking file and returns the current synchronization point found
+int read_current_sync_pts()
+{
+  SyncPts pts = read_sync_pts();
+  return pts.current;
+}
+
+// Write to tracking file with values in SyncPts argument
+void update_track_sync_pts_file(SyncPts pts)
+{
+    string newString;
+    stringstream temp1;
+    stringstream temp2;
+    temp1 << pts.current;
+    newString.append(temp1.str());
+    newString.append("/");
+    temp2 << pts.total;
+    newString.append(temp2.str());
+
+    // Write back to file
+    ofstream outfile;
+    outfile.open(TRACK_SYNC_PTS_FILE_NAME);
+
+    if (outfile)
+        outfile.write(newString.c_str(), (int)newString.length());
+
+    outfile.close();
+}
+
+// Use CHESS algorithm to explore test program
+// If program does not return appropriate status code, we assume a crash occurred
+// Iterate through each synchronization point for a total of TOTAL_SYNC_PTS
+void explore_program()
+{
+  int resumed = restore_executions(CRASHES);
+
+  deque<Schedule> queue;
+  for (int current = read_current_sync_pts(); current <= TOTAL_SYNC_PTS; current++) {
+    if (JOURNAL_FINISHED.count(current))
+      continue;
+    if (!FILTER_SPECS.empty() && !binary_search(PREEMPTIBLE_SYNC_PTS.begin(), PREEMPTIBLE_SYNC_PTS.end(), current))
+      continue;
+
+    // The Nth execution preempts the running thread at the Nth synchronization point
+    Schedule schedule;
+    schedule.id = current;
+    schedule.seed = 0;
+    Preemption preemption = { current, -1 };
+    schedule.preemptions.push_back(preemption);
+    queue.push_back(schedule);
+  }
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  int ran = CHECKPOINT ? run_checkpointed(queue, sweep_finished) : run_schedules(queue, sweep_finished);
+  int explored = resumed + ran;
+
+  double seconds = elapsed_seconds(start);
+  fprintf(stderr, "Explored %d schedules in %.3f s (%.1f schedules/s)\n", explored, seconds, ran / seconds);
+  print_state_coverage(explored);
+  fprintf(stderr, "\n");
+
+  // Workers finish out of order
+  sort(CRASHES.begin(), CRASHES.end(), earlier_schedule);
+
+  print_crash_report(CRASHES);
+  print_output_report();
+  write_results_file(explored, seconds);
+  write_profile();
+}
+
+void sweep_finished(ExecutionResult &result, const char *, deque<Schedule> &)
+{
+  Schedule &schedule = result.schedule;
+  if (pruned(result)) {
+    fprintf(stderr, "========== Execution pruned, its state was explored before ==========\n\n");
+    PRUNED_EXECUTIONS++;
+  } else if (result.status != 0) {
+    fprintf(stderr, "!!!!!!!!!! Program crashed at synchronization point %d/%d%s (replay: %s) !!!!!!!!!!\n\n", schedule.id, TOTAL_SYNC_PTS, failure_note(result).c_str(), replay_file_name(schedule.id).c_str());
+    CRASHES.push_back(result);
+  } else {
+    fprintf(stderr, "========== Execution complete ==========\n\n");
+  }
+}
+
+// Run every schedule of the sweep VERIFY_RUNS times, in parallel on the workers,
+// and compare the decisions, the exit status and the output of the runs in memory.
+// Replays are kept only of the runs that diverged and of their reference.
+void verify_determinism()
+{
+  deque<Schedule> queue;
+  int verified = 0;
+  for (int current = 1; current <= TOTAL_SYNC_PTS; current++) {
+    if (!FILTER_SPECS.empty() && !binary_search(PREEMPTIBLE_SYNC_PTS.begin(), PREEMPTIBLE_SYNC_PTS.end(), current))
+      continue;
+    verified++;
+
+    for (int run = 0; run < VERIFY_RUNS; run++) {
+      Schedule schedule;
+      schedule.id = (current - 1) * VERIFY_RUNS + run + 1;
+      schedule.seed = 0;
+      Preemption preemption = { current, -1 };
+      schedule.preemptions.push_back(preemption);
+      queue.push_back(schedule);
+    }
+  }
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  int ran = run_schedules(queue, verify_finished);
+
+  double seconds = elapsed_seconds(start);
+  fprintf(stderr, "Verified %d schedules %d times each in %.3f s (%.1f executions/s)\n\n", verified, VERIFY_RUNS, seconds, ran / seconds);
+
+  fprintf(stderr, "========== Determinism Report Begin ==========\n");
+  if (VERIFY_DIVERGED.empty())
+    fprintf(stderr, "Every run of a schedule made the same decisions, ended the same way and printed the same output.\n");
+  for (map<int, string>::iterator it = VERIFY_DIVERGED.begin(); it != VERIFY_DIVERGED.end(); ++it)
+    fprintf(stderr, "Schedule %d/%d diverged: %s\n", it->first, TOTAL_SYNC_PTS, it->second.c_str());
+  fprintf(stderr, "========== Determinism Report End ==========\n");
+
+  write_results_file(ran, seconds);
+}
+
+void verify_finished(ExecutionResult &result, const char *, deque<Schedule> &)
+{
+  int syncPt = result.schedule.preemptions[0].syncPt;
+  int run = (result.schedule.id - 1) % VERIFY_RUNS + 1;
+  bool last = ++VERIFY_FINISHED[syncPt] == VERIFY_RUNS;
+  remove(replay_file_name(result.schedule.id).c_str());
+
+  if (!VERIFY_REFERENCE.count(syncPt)) {
+    fprintf(stderr, "========== Execution complete, the reference of its schedule ==========\n\n");
+    VERIFY_REFERENCE[syncPt] = result;
+    return;
+  }
+
+  ExecutionResult &reference = VERIFY_REFERENCE[syncPt];
+  if (VERIFY_DIVERGED.count(syncPt)) {
+    fprintf(stderr, "========== Execution complete ==========\n\n");
+    if (last)
+      VERIFY_REFERENCE.erase(syncPt);
+    return;
+  }
+
+  // The decisions are hashed as a whole, a mismatch is located decision by decision
+  stringstream divergence;
+  vector<Decision> &expected = reference.decisions;
+  vector<Decision> &decisions = result.decisions;
+  unsigned long long expectedHash = hash_bytes((char *)expected.data(), expected.size() * sizeof(Decision), 14695981039346656037ULL);
+  unsigned long long hash = hash_bytes((char *)decisions.data(), decisions.size() * sizeof(Decision), 14695981039346656037ULL);
+  if (hash != expectedHash) {
+    size_t i = 0;
+    while (i < expected.size() && i < decisions.size() && memcmp(&expected[i], &decisions[i], sizeof(Decision)) == 0)
+      i++;
+    divergence << "run " << run << " left run " << (reference.schedule.id - 1) % VERIFY_RUNS + 1 << " at synchronization point " << i + 1
+      << ": " << describe_decision(decisions, i) << " instead of " << describe_decision(expected, i);
+  } else if (result.status != reference.status) {
+    divergence << "run " << run << " ended as " << outcome(result) << " (status " << result.status << "), run "
+      << (reference.schedule.id - 1) % VERIFY_RUNS + 1 << " as " << outcome(reference) << " (status " << reference.status << ")";
+  } else if (result.status == 0 && result.outputHash != reference.outputHash) {
+    divergence << "run " << run << " printed another output than run " << (reference.schedule.id - 1) % VERIFY_RUNS + 1;
+  }
+
+  if (divergence.str().empty()) {
+    fprintf(stderr, "========== Execution complete, same as the reference ==========\n\n");
+  } else {
+    write_replay_file(expected, reference.schedule.id);
+    write_replay_file(decisions, result.schedule.id);
+    divergence << " (replays: " << replay_file_name(reference.schedule.id) << ", " << replay_file_name(result.schedule.id) << ")";
+    VERIFY_DIVERGED[syncPt] = divergence.str();
+    fprintf(stderr, "!!!!!!!!!! Schedule %d/%d diverged: %s !!!!!!!!!!\n\n", syncPt, TOTAL_SYNC_PTS, divergence.str().c_str());
+  }
+
+  if (last)
+    VERIFY_REFERENCE.erase(syncPt);
+}
+
+// "thread 1 at mutex_lock of object 2, then thread 0", or the end of the execution
+string describe_decision(vector<Decision> &decisions, size_t i)
+{
+  if (i >= decisions.size())
+    return "the end of the execution";
+
+  Decision &decision = decisions[i];
+  stringstream description;
+  description << "thread " << decision.running << " at " << sync_pt_kind_name(decision.kind);
+  if (decision.mutex >= 0)
+    description << " of object " << decision.mutex;
+  description << ", then thread " << decision.next;
+  return description.str();
+}
+
+// Iterative context bounding: explore every schedule with 0, 1, ... PREEMPTION_BOUND preemptions
+// A finished schedule is extended by one preemption at each later synchronization point of its
+// trace, to each thread that was enabled there. The queue is first in first out, so all
+// schedules with n preemptions run before any schedule with n + 1.
+void explore_bounded()
+{
+  deque<Schedule> queue;
+  ExecutionResult root;
+  root.schedule.id = 0;
+  root.schedule.seed = 0;
+  root.status = 0;
+  root.deadlocked = false;
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  // The first execution already ran the schedule without preemptions. A resumed run
+  // queues what the journal queued and did not finish.
+  int resumed = restore_executions(CRASHED_SCHEDULES);
+  if (JOURNAL_SYNC_PTS < 0) {
+    bounded_finished(root, TRACE_FILE_NAME, queue);
+    journal_census(queue, 0);
+  } else {
+    for (size_t i = 0; i < JOURNAL_QUEUED.size(); i++) {
+      if (!JOURNAL_FINISHED.count(JOURNAL_QUEUED[i].id))
+        queue.push_back(JOURNAL_QUEUED[i]);
+      NEXT_SCHEDULE_ID = max(NEXT_SCHEDULE_ID, JOURNAL_QUEUED[i].id + 1);
+    }
+    PRUNED_SCHEDULES = JOURNAL_PRUNED_SCHEDULES;
+  }
+  remove(TRACE_FILE_NAME);
+
+  int ran = run_schedules(queue, bounded_finished);
+  int explored = 1 + resumed + ran;
+
+  double seconds = elapsed_seconds(start);
+  fprintf(stderr, "Explored %d schedules with up to %d preemptions in %.3f s (%.1f schedules/s)\n", explored, PREEMPTION_BOUND, seconds, ran / seconds);
+  if (REDUCTION)
+    fprintf(stderr, "Partial-order reduction pruned %d schedules before running them (and never extended them)\n", PRUNED_SCHEDULES);
+  print_state_coverage(explored);
+  fprintf(stderr, "\n");
+
+  print_bounded_crash_report();
+  print_output_report();
+  write_results_file(explored, seconds);
+  write_profile();
+}
+
+void bounded_finished(ExecutionResult &result, const char *traceFileName, deque<Schedule> &queue)
+{
+  Schedule &schedule = result.schedule;
+
+  if (failed(result)) {
+    fprintf(stderr, "!!!!!!!!!! Program crashed with schedule %d%s (preemptions: %s, replay: %s) !!!!!!!!!!\n\n", schedule.id, failure_note(result).c_str(), format_preemptions(schedule.preemptions).c_str(), replay_file_name(schedule.id).c_str());
+    CRASHED_SCHEDULES.push_back(result);
+    return;
+  }
+  // A pruned execution stopped where its state was explored before, its trace ends
+  // there and it is only extended before that point
+  if (pruned(result)) {
+    fprintf(stderr, "========== Execution pruned, its state was explored before ==========\n\n");
+    PRUNED_EXECUTIONS++;
+  } else if (schedule.id > 0) {
+    fprintf(stderr, "========== Execution complete ==========\n\n");
+  }
+
+  if ((int)schedule.preemptions.size() >= PREEMPTION_BOUND)
+    return;
+
+  int lastSyncPt = schedule.preemptions.empty() ? 0 : schedule.preemptions.back().syncPt;
+  vector<SyncPtTrace> trace = read_trace(traceFileName);
+  vector<bool> redundant;
+  if (REDUCTION)
+    redundant = redundant_preemptions(trace);
+
+  for (size_t i = 0; i < trace.size(); i++) {
+    if (trace[i].syncPt <= lastSyncPt)
+      continue;
+
+    for (size_t t = 0; t < trace[i].enabled.size(); t++) {
+      if (trace[i].enabled[t] == trace[i].running)
+        continue;
+
+      // The same switch at the next synchronization point only commutes independent operations
+      if (REDUCTION && redundant[i] && count(trace[i + 1].enabled.begin(), trace[i + 1].enabled.end(), trace[i].enabled[t])) {
+        PRUNED_SCHEDULES++;
+        continue;
+      }
+
+      Schedule next;
+      next.id = NEXT_SCHEDULE_ID++;
+      next.seed = 0;
+      next.preemptions = schedule.preemptions;
+      Preemption preemption = { trace[i].syncPt, trace[i].enabled[t] };
+      next.preemptions.push_back(preemption);
+      queue.push_back(next);
+    }
+  }
+}
+
+// Probabilistic concurrency testing: each of PCT_RUNS executions gives the threads
+// random priorities, always runs the ready thread with the highest priority, and
+// lowers the priority of the running thread at PCT_DEPTH - 1 change points chosen
+// at random among the synchronization points of the first execution. With n threads
+// and k synchronization points, each run hits a given bug of depth PCT_DEPTH (one
+// that needs that many ordering constraints) with probability at least 1/(n k^(d-1)).
+void explore_pct()
+{
+  fprintf(stderr, "PCT with depth %d over %d synchronization points, rerun these schedules with -S %llu\n\n", PCT_DEPTH, TOTAL_SYNC_PTS, PCT_SEED);
+
+  int resumed = restore_executions(CRASHED_SCHEDULES);
+
+  // Change points fall where the filter allows preemptions
+  vector<int> candidates = PREEMPTIBLE_SYNC_PTS;
+  if (FILTER_SPECS.empty())
+    for (int point = 1; point <= TOTAL_SYNC_PTS; point++)
+      candidates.push_back(point);
+
+  deque<Schedule> queue;
+  int changePoints = min(PCT_DEPTH - 1, (int)candidates.size());
+  for (int run = 1; run <= PCT_RUNS; run++) {
+    if (JOURNAL_FINISHED.count(run))
+      continue;
+
+    Schedule schedule;
+    schedule.id = run;
+    schedule.seed = PCT_SEED + run;
+
+    unsigned long long random = schedule.seed;
+    set<int> points;
+    while ((int)points.size() < changePoints)
+      points.insert(candidates[next_random(random) % candidates.size()]);
+    for (set<int>::iterator point = points.begin(); point != points.end(); ++point) {
+      Preemption preemption = { *point, PCT_CHANGE_POINT };
+      schedule.preemptions.push_back(preemption);
+    }
+    queue.push_back(schedule);
+  }
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  int ran = run_schedules(queue, pct_finished);
+  int explored = resumed + ran;
+
+  double seconds = elapsed_seconds(start);
+  fprintf(stderr, "Explored %d PCT schedules of depth %d in %.3f s (%.1f schedules/s)\n\n", explored, PCT_DEPTH, seconds, ran / seconds);
+
+  // Workers finish out of order
+  sort(CRASHED_SCHEDULES.begin(), CRASHED_SCHEDULES.end(), earlier_schedule);
+
+  print_bounded_crash_report();
+  print_output_report();
+  write_results_file(explored, seconds);
+  write_profile();
+}
+
+void pct_finished(ExecutionResult &result, const char *, deque<Schedule> &)
+{
+  Schedule &schedule = result.schedule;
+  if (result.status != 0) {
+    fprintf(stderr, "!!!!!!!!!! Program crashed with PCT run %d%s (seed: %llu, change points: %s, replay: %s) !!!!!!!!!!\n\n", schedule.id, failure_note(result).c_str(), schedule.seed, format_preemptions(schedule.preemptions).c_str(), replay_file_name(schedule.id).c_str());
+    CRASHED_SCHEDULES.push_back(result);
+  } else {
+    fprintf(stderr, "========== Execution complete ==========\n\n");
+  }
+}
+
+// splitmix64, the same seed always gives the same schedules
+unsigned long long next_random(unsigned long long &state)
+{
+  unsigned long long x = (state += 0x9E3779B97F4A7C15ULL);
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+  return x ^ (x >> 31);
+}
+
+bool earlier_schedule(const ExecutionResult &a, const ExecutionResult &b)
+{
+  return a.schedule.id < b.schedule.id;
+}
+
+// "ok", "crash", "deadlock" (chess.so found every thread waiting), "timeout" or
+// "pruned" (chess.so stopped it in a state the state cache holds)
+const char* outcome(ExecutionResult &result)
+{
+  if (result.status == 0)
+    return "ok";
+  if (pruned(result))
+    return "pruned";
+  if (result.timedOut || exit_signal(result.status) == SIGXCPU)
+    return "timeout";
+  if (result.deadlocked && exit_code(result.status) == DEADLOCK_EXIT_STATUS)
+    return "deadlock";
+  return "crash";
+}
+
+bool pruned(ExecutionResult &result)
+{
+  return STATE_CACHE_FILE_NAME && exit_code(result.status) == PRUNED_EXIT_STATUS && !result.timedOut;
+}
+
+// Crashed, deadlocked or timed out
+bool failed(ExecutionResult &result)
+{
+  return result.status != 0 && !pruned(result);
+}
+
+// Distinct states the executions reached against the executions spent on them
+void print_state_coverage(int explored)
+{
+  if (!STATE_CACHE_FILE_NAME)
+    return;
+
+  long long states = cached_states();
+  fprintf(stderr, "State coverage: %lld distinct states (%lld new) in %d executions, %d executions pruned in explored states\n",
+    states, states - STATES_BEFORE, explored, PRUNED_EXECUTIONS);
+  if (states * 4 >= STATE_CACHE_CAPACITY * 3LL)
+    fprintf(stderr, "The state cache %s is full, delete it to start over\n", STATE_CACHE_FILE_NAME);
+}
+
+// How a failed execution ended, if it is not an ordinary crash
+string failure_note(ExecutionResult &result)
+{
+  string kind = outcome(result);
+  if (kind == "deadlock" || kind == "timeout")
+    return " (" + kind + ")";
+  return "";
+}
+
+// Print crash report
+void print_crash_report(vector<ExecutionResult> &crashes)
+{
+  fprintf(stderr, "========== Crash Report Begin ==========\n");
+
+  int earlier = report_cached_crashes(crashes);
+  if (crashes.empty() && earlier == 0) {
+    fprintf(stderr, "No crash occurred! You get a cookie.\n");
+    print_oreo_cookie();
+  }
+
+  for (size_t i = 0; i < crashes.size(); i++) {
+    int id = crashes[i].schedule.id;
+    fprintf(stderr, "Crash occurred at synchronization point %d/%d%s, replay with: ./chesstool --replay %s %s\n", id, TOTAL_SYNC_PTS, failure_note(crashes[i]).c_str(), replay_file_name(id).c_str(), TEST_PROGRAM);
+  }
+
+  fprintf(stderr, "========== Crash Report End ==========\n");
+}
+
+// Print crash report of bounded exploration
+void print_bounded_crash_report()
+{
+  fprintf(stderr, "========== Crash Report Begin ==========\n");
+
+  int earlier = report_cached_crashes(CRASHED_SCHEDULES);
+  if (CRASHED_SCHEDULES.empty() && earlier == 0) {
+    fprintf(stderr, "No crash occurred! You get a cookie.\n");
+    print_oreo_cookie();
+  }
+
+  for (size_t i = 0; i < CRASHED_SCHEDULES.size(); i++) {
+    Schedule &schedule = CRASHED_SCHEDULES[i].schedule;
+    if (PCT_RUNS > 0) {
+      fprintf(stderr, "Crash occurred in PCT run %d (seed: %llu, change points: %s)%s, replay with: ./chesstool --replay %s %s\n", schedule.id, schedule.seed, format_preemptions(schedule.preemptions).c_str(), failure_note(CRASHED_SCHEDULES[i]).c_str(), replay_file_name(schedule.id).c_str(), TEST_PROGRAM);
+      continue;
+    }
+    fprintf(stderr, "Crash occurred with %d preemption(s): %s%s, replay with: ./chesstool --replay %s %s\n", (int)schedule.preemptions.size(), format_preemptions(schedule.preemptions).c_str(), failure_note(CRASHED_SCHEDULES[i]).c_str(), replay_file_name(schedule.id).c_str(), TEST_PROGRAM);
+  }
+
+  fprintf(stderr, "========== Crash Report End ==========\n");
+}
+
+// FNV-1a, over 8 bytes at a time as far as they go
+unsigned long long hash_bytes(const char *data, size_t size, unsigned long long hash)
+{
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    unsigned long long word;
+    memcpy(&word, data + i, sizeof(word));
+    hash = (hash ^ word) * 1099511628211ULL;
+  }
+  for (; i < size; i++)
+    hash = (hash ^ (unsigned char)data[i]) * 1099511628211ULL;
+  return hash;
+}
+
+// Everything written to a captured output file, from its start
+string read_output(int fd)
+{
+  string output;
+  char buffer[65536];
+  off_t offset = 0;
+  ssize_t count;
+  while (fd >= 0 && (count = pread(fd, buffer, sizeof(buffer), offset)) > 0) {
+    output.append(buffer, count);
+    offset += count;
+  }
+  return output;
+}
+
+// Where the first execution printing an output keeps it, "<program>.<schedule>.out"
+string output_file_name(int id)
+{
+  const char *program = strrchr(TEST_PROGRAM, '/');
+  stringstream name;
+  name << (program ? program + 1 : TEST_PROGRAM) << "." << id << ".out";
+  return name.str();
+}
+
+// Group an execution by the hash of its output. The first execution printing an output keeps
+// it, and the first one ending normally with it its replay. With --expect, every
+// execution ending normally with another output is reported and keeps its replay.
+void check_output(ExecutionResult &result, const string &output, const char *recordFileName)
+{
+  int id = result.schedule.id;
+  OutputGroup &group = OUTPUT_GROUPS[result.outputHash];
+  if (group.executions++ == 0) {
+    group.first = id;
+    ofstream outfile(output_file_name(id).c_str(), ios_base::binary | ios_base::trunc);
+    outfile.write(output.data(), output.size());
+    outfile.close();
+  }
+
+  // Failed and pruned executions stopped before printing everything
+  if (result.status != 0)
+    return;
+
+  bool wrong = EXPECTED_FILE_NAME && result.outputHash != EXPECTED_HASH;
+  if (group.schedules.empty() || wrong)
+    save_replay_file(recordFileName, id);
+  group.schedules.push_back(id);
+
+  if (wrong)
+    fprintf(stderr, "!!!!!!!!!! Output of schedule %d differs from %s (output: %s, replay: %s) !!!!!!!!!!\n", id, EXPECTED_FILE_NAME, output_file_name(group.first).c_str(), replay_file_name(id).c_str());
+}
+
+// Executions that ended normally but printed something other than the expected
+// output, or without --expect than the output most of them printed
+void print_output_report()
+{
+  if (!CAPTURE)
+    return;
+
+  unsigned long long expected = EXPECTED_HASH;
+  if (!EXPECTED_FILE_NAME) {
+    size_t most = 0;
+    for (map<unsigned long long, OutputGroup>::iterator it = OUTPUT_GROUPS.begin(); it != OUTPUT_GROUPS.end(); ++it) {
+      if (it->second.schedules.size() > most) {
+        most = it->second.schedules.size();
+        expected = it->first;
+      }
+    }
+  }
+
+  fprintf(stderr, "\n========== Output Report Begin ==========\n");
+  int distinct = 0;
+  for (map<unsigned long long, OutputGroup>::iterator it = OUTPUT_GROUPS.begin(); it != OUTPUT_GROUPS.end(); ++it)
+    if (!it->second.schedules.empty())
+      distinct++;
+  fprintf(stderr, "%d distinct outputs of executions that ended normally, expected: %s\n", distinct, EXPECTED_FILE_NAME ? EXPECTED_FILE_NAME : OUTPUT_GROUPS.count(expected) ? output_file_name(OUTPUT_GROUPS[expected].first).c_str() : "none");
+
+  // In the order the outputs first appeared
+  vector<pair<int, unsigned long long> > order;
+  for (map<unsigned long long, OutputGroup>::iterator it = OUTPUT_GROUPS.begin(); it != OUTPUT_GROUPS.end(); ++it)
+    order.push_back(make_pair(it->second.first, it->first));
+  sort(order.begin(), order.end());
+
+  int wrong = 0;
+  for (size_t i = 0; i < order.size(); i++) {
+    OutputGroup &group = OUTPUT_GROUPS[order[i].second];
+    if (order[i].second == expected) {
+      // Nothing to look at in the replay of an execution that did everything right
+      if (!group.schedules.empty())
+        remove(replay_file_name(group.schedules[0]).c_str());
+      continue;
+    }
+    if (group.schedules.empty())
+      continue;
+
+    // Workers finish out of order
+    sort(group.schedules.begin() + 1, group.schedules.end());
+    stringstream schedules;
+    for (size_t i = 0; i < group.schedules.size() && i < 10; i++)
+      schedules << (i > 0 ? " " : "") << group.schedules[i];
+    if (group.schedules.size() > 10)
+      schedules << " ...";
+    fprintf(stderr, "Wrong output (%s) in %d execution(s), schedules %s, replay with: ./chesstool --replay %s %s\n", output_file_name(group.first).c_str(), (int)group.schedules.size(), schedules.str().c_str(), replay_file_name(group.schedules[0]).c_str(), TEST_PROGRAM);
+    wrong += group.schedules.size();
+  }
+
+  if (wrong == 0)
+    fprintf(stderr, "Every execution that ended normally printed the expected output.\n");
+  fprintf(stderr, "========== Output Report End ==========\n");
+}
+
+// Exit code of a wait status, the shell of run.sh reports a signal as 128 + signal
+int exit_code(int status)
+{
+  if (WIFEXITED(status) && WEXITSTATUS(status) <= 128)
+    return WEXITSTATUS(status);
+  return -1;
+}
+
+int exit_signal(int status)
+{
+  if (WIFSIGNALED(status))
+    return WTERMSIG(status);
+  if (WIFEXITED(status) && WEXITSTATUS(status) > 128)
+    return WEXITSTATUS(status) - 128;
+  return 0;
+}
+
+// The contents of a JSON string literal for text
+string json_escape(const char* text)
+{
+  string escaped;
+  for (const char* c = text; *c; c++) {
+    if (*c == '"' || *c == '\\') {
+      escaped += '\\';
+      escaped += *c;
+    } else if ((unsigned char)*c < 0x20) {
+      char code[8];
+      snprintf(code, sizeof(code), "\\u%04x", *c);
+      escaped += code;
+    } else {
+      escaped += *c;
+    }
+  }
+  return escaped;
+}
+
+// Write one row per execution and the totals to RESULTS_FILE_NAME, as CSV if the
+// name ends in .csv and as JSON otherwise. The first execution is not included.
+// Preemptions are separated by commas, so the CSV column is quoted.
+void write_results_file(int explored, double seconds)
+{
+  if (!RESULTS_FILE_NAME)
+    return;
+
+  string name = RESULTS_FILE_NAME;
+  bool csv = name.size() >= 4 && name.compare(name.size() - 4, 4, ".csv") == 0;
+  int crashes = 0;
+  for (size_t i = 0; i < RESULTS.size(); i++)
+    if (failed(RESULTS[i]))
+      crashes++;
+  long long states = STATE_CACHE_FILE_NAME ? cached_states() : -1;
+  long long newStates = STATE_CACHE_FILE_NAME ? states - STATES_BEFORE : -1;
+  int pctDepth = PCT_RUNS > 0 ? PCT_DEPTH : -1;
+
+  FILE *file = fopen(RESULTS_FILE_NAME, "w");
+  if (!file) {
+    fprintf(stderr, "Error: Cannot write results to %s\n", RESULTS_FILE_NAME);
+    return;
+  }
+
+  if (csv) {
+    fprintf(file, "# program=%s jobs=%d fork_server=%d preemption_bound=%d pct_depth=%d schedules=%d crashes=%d pruned=%d states=%lld new_states=%lld wall_seconds=%.6f schedules_per_second=%.3f\n",
+      TEST_PROGRAM, JOBS, FORK_SERVER, PREEMPTION_BOUND, pctDepth, explored, crashes, PRUNED_EXECUTIONS, states, newStates, seconds, explored / seconds);
+    fprintf(file, "schedule,preemptions,seed,outcome,exit_code,signal,wall_seconds,user_seconds,sys_seconds,max_rss_kb,sync_pts\n");
+  } else {
+    fprintf(file, "{\n  \"program\": \"%s\",\n  \"jobs\": %d,\n  \"fork_server\": %s,\n  \"preemption_bound\": %d,\n  \"pct_depth\": %d,\n", json_escape(TEST_PROGRAM).c_str(), JOBS, FORK_SERVER ? "true" : "false", PREEMPTION_BOUND, pctDepth);
+    fprintf(file, "  \"schedules\": %d,\n  \"crashes\": %d,\n  \"pruned\": %d,\n  \"states\": %lld,\n  \"new_states\": %lld,\n", explored, crashes, PRUNED_EXECUTIONS, states, newStates);
+    fprintf(file, "  \"wall_seconds\": %.6f,\n  \"schedules_per_second\": %.3f,\n  \"executions\": [", seconds, explored / seconds);
+  }
+
+  for (size_t i = 0; i < RESULTS.size(); i++) {
+    ExecutionResult &result = RESULTS[i];
+    string preemptions = format_preemptions(result.schedule.preemptions);
+    if (csv)
+      fprintf(file, "%d,\"%s\",%llu,%s,%d,%d,%.6f,%.6f,%.6f,%ld,%d\n", result.schedule.id, preemptions.c_str(), result.schedule.seed, outcome(result), exit_code(result.status), exit_signal(result.status),
+        result.wallSeconds, result.userSeconds, result.sysSeconds, result.maxRssKb, result.syncPts);
+    else
+      fprintf(file, "%s\n    {\"schedule\": %d, \"preemptions\": \"%s\", \"seed\": %llu, \"outcome\": \"%s\", \"exit_code\": %d, \"signal\": %d, \"wall_seconds\": %.6f, \"user_seconds\": %.6f, \"sys_seconds\": %.6f, \"max_rss_kb\": %ld, \"sync_pts\": %d}",
+        i > 0 ? "," : "", result.schedule.id, preemptions.c_str(), result.schedule.seed, outcome(result), exit_code(result.status), exit_signal(result.status),
+        result.wallSeconds, result.userSeconds, result.sysSeconds, result.maxRssKb, result.syncPts);
+  }
+
+  if (!csv)
+    fprintf(file, "\n  ]\n}\n");
+  fclose(file);
+}
+
+// Delta debugging of a failing schedule, given as a replay file or as preemptions.
+// Every batch of candidates runs in parallel on the same workers (and fork servers),
+// and the first candidate of a batch that fails like the original becomes the new
+// minimum. A round drops preemptions (ddmin over ever smaller chunks), then moves
+// each preemption to the earliest synchronization point where the schedule still
+// fails, then retargets preemptions to threads other preemptions already switch to.
+// Rounds repeat until one changes nothing.
+void minimize_schedule()
+{
+  vector<Decision> decisions;
+  if (read_decisions(MINIMIZE_SCHEDULE, decisions)) {
+    MINIMIZE_ORIGINAL = replay_preemptions(decisions);
+  } else if (!parse_preemptions(MINIMIZE_SCHEDULE, MINIMIZE_ORIGINAL)) {
+    fprintf(stderr, "Error: %s is neither a replay file nor preemptions like 14:1,20:0\n", MINIMIZE_SCHEDULE);
+    exit(0);
+  }
+  fprintf(stderr, "========== Minimizing schedule with %d preemption(s): %s ==========\n\n", (int)MINIMIZE_ORIGINAL.size(), format_preemptions(MINIMIZE_ORIGINAL).c_str());
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  // The original runs first, the candidates must fail the same way
+  MINIMUM.schedule.id = 0;
+  deque<Schedule> queue;
+  Schedule original;
+  original.id = NEXT_SCHEDULE_ID++;
+  original.seed = 0;
+  original.preemptions = MINIMIZE_ORIGINAL;
+  MINIMIZE_TRIED.insert(format_preemptions(original.preemptions));
+  MINIMIZE_PENDING = 1;
+  queue.push_back(original);
+
+  run_schedules(queue, minimize_finished);
+  print_minimized_schedule(elapsed_seconds(start));
+}
+
+// Fails the way the original failed: the same exit status or signal, or also a timeout
+bool same_failure(ExecutionResult &result, ExecutionResult &original)
+{
+  if (!failed(result) || strcmp(outcome(result), outcome(original)) != 0)
+    return false;
+  return strcmp(outcome(result), "timeout") == 0 || result.status == original.status;
+}
+
+void minimize_finished(ExecutionResult &result, const char *, deque<Schedule> &queue)
+{
+  Schedule &schedule = result.schedule;
+  bool fails = MINIMIZE_PHASE == MINIMIZE_VERIFY ? failed(result) : same_failure(result, MINIMUM);
+  if (failed(result))
+    MINIMIZE_REPLAYS.push_back(schedule.id);
+  fprintf(stderr, "========== Candidate %d %s%s ==========\n\n", schedule.id, fails ? "fails" : "passes", failed(result) && !fails ? " (differently)" : "");
+
+  // Workers finish out of order, the earliest candidate of the batch wins
+  if (fails && (!MINIMIZE_FOUND || schedule.id < MINIMIZE_BEST.schedule.id)) {
+    MINIMIZE_FOUND = true;
+    MINIMIZE_BEST = result;
+  }
+  if (--MINIMIZE_PENDING > 0)
+    return;
+
+  bool found = MINIMIZE_FOUND;
+  if (found) {
+    MINIMUM = MINIMIZE_BEST;
+    if (MINIMIZE_PHASE != MINIMIZE_VERIFY)
+      MINIMIZE_CHANGED = true;
+  }
+  MINIMIZE_FOUND = false;
+  advance_minimize(found);
+
+  while (MINIMIZE_PHASE != MINIMIZE_DONE) {
+    vector<vector<Preemption> > candidates = minimize_candidates();
+    for (size_t i = 0; i < candidates.size(); i++) {
+      Schedule next;
+      next.id = NEXT_SCHEDULE_ID++;
+      next.seed = 0;
+      next.preemptions = candidates[i];
+      queue.push_back(next);
+    }
+    MINIMIZE_PENDING = candidates.size();
+    if (MINIMIZE_PENDING > 0)
+      return;
+    advance_minimize(false);
+  }
+}
+
+// Next phase or granularity after a batch, found if a candidate failed
+void advance_minimize(bool found)
+{
+  size_t size = MINIMUM.schedule.preemptions.size();
+  switch (MINIMIZE_PHASE) {
+    case MINIMIZE_VERIFY:
+      MINIMIZE_PHASE = found ? MINIMIZE_DROP : MINIMIZE_DONE;
+      MINIMIZE_GRANULARITY = 2;
+      break;
+    case MINIMIZE_DROP:
+      // ddmin: a smaller schedule keeps splitting at about the same granularity,
+      // otherwise split finer until single preemptions were dropped
+      if (found) {
+        MINIMIZE_GRANULARITY = max(MINIMIZE_GRANULARITY - 1, (size_t)2);
+      } else if (MINIMIZE_GRANULARITY < size) {
+        MINIMIZE_GRANULARITY = min(2 * MINIMIZE_GRANULARITY, size);
+      } else {
+        MINIMIZE_PHASE = MINIMIZE_EARLIER;
+        MINIMIZE_INDEX = 0;
+      }
+      break;
+    case MINIMIZE_EARLIER:
+      if (++MINIMIZE_INDEX >= size)
+        MINIMIZE_PHASE = MINIMIZE_THREADS;
+      break;
+    case MINIMIZE_THREADS:
+      if (found)
+        break;
+      MINIMIZE_PHASE = MINIMIZE_CHANGED ? MINIMIZE_DROP : MINIMIZE_DONE;
+      MINIMIZE_CHANGED = false;
+      MINIMIZE_GRANULARITY = 2;
+      break;
+  }
+}
+
+// Candidates of the current phase that did not run before, in the order they are preferred
+vector<vector<Preemption> > minimize_candidates()
+{
+  vector<Preemption> &current = MINIMUM.schedule.preemptions;
+  vector<vector<Preemption> > candidates;
+
+  if (MINIMIZE_PHASE == MINIMIZE_DROP && !current.empty()) {
+    // Every chunk alone, then the schedule without each chunk
+    size_t chunks = min(MINIMIZE_GRANULARITY, current.size());
+    for (int complement = 0; complement < 2; complement++) {
+      for (size_t c = 0; c < chunks; c++) {
+        size_t first = c * current.size() / chunks, last = (c + 1) * current.size() / chunks;
+        vector<Preemption> candidate;
+        for (size_t i = 0; i < current.size(); i++)
+          if ((i >= first && i < last) != (complement == 1))
+            candidate.push_back(current[i]);
+        candidates.push_back(candidate);
+      }
+    }
+  } else if (MINIMIZE_PHASE == MINIMIZE_EARLIER && MINIMIZE_INDEX < current.size()) {
+    // Every synchronization point after the previous preemption, earliest first
+    int first = MINIMIZE_INDEX > 0 ? current[MINIMIZE_INDEX - 1].syncPt + 1 : 1;
+    for (int point = first; point < current[MINIMIZE_INDEX].syncPt; point++) {
+      vector<Preemption> candidate = current;
+      candidate[MINIMIZE_INDEX].syncPt = point;
+      candidates.push_back(candidate);
+    }
+  } else if (MINIMIZE_PHASE == MINIMIZE_THREADS) {
+    // A preemption to a thread no other preemption switches to, switching to one of those instead
+    set<int> threads;
+    for (size_t i = 0; i < current.size(); i++)
+      threads.insert(current[i].thread);
+    for (size_t i = 0; i < current.size(); i++) {
+      int uses = 0;
+      for (size_t j = 0; j < current.size(); j++)
+        uses += current[j].thread == current[i].thread;
+      if (uses > 1)
+        continue;
+      for (set<int>::iterator thread = threads.begin(); thread != threads.end(); ++thread) {
+        if (*thread == current[i].thread)
+          continue;
+        vector<Preemption> candidate = current;
+        candidate[i].thread = *thread;
+        candidates.push_back(candidate);
+      }
+    }
+  }
+
+  vector<vector<Preemption> > untried;
+  for (size_t i = 0; i < candidates.size(); i++)
+    if (MINIMIZE_TRIED.insert(format_preemptions(candidates[i])).second)
+      untried.push_back(candidates[i]);
+  return untried;
+}
+
+// Keep the replay of the minimum as <program>.min.replay, drop those of the other candidates
+void print_minimized_schedule(double seconds)
+{
+  int tried = NEXT_SCHEDULE_ID - 1;
+  fprintf(stderr, "========== Minimization Report Begin ==========\n");
+  if (MINIMUM.schedule.id == 0) {
+    fprintf(stderr, "The schedule %s did not fail when run again, nothing to minimize.\n", format_preemptions(MINIMIZE_ORIGINAL).c_str());
+  } else {
+    const char *program = strrchr(TEST_PROGRAM, '/');
+    string replayFileName = string(program ? program + 1 : TEST_PROGRAM) + ".min.replay";
+    rename(replay_file_name(MINIMUM.schedule.id).c_str(), replayFileName.c_str());
+
+    set<int> threads;
+    for (size_t i = 0; i < MINIMUM.schedule.preemptions.size(); i++)
+      threads.insert(MINIMUM.schedule.preemptions[i].thread);
+    fprintf(stderr, "Original: %d preemption(s): %s\n", (int)MINIMIZE_ORIGINAL.size(), format_preemptions(MINIMIZE_ORIGINAL).c_str());
+    fprintf(stderr, "Minimized: %d preemption(s) to %d thread(s): %s (%s)\n", (int)MINIMUM.schedule.preemptions.size(), (int)threads.size(),
+      MINIMUM.schedule.preemptions.empty() ? "none" : format_preemptions(MINIMUM.schedule.preemptions).c_str(), outcome(MINIMUM));
+    fprintf(stderr, "Replay with: ./chesstool --replay %s %s\n", replayFileName.c_str(), TEST_PROGRAM);
+  }
+  fprintf(stderr, "Ran %d candidate schedules in %.3f s\n", tried, seconds);
+  fprintf(stderr, "========== Minimization Report End ==========\n");
+
+  for (size_t i = 0; i < MINIMIZE_REPLAYS.size(); i++)
+    remove(replay_file_name(MINIMIZE_REPLAYS[i]).c_str());
+}
+
+// Add the profile chess.so wrote for an execution, and count the schedule of the
+// execution for the call site of its first preemption. An execution killed by a
+// signal writes no profile.
+void read_profile(const char *profileFileName, ExecutionResult *result)
+{
+  ifstream infile(profileFileName);
+  string line;
+  while (getline(infile, line)) {
+    stringstream fields(line);
+    string tag, module, offset;
+    fields >> tag;
+
+    if (tag == "site") {
+      SiteProfile site;
+      if (!(fields >> module >> offset >> site.kind >> site.syncPts >> site.objects >> site.contended))
+        continue;
+      SiteProfile &profile = SITE_PROFILES[module + " " + offset];
+      if (profile.module.empty()) {
+        profile = site;
+        profile.module = module;
+        profile.offset = offset;
+        profile.syncPts = profile.objects = profile.contended = 0;
+        profile.schedules = 0;
+        profile.seconds = 0;
+      }
+      profile.syncPts += site.syncPts;
+      profile.objects = max(profile.objects, site.objects);
+      profile.contended += site.contended;
+    } else if (tag == "point") {
+      int point;
+      if (fields >> point >> module >> offset && point == (int)POINT_SITES.size() + 1)
+        POINT_SITES.push_back(module + " " + offset);
+    }
+  }
+  infile.close();
+  remove(profileFileName);
+
+  if (!result || result->schedule.preemptions.empty())
+    return;
+  int point = result->schedule.preemptions[0].syncPt;
+  if (point < 1 || point > (int)POINT_SITES.size() || !SITE_PROFILES.count(POINT_SITES[point - 1]))
+    return;
+  SiteProfile &profile = SITE_PROFILES[POINT_SITES[point - 1]];
+  profile.schedules++;
+  profile.seconds += result->wallSeconds;
+}
+
+bool more_sync_pts(const SiteProfile &a, const SiteProfile &b)
+{
+  return a.syncPts > b.syncPts;
+}
+
+const char* sync_pt_kind_name(char kind)
+{
+  switch (kind) {
+    case 'S': return "thread_start";
+    case 'L': return "mutex_lock";
+    case 'U': return "mutex_unlock";
+    case 'T': return "sleep";
+    case 'W': return "cond_wait";
+    case 'N': return "cond_signal";
+    case 'R': return "rwlock_lock";
+    case 'Q': return "rwlock_unlock";
+    case 'P': return "sem_wait";
+    case 'V': return "sem_post";
+    case 'B': return "barrier";
+  }
+  return "unknown";
+}
+
+// "file:line (function)" of every call site, asking addr2line once per module.
+// Without debug information the location stays "module+offset (function)".
+map<string, string> resolve_locations(vector<SiteProfile> &sites)
+{
+  map<string, vector<SiteProfile*> > modules;
+  for (size_t i = 0; i < sites.size(); i++)
+    modules[sites[i].module].push_back(&sites[i]);
+
+  map<string, string> locations;
+  for (map<string, vector<SiteProfile*> >::iterator module = modules.begin(); module != modules.end(); ++module) {
+    string command = "addr2line -f -e '" + module->first + "'";
+    for (size_t i = 0; i < module->second.size(); i++)
+      command += " " + module->second[i]->offset;
+
+    FILE *output = module->first == "?" ? NULL : popen((command + " 2>/dev/null").c_str(), "r");
+    for (size_t i = 0; i < module->second.size(); i++) {
+      SiteProfile &site = *module->second[i];
+      const char *name = strrchr(site.module.c_str(), '/');
+      string location = string(name ? name + 1 : site.module.c_str()) + "+" + site.offset;
+
+      char function[1024], line[1024];
+      if (output && fgets(function, sizeof(function), output) && fgets(line, sizeof(line), output)) {
+        function[strcspn(function, "\n")] = 0;
+        line[strcspn(line, "\n")] = 0;
+        if (strncmp(line, "??", 2) != 0)
+          location = line;
+        if (strcmp(function, "??") != 0)
+          location += string(" (") + function + ")";
+      }
+      locations[site.module + " " + site.offset] = location;
+    }
+    if (output)
+      pclose(output);
+  }
+  return locations;
+}
+
+// Write every call site to PROFILE_FILE_NAME as tab separated values, the sites with
+// the most synchronization points first, and print the top ones
+void write_profile()
+{
+  if (!PROFILE_FILE_NAME)
+    return;
+
+  vector<SiteProfile> sites;
+  for (map<string, SiteProfile>::iterator site = SITE_PROFILES.begin(); site != SITE_PROFILES.end(); ++site)
+    sites.push_back(site->second);
+  sort(sites.begin(), sites.end(), more_sync_pts);
+  map<string, string> locations = resolve_locations(sites);
+
+  FILE *file = fopen(PROFILE_FILE_NAME, "w");
+  if (!file) {
+    fprintf(stderr, "Error: Cannot write the profile to %s\n", PROFILE_FILE_NAME);
+    return;
+  }
+
+  fprintf(stderr, "========== Call Site Profile (%s) ==========\n", PROFILE_FILE_NAME);
+  fprintf(stderr, "%10s %8s %10s %10s %10s  %-13s %s\n", "sync_pts", "objects", "contended", "schedules", "seconds", "kind", "location");
+  fprintf(file, "sync_pts\tobjects\tcontended\tschedules\tseconds\tkind\tlocation\n");
+  for (size_t i = 0; i < sites.size(); i++) {
+    SiteProfile &site = sites[i];
+    string &location = locations[site.module + " " + site.offset];
+    fprintf(file, "%ld\t%ld\t%ld\t%d\t%.6f\t%s\t%s\n", site.syncPts, site.objects, site.contended, site.schedules, site.seconds, sync_pt_kind_name(site.kind), location.c_str());
+    if (i < 10)
+      fprintf(stderr, "%10ld %8ld %10ld %10d %10.3f  %-13s %s\n", site.syncPts, site.objects, site.contended, site.schedules, site.seconds, sync_pt_kind_name(site.kind), location.c_str());
+  }
+  fprintf(stderr, "========== Call Site Profile End ==========\n");
+  fclose(file);
+}
+
+// One filter spec per line, blank lines and lines starting with # are skipped
+void read_filter_file(const char *fileName)
+{
+  ifstream infile(fileName);
+  if (!infile) {
+    fprintf(stderr, "Error: Cannot read the filter %s\n", fileName);
+    exit(0);
+  }
+  string line;
+  while (getline(infile, line)) {
+    size_t start = line.find_first_not_of(" \t");
+    if (start != string::npos && line[start] != '#')
+      FILTER_SPECS.push_back(line.substr(start));
+  }
+}
+
+vector<string> command_output(string command)
+{
+  vector<string> lines;
+  FILE *output = popen((command + " 2>/dev/null").c_str(), "r");
+  if (!output)
+    return lines;
+  char line[4096];
+  while (fgets(line, sizeof(line), output)) {
+    line[strcspn(line, "\n")] = 0;
+    lines.push_back(line);
+  }
+  pclose(output);
+  return lines;
+}
+
+bool parse_address(string str, unsigned long long &address)
+{
+  char *end;
+  address = strtoull(str.c_str(), &end, 16);
+  return !str.empty() && *end == 0;
+}
+
+// Resolve every filter spec to what chess.so matches, link time addresses of the
+// program (see read_preemption_filter in chess.cpp):
+//   "mutex <symbol>" or "mutex <address>"    a mutex or other synchronization object ("object" too)
+//   "function <symbol>"                      calls from the function
+//   "file <source>[:<line>[-<line>]]"        calls from the lines of a source file (needs -g)
+//   "site <address>[-<address>]"             calls from code addresses, as in the profile
+// A colon may stand for the space, as in --only mutex:Q_mutex.
+void resolve_filter()
+{
+  const char *slash = strrchr(TEST_PROGRAM, '/');
+  string module = slash ? slash + 1 : TEST_PROGRAM;
+
+  // Symbol -> address and size, from the symbol table
+  map<string, pair<unsigned long long, unsigned long long> > symbols;
+  vector<string> nm = command_output(string("nm -S --defined-only '") + TEST_PROGRAM + "'");
+  for (size_t i = 0; i < nm.size(); i++) {
+    stringstream fields(nm[i]);
+    string address, size, type, name;
+    unsigned long long a, n;
+    if (fields >> address >> size >> type >> name && parse_address(address, a) && parse_address(size, n))
+      symbols[name] = make_pair(a, n);
+  }
+  vector<string> lineTable;
+
+  stringstream filter;
+  for (size_t i = 0; i < FILTER_SPECS.size(); i++) {
+    string spec = FILTER_SPECS[i];
+    size_t separator = spec.find_first_of(" :");
+    string kind = spec.substr(0, separator);
+    string arg = separator == string::npos ? "" : spec.substr(spec.find_first_not_of(" :", separator) == string::npos ? spec.size() : spec.find_first_not_of(" :", separator));
+    arg = arg.substr(0, arg.find_last_not_of(" \t") + 1);
+    unsigned long long first, last;
+    bool resolved = false;
+
+    if (kind == "mutex" || kind == "object") {
+      if (symbols.count(arg)) {
+        filter << "object " << module << " " << hex << symbols[arg].first << dec << "\n";
+        resolved = true;
+      } else if (arg.compare(0, 2, "0x") == 0 && parse_address(arg.substr(2), first)) {
+        filter << "object - " << hex << first << dec << "\n";
+        resolved = true;
+      }
+    } else if (kind == "function") {
+      if (symbols.count(arg) && symbols[arg].second > 0) {
+        filter << "site " << module << " " << hex << symbols[arg].first << " " << symbols[arg].first + symbols[arg].second << dec << "\n";
+        resolved = true;
+      }
+    } else if (kind == "site") {
+      size_t dash = arg.find('-');
+      string from = arg.substr(0, dash), to = dash == string::npos ? "" : arg.substr(dash + 1);
+      if (from.compare(0, 2, "0x") == 0 && parse_address(from.substr(2), first)) {
+        last = first + 1;
+        if (to.empty() || (to.compare(0, 2, "0x") == 0 && parse_address(to.substr(2), last))) {
+          filter << "site " << module << " " << hex << first << " " << max(last, first + 1) << dec << "\n";
+          resolved = true;
+        }
+      }
+    } else if (kind == "file") {
+      // The line table gives the address where the code of each line starts, up to the next row
+      if (lineTable.empty())
+        lineTable = command_output(string("objdump --dwarf=decodedline '") + TEST_PROGRAM + "'");
+      size_t colon = arg.find(':');
+      string file = arg.substr(0, colon);
+      int firstLine = 1, lastLine = INT_MAX;
+      if (colon != string::npos && sscanf(arg.c_str() + colon + 1, "%d-%d", &firstLine, &lastLine) == 1)
+        lastLine = firstLine;
+      const char *base = strrchr(file.c_str(), '/');
+      file = base ? base + 1 : file;
+
+      bool previous = false, matched = false;
+      unsigned long long start = 0, previousAddress = 0;
+      for (size_t row = 0; row < lineTable.size(); row++) {
+        stringstream fields(lineTable[row]);
+        string name, line, address;
+        unsigned long long a;
+        if (!(fields >> name >> line >> address) || address.compare(0, 2, "0x") != 0 || !parse_address(address.substr(2), a) || (line != "-" && !isdigit(line[0])))
+          continue;
+        // The row before ends here
+        if (previous && matched && a != previousAddress) {
+          filter << "site " << module << " " << hex << start << " " << a << dec << "\n";
+          resolved = true;
+        }
+        base = strrchr(name.c_str(), '/');
+        int number = atoi(line.c_str());
+        matched = line != "-" && (base ? base + 1 : name) == file && number >= firstLine && number <= lastLine;
+        previous = line != "-";
+        start = previousAddress = a;
+      }
+    }
+
+    if (!resolved) {
+      fprintf(stderr, "Error: Cannot resolve the filter \"%s\" in %s\n", spec.c_str(), TEST_PROGRAM);
+      exit(0);
+    }
+  }
+
+  string resolved = filter.str();
+  ofstream outfile(FILTER_TRACE_NAME, ios_base::trunc);
+  outfile << resolved;
+  outfile.close();
+  setenv("CHESS_PREEMPTION_FILTER", FILTER_TRACE_NAME, 1);
+
+  unsigned long long digest = hash_bytes(resolved.data(), resolved.size(), 14695981039346656037ULL);
+  stringstream digestString;
+  digestString << "filter:" << hex << digest;
+  FILTER_DIGEST = digestString.str();
+}
+
+// A preemption can switch where the trace of the first execution has another
+// thread enabled, chess.so enables only the running thread where the filter
+// allows no preemption
+void read_preemptible_sync_pts(const char *traceFileName)
+{
+  vector<SyncPtTrace> trace = read_trace(traceFileName);
+  for (size_t i = 0; i < trace.size(); i++)
+    if (trace[i].enabled.size() > 1)
+      PREEMPTIBLE_SYNC_PTS.push_back(trace[i].syncPt);
+}
+
+// Everything that decides which schedules a run explores, the first line of the journal
+string journal_header()
+{
+  stringstream header;
+  header << "H " << JOURNAL_VERSION << " " << PREEMPTION_BOUND << " " << REDUCTION << " " << PCT_RUNS << " " << PCT_DEPTH << " " << PCT_SEED << " " << TEST_PROGRAM;
+  if (!FILTER_DIGEST.empty())
+    header << " " << FILTER_DIGEST;
+  return header.str();
+}
+
+// Start a new journal, or with --resume read the journal of the interrupted run with
+// the same parameters and append to it
+void open_journal()
+{
+  if (RESUME)
+    read_journal();
+
+  JOURNAL_FD = open(JOURNAL_FILE_NAME, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | (RESUME ? 0 : O_TRUNC), 0644);
+  if (JOURNAL_FD < 0) {
+    fprintf(stderr, "Error: Cannot write the journal %s\n", JOURNAL_FILE_NAME);
+    exit(0);
+  }
+  if (!RESUME)
+    append_journal(journal_header() + "\n");
+}
+
+// Lines after the header:
+//   "D <synchronization points>"                  census of the first execution
+//   "F <synchronization points>"                  where the filter allows preemptions, comma separated
+//   "Q <schedule> <preemptions>"                  schedule queued by bounded exploration
+//   "P <schedules>"                               schedules partial-order reduction pruned
+//   "X <schedule> <status> <timed out> <wall> <user> <sys> <max rss> <sync points> <seed> <preemptions>"
+//                                                 finished execution
+// Preemptions are "-" if there are none. A line cut short by a kill is skipped.
+void read_journal()
+{
+  ifstream infile(JOURNAL_FILE_NAME);
+  string line;
+  if (!getline(infile, line)) {
+    fprintf(stderr, "Error: No journal %s to resume\n", JOURNAL_FILE_NAME);
+    exit(0);
+  }
+
+  // A run of PCT without -S continues with the seed of the journal
+  stringstream header(line);
+  string tag;
+  int version, bound, reduction, runs, depth;
+  unsigned long long seed;
+  if (PCT_RUNS > 0 && PCT_SEED == 0 && header >> tag >> version >> bound >> reduction >> runs >> depth >> seed)
+    PCT_SEED = seed;
+  if (line != journal_header()) {
+    fprintf(stderr, "Error: The journal %s is of another run (%s), resume with the same options\n", JOURNAL_FILE_NAME, line.c_str());
+    exit(0);
+  }
+
+  while (getline(infile, line)) {
+    stringstream fields(line);
+    string preemptions;
+    fields >> tag;
+
+    if (tag == "D") {
+      fields >> JOURNAL_SYNC_PTS;
+    } else if (tag == "F") {
+      string points, point;
+      fields >> points;
+      stringstream list(points);
+      while (getline(list, point, ','))
+        if (point != "-")
+          PREEMPTIBLE_SYNC_PTS.push_back(atoi(point.c_str()));
+    } else if (tag == "Q") {
+      Schedule schedule;
+      schedule.seed = 0;
+      if (fields >> schedule.id >> preemptions && parse_preemptions(preemptions, schedule.preemptions))
+        JOURNAL_QUEUED.push_back(schedule);
+    } else if (tag == "P") {
+      int pruned;
+      if (fields >> pruned)
+        JOURNAL_PRUNED_SCHEDULES += pruned;
+    } else if (tag == "X") {
+      ExecutionResult result;
+      if (fields >> result.schedule.id >> result.status >> result.timedOut >> result.deadlocked >> result.wallSeconds >> result.userSeconds >> result.sysSeconds
+        >> result.maxRssKb >> result.syncPts >> result.schedule.seed >> preemptions && parse_preemptions(preemptions, result.schedule.preemptions)) {
+        JOURNAL_EXECUTIONS.push_back(result);
+        JOURNAL_FINISHED.insert(result.schedule.id);
+      }
+    }
+  }
+}
+
+// One write per entry, so a killed chesstool leaves whole lines
+void append_journal(string lines)
+{
+  if (JOURNAL_FD >= 0 && write(JOURNAL_FD, lines.data(), lines.size()) != (ssize_t)lines.size())
+    fprintf(stderr, "Error: Cannot write the journal %s\n", JOURNAL_FILE_NAME);
+}
+
+string journal_schedule(Schedule &schedule)
+{
+  return schedule.preemptions.empty() ? "-" : format_preemptions(schedule.preemptions);
+}
+
+// Read preemptions written by format_preemptions, or "-"
+bool parse_preemptions(string str, vector<Preemption> &preemptions)
+{
+  if (str == "-")
+    return true;
+  stringstream fields(str);
+  string field;
+  while (getline(fields, field, ',')) {
+    Preemption preemption;
+    if (sscanf(field.c_str(), "%d:%d", &preemption.syncPt, &preemption.thread) != 2)
+      return false;
+    preemptions.push_back(preemption);
+  }
+  return true;
+}
+
+// The synchronization points of the first execution, and the schedules queued from
+// position queued on
+void journal_census(deque<Schedule> &queue, size_t queued)
+{
+  stringstream lines;
+  lines << "D " << TOTAL_SYNC_PTS << "\n";
+  if (!FILTER_SPECS.empty()) {
+    lines << "F ";
+    for (size_t i = 0; i < PREEMPTIBLE_SYNC_PTS.size(); i++)
+      lines << (i ? "," : "") << PREEMPTIBLE_SYNC_PTS[i];
+    lines << (PREEMPTIBLE_SYNC_PTS.empty() ? "-\n" : "\n");
+  }
+  for (size_t i = queued; i < queue.size(); i++)
+    lines << "Q " << queue[i].id << " " << journal_schedule(queue[i]) << "\n";
+  if (PRUNED_SCHEDULES > 0)
+    lines << "P " << PRUNED_SCHEDULES << "\n";
+  append_journal(lines.str());
+}
+
+// A finished execution with the schedules it queued from position queued on, and
+// the schedules partial-order reduction pruned when extending it
+void journal_execution(ExecutionResult &result, deque<Schedule> &queue, size_t queued, int prunedSchedules)
+{
+  stringstream lines;
+  for (size_t i = queued; i < queue.size(); i++)
+    lines << "Q " << queue[i].id << " " << journal_schedule(queue[i]) << "\n";
+  if (prunedSchedules > 0)
+    lines << "P " << prunedSchedules << "\n";
+  lines << "X " << result.schedule.id << " " << result.status << " " << result.timedOut << " " << result.deadlocked << " " << result.wallSeconds << " " << result.userSeconds
+    << " " << result.sysSeconds << " " << result.maxRssKb << " " << result.syncPts << " " << result.schedule.seed << " " << journal_schedule(result.schedule) << "\n";
+  append_journal(lines.str());
+}
+
+// Count the executions of the journal as explored, with their crashes and results
+// Returns the number of executions
+int restore_executions(vector<ExecutionResult> &crashes)
+{
+  for (size_t i = 0; i < JOURNAL_EXECUTIONS.size(); i++) {
+    ExecutionResult &result = JOURNAL_EXECUTIONS[i];
+    if (RESULTS_FILE_NAME)
+      RESULTS.push_back(result);
+    if (pruned(result))
+      PRUNED_EXECUTIONS++;
+    else if (failed(result))
+      crashes.push_back(result);
+  }
+  return JOURNAL_EXECUTIONS.size();
 }
 
 // ASCII art - oreo cookie
@@ -0,0 +1,137 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include <iostream>
+#include <fstream>
+
+using namespace std;
+
+#define EVENT_FILE_MAGIC                        "CHESSEVT"
+#define EVENT_FILE_VERSION                      1
+
+// Event trace chess.so writes to CHESS_EVENT_TRACE, same layout as in chess.so
+struct EventFileHeader {
+  char magic[8];
+  int version;
+  int count;
+  long long dropped;
+  unsigned long long start;
+  double ticksPerUs;
+};
+
+struct TraceEvent {
+  unsigned long long timestamp;
+  unsigned long long object;
+  int syncPt;
+  short thread;
+  char kind;
+  char reserved;
+};
+
+bool read_events(const char*, EventFileHeader&, vector<TraceEvent>&);
+bool earlier(const TraceEvent&, const TraceEvent&);
+const char* event_name(char);
+void print_chrome_trace(EventFileHeader&, vector<TraceEvent>&);
+
+// Convert a binary event trace of chess.so to Chrome trace JSON (chrome://tracing, Perfetto)
+// Usage: ./chesstrace <eventfile> > trace.json
+int main(int argc, char *argv[])
+{
+  if (argc != 2) {
+    fprintf(stderr, "Invalid arguments provided to chesstrace.\nUsage: ./chesstrace <eventfile> > trace.json\n");
+    exit(0);
+  }
+
+  EventFileHeader header;
+  vector<TraceEvent> events;
+  if (!read_events(argv[1], header, events)) {
+    fprintf(stderr, "Error: %s is not an event trace.\n", argv[1]);
+    exit(0);
+  }
+
+  if (header.dropped > 0)
+    fprintf(stderr, "%lld events were overwritten in full ring buffers, the trace starts late for some threads\n", header.dropped);
+
+  print_chrome_trace(header, events);
+  return 0;
+}
+
+bool read_events(const char *fileName, EventFileHeader &header, vector<TraceEvent> &events)
+{
+  ifstream infile(fileName, ios_base::binary);
+  if (!infile.read((char *)&header, sizeof(header)) || memcmp(header.magic, EVENT_FILE_MAGIC, sizeof(header.magic)) != 0 || header.version != EVENT_FILE_VERSION || header.count < 0)
+    return false;
+
+  events.resize(header.count);
+  return header.count == 0 || infile.read((char *)&events[0], header.count * sizeof(TraceEvent));
+}
+
+bool earlier(const TraceEvent &a, const TraceEvent &b)
+{
+  return a.timestamp < b.timestamp;
+}
+
+const char* event_name(char kind)
+{
+  switch (kind) {
+    case 'C': return "create";
+    case 'J': return "join";
+    case 'L': return "lock";
+    case 'U': return "unlock";
+    case 'Y': return "yield";
+    case 'S': return "switch";
+    case 'W': return "cond_wait";
+    case 'N': return "cond_signal";
+    case 'P': return "sem_wait";
+    case 'V': return "sem_post";
+    case 'B': return "barrier";
+  }
+  return "unknown";
+}
+
+// Every thread gets a track with a "running" slice from the switch that handed it
+// the baton to the switch that handed it on, and instant events for its operations
+void print_chrome_trace(EventFileHeader &header, vector<TraceEvent> &events)
+{
+  stable_sort(events.begin(), events.end(), earlier);
+
+  printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+  printf("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"thread 0 (main)\"}}");
+
+  int running = -1;
+  for (size_t i = 0; i < events.size(); i++) {
+    TraceEvent &event = events[i];
+    double ts = (event.timestamp - header.start) / header.ticksPerUs;
+
+    // The first thread to record anything holds the baton from the start
+    if (running < 0) {
+      printf(",\n{\"name\":\"running\",\"ph\":\"B\",\"pid\":1,\"tid\":%d,\"ts\":%.3f}", event.thread, ts);
+      running = event.thread;
+    }
+
+    if (event.kind == 'C')
+      printf(",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%llu,\"args\":{\"name\":\"thread %llu\"}}", event.object, event.object);
+
+    if (event.kind == 'S') {
+      printf(",\n{\"name\":\"running\",\"ph\":\"E\",\"pid\":1,\"tid\":%d,\"ts\":%.3f}", event.thread, ts);
+      printf(",\n{\"name\":\"running\",\"ph\":\"B\",\"pid\":1,\"tid\":%llu,\"ts\":%.3f}", event.object, ts);
+      running = event.object;
+    }
+
+    printf(",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"args\":{\"sync_pt\":%d", event_name(event.kind), event.thread, ts, event.syncPt);
+    if (event.kind == 'L' || event.kind == 'U')
+      printf(",\"mutex\":\"0x%llx\"", event.object);
+    else if (strchr("WNPVB", event.kind))
+      printf(",\"object\":\"0x%llx\"", event.object);
+    else if (event.kind != 'Y')
+      printf(",\"thread\":%llu", event.object);
+    printf("}}");
+  }
+
+  if (running >= 0 && !events.empty())
+    printf(",\n{\"name\":\"running\",\"ph\":\"E\",\"pid\":1,\"tid\":%d,\"ts\":%.3f}", running, (events.back().timestamp - header.start) / header.ticksPerUs);
+
+  printf("\n]}\n");
+}
@@ -0,0 +1,57 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+
+pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t nonempty = PTHREAD_COND_INITIALIZER;
+int items = 0;
+
+void* consumer(void* arg);
+void* producer(void* arg);
+
+// Consumers wait for an item with "if" instead of "while". Another consumer can
+// take the item between the signal and the wakeup, and a wakeup can be spurious,
+// then the woken consumer finds the queue empty.
+int main()
+{
+    pthread_t thread1, thread2, thread3;
+    pthread_create(&thread1, NULL, consumer, NULL);
+    pthread_create(&thread2, NULL, consumer, NULL);
+    pthread_create(&thread3, NULL, producer, NULL);
+    pthread_join(thread1, NULL);
+    pthread_join(thread2, NULL);
+    pthread_join(thread3, NULL);
+
+    return 0;
+}
+
+void* consumer(void* arg)
+{
+    pthread_mutex_lock(&mutex);
+    if (items == 0)
+        pthread_cond_wait(&nonempty, &mutex);
+    if (items == 0) {
+        puts ("consumer woke up to an empty queue");
+        abort();
+    }
+    items--;
+    puts ("consumed");
+    pthread_mutex_unlock(&mutex);
+    return NULL;
+}
+
+void* producer(void* arg)
+{
+    int i;
+    for (i = 0; i < 2; i++) {
+        pthread_mutex_lock(&mutex);
+        items++;
+        puts ("produced");
+        pthread_cond_signal(&nonempty);
+        pthread_mutex_unlock(&mutex);
+    }
+    return NULL;
+}